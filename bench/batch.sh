@@ -0,0 +1,42 @@
+#!/bin/bash
+# Compile a batch of generated files with 1..N workers and check that the
+# output matches compiling each file on its own.
+#   bench/batch.sh [FILES] [STATEMENTS] [MAX_JOBS]
+
+FILES=${1:-200}
+STATEMENTS=${2:-20000}
+MAX_JOBS=${3:-$(nproc)}
+DIR=bench/batch
+
+make bin/compiler || exit 1
+
+rm -rf $DIR
+mkdir -p $DIR
+for ((f = 0; f < FILES; f++)); do
+    # vary the size so some workers run out early and have to steal
+    awk -v n="$((STATEMENTS / 2 + (f * 7919) % STATEMENTS))" -v seed="$f" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            v = "v" sprintf("%c", 97 + (i + seed) % 26)
+            if (i % 40 == 0) print "while " v " < 100 begin"
+            print v " := " v " + " (i + seed) % 1000 " * count"
+            if (i % 7 == 0) print "print " v
+            if (i % 40 == 39) print "end"
+        }
+        if (n % 40 != 0) print "end"
+    }' > $DIR/in$f.txt
+    bin/compiler -S $DIR/in$f.txt -o $DIR/ref$f.s || exit 1
+    echo "$DIR/in$f.txt $DIR/out$f.s" >> $DIR/manifest
+done
+
+TIMEFORMAT="%R"
+base=""
+for ((jobs = 1; jobs <= MAX_JOBS; jobs++)); do
+    rm -f $DIR/out*.s
+    seconds=$( { time bin/compiler --batch $DIR/manifest -j $jobs > /dev/null || exit 1; } 2>&1 )
+    for ((f = 0; f < FILES; f++)); do
+        cmp -s $DIR/ref$f.s $DIR/out$f.s || { echo "out$f.s differs with -j $jobs"; exit 1; }
+    done
+    [ -z "$base" ] && base=$seconds
+    echo "jobs=$jobs seconds=$seconds speedup=$(awk -v a=$base -v b=$seconds 'BEGIN { printf "%.2f", a / b }')"
+done
+rm -rf $DIR
@@ -0,0 +1,93 @@
+#!/bin/bash
+# Compile generated programs of growing size in four shapes and append the
+# time, heap allocations and peak RSS of each phase to RESULTS, one JSON
+# object per compile, so compile-time regressions show up as the tree grows.
+# It runs bin/compile_bench, bin/compiler built to count allocations. The
+# source is tokenized up front and the parser replays the tokens, so
+# tokenize_seconds is lexing alone, not the lexing a plain compile does
+# inside the parser's loop.
+#   bench/compile_bench.sh [SIZES] [RESULTS]
+# SIZES is a quoted list of statement counts; RESULTS defaults to
+# bench/compile_results.jsonl. OPTS picks the levels, by default "-O0 -O -O2".
+#   flat    a long straight sequence of assignments and prints
+#   nested  ifs and whiles nested SIZE/4 deep
+#   expr    one expression of SIZE operators per statement, for a few statements
+#   vars    SIZE distinct variables, each assigned and read
+
+SIZES=${1:-1000 10000 100000}
+RESULTS=${2:-bench/compile_results.jsonl}
+OPTS=${OPTS:--O0 -O -O2}
+INPUT=bench/compile_input.txt
+OUT=bench/compile_output.s
+
+make bin/compile_bench || exit 1
+
+generate() {
+    awk -v shape="$1" -v n="$2" 'BEGIN {
+        # inside a loop, so -O2 cannot work every value out
+        print "while round < 2 begin"
+        if (shape == "flat") {
+            for (i = 0; i < n; i++) {
+                v = "v" sprintf("%c", 97 + i % 26)
+                if (i % 3 == 0) print v " := " v " + " i % 1000 " * count"
+                else if (i % 3 == 1) print "count := " v " - count / 3"
+                else print "print " v " < count"
+            }
+        }
+        else if (shape == "nested") {
+            depth = int(n / 4)
+            for (i = 0; i < depth; i++) {
+                v = "v" sprintf("%c", 97 + i % 26)
+                if (i % 2 == 0) print "if " v " < " i " begin"
+                else print "while " v " < " i " begin"
+                print v " := " v " + 1"
+            }
+            for (i = depth - 1; i >= 0; i--) {
+                print "print v" sprintf("%c", 97 + i % 26)
+                print "end"
+            }
+        }
+        else if (shape == "expr") {
+            split("+ - * / < =", ops, " ")
+            for (s = 0; s < 4; s++) {
+                line = "v" sprintf("%c", 97 + s) " := a"
+                for (i = 1; i < n / 4; i++) line = line " " ops[1 + i % 6] " " (i % 3 == 0 ? "b" : i % 97 + 1)
+                print line
+                print "print v" sprintf("%c", 97 + s)
+            }
+        }
+        else {
+            for (i = 0; i < n; i++) {
+                v = "v" sprintf("%c%c%c%c", 97 + i % 26, 97 + int(i / 26) % 26, 97 + int(i / 676) % 26, 97 + int(i / 17576) % 26)
+                print v " := " (i % 2 == 0 ? "last + " i % 100 : "last * 3")
+                print "last := " v
+            }
+            print "print last"
+        }
+        print "round := round + 1"
+        print "end"
+    }' > $INPUT
+}
+
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+date=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+status=0
+for shape in flat nested expr vars; do
+    for size in $SIZES; do
+        generate $shape $size
+        for opt in $OPTS; do
+            flags=$([ $opt == -O0 ] || echo $opt)
+            report=$(bin/compile_bench $flags --phase-report -S $INPUT -o $OUT 2>&1 >/dev/null)
+            if [ $? -ne 0 ] || [ "${report:0:1}" != "{" ]; then
+                echo "$shape $size $opt: $report"
+                status=1
+                continue
+            fi
+            line="{\"commit\": \"$commit\", \"date\": \"$date\", \"shape\": \"$shape\", \"size\": $size, ${report:1}"
+            echo "$line" >> $RESULTS
+            echo "$line"
+        done
+    done
+done
+rm -f $INPUT $OUT
+exit $status
@@ -0,0 +1,97 @@
+// Output throughput in MB/s: the assembly of a program written to a file a
+// line at a time with std::endl, as code generation used to, through an
+// ofstream without the flushes, and through AsmEmitter; then generating
+// straight into an AsmEmitter on the file, as bin/compiler does.
+//
+//   bin/emit_bench FILE [OUTPUT]
+
+#include "ast.hpp"
+#include "emitter.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string_view>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{ return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); }
+
+static void report(const char *mode, size_t bytes, double seconds)
+{
+    printf("mode=%s bytes=%zu seconds=%.3f mb_per_sec=%.1f\n",
+           mode, bytes, seconds, bytes / seconds / (1 << 20));
+}
+
+//! Hand text to out a line at a time, the way code generation writes it
+template<class Stream> static void replay(Stream &out, std::string_view text, bool endl)
+{
+    for (size_t start = 0; start < text.size(); ) {
+        size_t end = text.find('\n', start);
+        out.write(text.data() + start, end - start);
+        if (endl) out<<std::endl;
+        else out<<'\n';
+        start = end + 1;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s FILE [OUTPUT]\n", argv[0]);
+        return 1;
+    }
+    const char *output = argc > 2 ? argv[2] : "bench/emit_output.s";
+    FILE *file = fopen(argv[1], "r");
+    if (file == NULL) {
+        fprintf(stderr, "%s could not be opened.\n", argv[1]);
+        return 1;
+    }
+
+    Session session;
+    session.read_file(file);
+    const Node *ast = session.parse();
+    fclose(file);
+
+    AsmEmitter text;
+    auto start = std::chrono::steady_clock::now();
+    {
+        Context context(session.symbols);
+        ast->generate_assembly(text, context);
+    }
+    report("generate", text.text().size(), seconds_since(start));
+
+    for (bool endl : { true, false }) {
+        start = std::chrono::steady_clock::now();
+        {
+            std::ofstream out(output);
+            replay(out, text.text(), endl);
+        }
+        report(endl ? "ofstream_endl" : "ofstream", text.text().size(), seconds_since(start));
+    }
+
+    start = std::chrono::steady_clock::now();
+    int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    {
+        AsmEmitter out(fd);
+        replay(out, text.text(), false);
+        out.finish();
+    }
+    close(fd);
+    report("emitter", text.text().size(), seconds_since(start));
+
+    start = std::chrono::steady_clock::now();
+    fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    {
+        Context context(session.symbols);
+        AsmEmitter out(fd);
+        ast->generate_assembly(out, context);
+        out.finish();
+    }
+    close(fd);
+    report("generate_emitter", text.text().size(), seconds_since(start));
+    unlink(output);
+    return 0;
+}
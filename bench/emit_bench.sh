@@ -0,0 +1,22 @@
+#!/bin/bash
+# Compare ways of writing the generated assembly out, in MB/s.
+#   bench/emit_bench.sh [STATEMENTS]
+
+STATEMENTS=${1:-200000}
+INPUT=bench/emit_input.txt
+
+make bin/emit_bench || exit 1
+
+awk -v n="$STATEMENTS" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        v = "v" sprintf("%c%c", 97 + i % 26, 97 + int(i / 26) % 26)
+        if (i % 5 == 0) print "if " v " < " i % 1000 " begin"
+        else if (i % 5 == 1) print v " := " v " * 3 + " i % 100 " / 7 - count"
+        else if (i % 5 == 2) print "print " v " + 1"
+        else if (i % 5 == 3) print "count := count + 1 = " v
+        else print "end"
+    }
+}' > $INPUT
+
+bin/emit_bench $INPUT
+rm -f $INPUT
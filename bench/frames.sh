@@ -0,0 +1,76 @@
+#!/bin/bash
+# Check that the frame of main is bounded by the temporaries live at once
+# rather than the length of the program, and that a frame past 32KB is
+# still addressed within the 16-bit offsets of lw and sw.
+#   bench/frames.sh [STATEMENTS] [VARIABLES]
+# Set AS to a MIPS assembler, e.g. mips-linux-gnu-as, to assemble the output.
+
+STATEMENTS=${1:-500000}
+VARIABLES=${2:-12000}
+INPUT=bench/frames.txt
+OUT=bench/frames.s
+
+make bin/compiler || exit 1
+
+# every kind of statement, none needing more than a few temporaries
+long() {
+    awk -v n="$1" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            v = "v" sprintf("%c%c", 97 + i % 26, 97 + int(i / 26) % 26)
+            if (i % 5 == 0) print "if " v " < " i % 1000 " begin"
+            else if (i % 5 == 1) print v " := " v " * 3 + " i % 100 " / 7 - count"
+            else if (i % 5 == 2) print "print " v " + 1"
+            else if (i % 5 == 3) print "count := count + 1 = " v
+            else print "end"
+        }
+    }' > $INPUT
+}
+
+# every variable live across a loop, so -O2 spills most of them
+wide() {
+    awk -v n="$1" 'function name(i) {
+            return "v" sprintf("%c%c%c", 97 + i % 26, 97 + int(i / 26) % 26, 97 + int(i / 676) % 26)
+        }
+        BEGIN {
+            for (i = 0; i < n; i++) print name(i) " := " i
+            print "while count < 3 begin"
+            for (i = 0; i < n; i++) print name(i) " := " name(i) " + " name((i + 1) % n)
+            print "count := count + 1"
+            print "end"
+            for (i = 0; i < n; i += 100) print "print " name(i)
+        }' > $INPUT
+}
+
+# compile with the given options and print the frame size, or fail on an
+# offset from $fp or $sp that does not fit in 16 bits
+frame() {
+    bin/compiler "$@" -S $INPUT -o $OUT || return 1
+    if [ -n "$AS" ]; then
+        $AS -mips32 -o /dev/null $OUT || return 1
+    fi
+    awk '/^\t\.frame/ { split($2, f, ","); frame = f[2] }
+         /\(\$(fp|sp)\)/ { split($2, a, ","); o = a[2] + 0; if (o < -32768 || o > 32767) { print "offset out of range: " $0; exit 1 } }
+         END { print frame }' $OUT
+}
+
+TIMEFORMAT="%R"
+status=0
+for opt in -O0 -O; do
+    flags=$([ $opt == -O0 ] || echo $opt)
+    long $((STATEMENTS / 10))
+    small=$(frame $flags) || { echo "$opt: $small"; status=1; continue; }
+    long $STATEMENTS
+    seconds=$( { time frame $flags > bench/frames.out; } 2>&1 ) || { cat bench/frames.out; status=1; continue; }
+    large=$(cat bench/frames.out)
+    echo "$opt: $((STATEMENTS / 10)) statements frame=$small, $STATEMENTS statements frame=$large seconds=$seconds"
+    [ "$small" == "$large" ] || { echo "    frame grows with the program"; status=1; }
+done
+
+wide $VARIABLES
+for opt in -O0 -O -O2; do
+    flags=$([ $opt == -O0 ] || echo $opt)
+    size=$(frame $flags) || { echo "$opt: $size"; status=1; continue; }
+    echo "$opt: $VARIABLES variables live across a loop frame=$size"
+done
+rm -f $INPUT $OUT bench/frames.out
+exit $status
@@ -0,0 +1,69 @@
+// Lexer throughput: tokens per second, peak RSS and heap allocations for
+// the stream (FILE*) path and the memory-mapped path.
+//
+//   bin/lex_bench [--mmap] FILE
+//
+// Run each mode in its own process so peak RSS is not shared.
+
+#include "ast.hpp"
+#include "../src/parser.tab.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <sys/resource.h>
+
+static unsigned long allocations = 0;
+
+void *operator new(size_t size)
+{
+    allocations++;
+    if (void *p = malloc(size)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{ free(p); }
+
+void operator delete(void *p, size_t) noexcept
+{ free(p); }
+
+int main(int argc, char *argv[])
+{
+    bool use_mmap = argc > 2 && strcmp(argv[1],"--mmap")==0;
+    const char *path = argv[argc-1];
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s [--mmap] FILE\n", argv[0]);
+        return 1;
+    }
+
+    Session session;
+    MappedSource *source = nullptr;
+    FILE *file = nullptr;
+    if (use_mmap) {
+        source = new MappedSource(path);
+        session.read_mapped(*source);
+    } else if ((file = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "%s could not be opened.\n", path);
+        return 1;
+    } else {
+        session.read_file(file);
+    }
+
+    unsigned long before = allocations, tokens = 0;
+    auto start = std::chrono::steady_clock::now();
+    YYSTYPE lval;
+    while (yylex(&lval, session.lexer()) != 0) tokens++;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("mode=%s tokens=%lu seconds=%.3f tokens_per_sec=%.0f peak_rss_kb=%ld allocations=%lu\n",
+           use_mmap ? "mmap" : "flex", tokens, seconds, tokens / seconds,
+           usage.ru_maxrss, allocations - before);
+    delete source;
+    return 0;
+}
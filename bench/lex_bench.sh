@@ -0,0 +1,23 @@
+#!/bin/bash
+# Compare the stream and memory-mapped lexer on a generated source file.
+#   bench/lex_bench.sh [STATEMENTS]
+
+STATEMENTS=${1:-2000000}
+INPUT=bench/lex_input.txt
+
+make bin/lex_bench || exit 1
+
+awk -v n="$STATEMENTS" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        v = "var" sprintf("%c%c", 97 + i % 26, 97 + int(i / 26) % 26)
+        if (i % 50 == 0) print "while " v " < 100 begin"
+        print v " := " v " + " i % 1000 " * count"
+        if (i % 7 == 0) print "print " v
+        if (i % 50 == 49) print "end"
+    }
+}' > $INPUT
+
+ls -l $INPUT
+bin/lex_bench $INPUT
+bin/lex_bench --mmap $INPUT
+rm -f $INPUT
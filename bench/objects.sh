@@ -0,0 +1,67 @@
+#!/bin/bash
+# Check bin/compiler -c against an assembler given the -S text of the same
+# program: the disassembly, relocations and data of the two objects must
+# match, big- and little-endian. Then time -c against -S plus the assembler
+# on a long program, whose branches no longer reach across it.
+#   bench/objects.sh [STATEMENTS]
+# AS and ASEL default to llvm-mc; e.g. AS="mips-linux-gnu-as -EB -KPIC"
+# and ASEL="mips-linux-gnu-as -EL -KPIC" check against the GNU assembler.
+
+STATEMENTS=${1:-20000}
+AS=${AS:-llvm-mc -triple=mips-linux-gnu -position-independent -filetype=obj}
+ASEL=${ASEL:-llvm-mc -triple=mipsel-linux-gnu -position-independent -filetype=obj}
+OBJDUMP=${OBJDUMP:-llvm-objdump}
+INPUT=bench/objects.txt
+
+make bin/compiler || exit 1
+
+# what both objects hold, named the same whichever assembler made them
+contents() {
+    $OBJDUMP -d -r -s -j .text -j .data -j .rdata -j .rodata $1 | sed -e 1,2d -e 's/\.rodata/.rdata/'
+}
+
+status=0
+checked=0
+for source in test/*/*.txt; do
+    [ $(basename $source) == MIPS.txt ] && continue
+    for opt in -O0 -O -O2 --stream --printf; do
+        flags=$([ $opt == -O0 ] || echo $opt)
+        bin/compiler $flags -S $source -o bench/objects.s || { status=1; continue; }
+        for endian in EB EL; do
+            as=$([ $endian == EB ] && echo "$AS" || echo "$ASEL")
+            $as -o bench/objects_as.o bench/objects.s || { status=1; continue; }
+            bin/compiler $flags -c -$endian -S $source -o bench/objects.o || { status=1; continue; }
+            if ! diff <(contents bench/objects_as.o) <(contents bench/objects.o) > bench/objects.diff; then
+                echo "$source $opt -$endian: objects differ"
+                head -20 bench/objects.diff
+                status=1
+            fi
+            checked=$((checked + 1))
+        done
+    done
+done
+echo "$checked objects match"
+
+awk -v n="$STATEMENTS" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        v = "v" sprintf("%c%c", 97 + i % 26, 97 + int(i / 26) % 26)
+        if (i % 5 == 0) print "if " v " < " i % 1000 " begin"
+        else if (i % 5 == 1) print v " := " v " * 3 + " i % 100 " / 7 - count"
+        else if (i % 5 == 2) print "print " v " + 1"
+        else if (i % 5 == 3) print "count := count + 1 = " v
+        else print "end"
+    }
+}' > $INPUT
+
+TIMEFORMAT="%R"
+for opt in -O0 -O -O2; do
+    flags=$([ $opt == -O0 ] || echo $opt)
+    text=$( { time bin/compiler $flags -S $INPUT -o bench/objects.s; } 2>&1 ) || { status=1; continue; }
+    object=$( { time bin/compiler $flags -c -S $INPUT -o bench/objects.o; } 2>&1 ) || { status=1; continue; }
+    rm -f bench/objects_as.o
+    assembled=$( { time $AS -o bench/objects_as.o bench/objects.s 2> /dev/null; } 2>&1 )
+    [ -s bench/objects_as.o ] || assembled="$assembled (failed)"
+    echo "$opt: $STATEMENTS statements -S seconds=$text -c seconds=$object assembler seconds=$assembled bytes=$(stat -c %s bench/objects.o)"
+done
+rm -f $INPUT bench/objects.s bench/objects.o bench/objects_as.o bench/objects.diff
+exit $status
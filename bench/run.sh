@@ -0,0 +1,93 @@
+#!/bin/bash
+# Check bin/compiler --run against the cREF.c programs in test/* and,
+# as an oracle for the IR passes, --run against --run -O2 on loop-heavy
+# programs. Then time those programs under --run against their C
+# equivalents built with cc -O0.
+#   bench/run.sh [SCALE]
+# SCALE multiplies the trip counts of the loops.
+
+SCALE=${1:-1}
+CC=${CC:-cc}
+DIR=bench/run
+
+make bin/compiler || exit 1
+rm -rf $DIR
+mkdir -p $DIR
+
+status=0
+for dir in test/*/; do
+    source=$(ls $dir*.txt | grep -v MIPS.txt)
+    $CC -w -O0 -o $DIR/ref $dir/cREF.c || { status=1; continue; }
+    if ! diff <(./$DIR/ref) <(bin/compiler --run -S $source) > $DIR/diff; then
+        echo "$source: --run differs from $dir""cREF.c"
+        head -20 $DIR/diff
+        status=1
+    fi
+done
+
+# each kernel in this language, then in C; N is the trip count
+kernel() {
+    case $1 in
+    count)
+        echo "i := 0 s := 0
+while i < $2 begin s := s + i * 7 / 3 i := i + 1 end
+print s" > $DIR/count.txt
+        echo "#include <stdio.h>
+int main() { int i = 0, s = 0;
+while (i < $2) { s = s + i * 7 / 3; i = i + 1; }
+printf(\"%d\n\", s); return 0; }" > $DIR/count.c ;;
+    nested)
+        echo "i := 0 c := 0
+while i < $2 begin
+    j := 0
+    while j < 1000 begin
+        if j < i begin c := c + j else c := c - 1 end
+        j := j + 1
+    end
+    i := i + 1
+end
+print c" > $DIR/nested.txt
+        echo "#include <stdio.h>
+int main() { int i = 0, j, c = 0;
+while (i < $2) { j = 0;
+    while (j < 1000) { if (j < i) c = c + j; else c = c - 1; j = j + 1; }
+    i = i + 1; }
+printf(\"%d\n\", c); return 0; }" > $DIR/nested.c ;;
+    collatz)
+        echo "n := 1 total := 0
+while n < $2 begin
+    x := n
+    while 1 < x begin
+        if x - x / 2 * 2 = 0 begin x := x / 2 else x := 3 * x + 1 end
+        total := total + 1
+    end
+    n := n + 1
+end
+print total" > $DIR/collatz.txt
+        echo "#include <stdio.h>
+int main() { int n = 1, x, total = 0;
+while (n < $2) { x = n;
+    while (1 < x) { if (x - x / 2 * 2 == 0) x = x / 2; else x = 3 * x + 1; total = total + 1; }
+    n = n + 1; }
+printf(\"%d\n\", total); return 0; }" > $DIR/collatz.c ;;
+    esac
+}
+
+TIMEFORMAT="%R"
+for spec in count:$((100000000 * SCALE)) nested:$((100000 * SCALE)) collatz:$((300000 * SCALE)); do
+    name=${spec%%:*}
+    kernel $name ${spec#*:}
+    $CC -w -O0 -o $DIR/$name $DIR/$name.c || { status=1; continue; }
+    native=$( { time ./$DIR/$name > $DIR/native.out; } 2>&1 )
+    for opt in -O0 -O2; do
+        flags=$([ $opt == -O0 ] || echo $opt)
+        run=$( { time bin/compiler $flags --run -S $DIR/$name.txt -o $DIR/run.out; } 2>&1 )
+        if ! cmp -s $DIR/native.out $DIR/run.out; then
+            echo "$name $opt: --run printed $(cat $DIR/run.out), the C program $(cat $DIR/native.out)"
+            status=1
+        fi
+        echo "$name $opt: --run seconds=$run cc -O0 seconds=$native ratio=$(awk -v a=$run -v b=$native 'BEGIN { printf "%.2f", a / b }')"
+    done
+done
+rm -rf $DIR
+exit $status
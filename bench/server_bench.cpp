@@ -0,0 +1,83 @@
+// Requests per second and latency percentiles of the compile server
+// against starting a process per file.
+//
+//   bin/server_bench MODE REQUESTS FILE...
+//
+//   exec     fork/exec bin/compiler -S FILE -o OUT for every request
+//   client   fork/exec bin/compiler_client, i.e. the drop-in CLI
+//   socket   send every request down one connection to the server
+//
+// The client and socket modes need `bin/compiler --server` to be running.
+
+#include "protocol.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static bool spawn_compile(const char *program, const char *source, const char *out)
+{
+    const char *argv[] = { program, "-S", source, "-o", out, nullptr };
+    pid_t pid;
+    if (posix_spawn(&pid, program, nullptr, nullptr, const_cast<char **>(argv), environ) != 0) return false;
+    int status;
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s exec|client|socket REQUESTS FILE...\n", argv[0]);
+        return 1;
+    }
+    std::string mode = argv[1];
+    unsigned requests = atoi(argv[2]);
+    std::vector<std::string> files(argv + 3, argv + argc);
+    const char *out = "bench/server_bench.s";
+
+    int fd = -1;
+    if (mode == "socket" && (fd = connect_server(server_socket_path())) < 0) {
+        fprintf(stderr, "no server listening on %s\n", server_socket_path());
+        return 1;
+    }
+
+    std::vector<double> latencies;
+    std::string body;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < requests; i++) {
+        const std::string &file = files[i % files.size()];
+        auto begin = std::chrono::steady_clock::now();
+        bool ok;
+        if (mode == "exec") ok = spawn_compile("bin/compiler", file.c_str(), out);
+        else if (mode == "client") ok = spawn_compile("bin/compiler_client", file.c_str(), out);
+        else {
+            char path[PATH_MAX];
+            ok = realpath(file.c_str(), path) != nullptr && send_request(fd, true, "", file, path)
+                && read_reply(fd, ok, body) && ok;
+        }
+        if (!ok) {
+            fprintf(stderr, "request %u (%s) failed\n", i, file.c_str());
+            return 1;
+        }
+        latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count());
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (fd >= 0) close(fd);
+    remove(out);
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) { return latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))]; };
+    printf("mode=%s requests=%u seconds=%.3f req_per_sec=%.0f p50_us=%.0f p99_us=%.0f\n",
+           mode.c_str(), requests, seconds, requests / seconds, percentile(0.50), percentile(0.99));
+    return 0;
+}
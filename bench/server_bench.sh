@@ -0,0 +1,19 @@
+#!/bin/bash
+# Compare a process per compile with the compile server on small inputs.
+#   bench/server_bench.sh [REQUESTS]
+
+REQUESTS=${1:-5000}
+SOCKET_DIR=$(mktemp -d)
+export COMPILER_SOCKET=$SOCKET_DIR/compiler.sock
+
+make bin/compiler bin/compiler_client bin/server_bench || exit 1
+
+bin/compiler --server -j 1 &
+SERVER=$!
+trap "kill $SERVER; rm -rf $SOCKET_DIR" EXIT
+while [ ! -S $COMPILER_SOCKET ]; do sleep 0.1; done
+
+FILES="test/IF/if.txt test/IFELSE/if_else.txt test/MIXED/mixed.txt test/PRINT/print.txt test/WHILE/while.txt"
+for mode in exec client socket; do
+    bin/server_bench $mode $REQUESTS $FILES || exit 1
+done
@@ -0,0 +1,32 @@
+#!/bin/bash
+# Compile programs that are very long and very deeply nested. Neither
+# should depend on the native stack size.
+#   bench/stress.sh [STATEMENTS] [DEPTH]
+
+STATEMENTS=${1:-1000000}
+DEPTH=${2:-10000}
+FLAT=bench/stress_flat.txt
+NESTED=bench/stress_nested.txt
+
+make bin/compiler || exit 1
+
+awk -v n="$STATEMENTS" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        if (i % 3 == 0) print "x := x + " i % 100
+        else if (i % 3 == 1) print "y := x * 2 < y"
+        else print "print y"
+    }
+}' > $FLAT
+
+awk -v n="$DEPTH" 'BEGIN {
+    for (i = 0; i < n; i++) print (i % 2 ? "if x begin" : "while x < 10 begin")
+    print "x := x + 1"
+    for (i = 0; i < n; i++) print "end"
+}' > $NESTED
+
+TIMEFORMAT="    %Rs"
+for input in $FLAT $NESTED; do
+    echo "$input: $(wc -l < $input) lines"
+    time bin/compiler -S $input -o /dev/null || exit 1
+done
+rm -f $FLAT $NESTED
@@ -0,0 +1,34 @@
+#!/bin/bash
+# Run each program in test/* natively, compiled with --target=x86_64 at
+# every optimization level, and diff what it prints against its cREF.c
+# built with the host compiler.
+#   bench/x86_64.sh
+# CC defaults to cc and both assembles our output and builds the references.
+
+CC=${CC:-cc}
+OUT=bench/x86_64
+
+make bin/compiler || exit 1
+
+status=0
+checked=0
+for dir in test/*/; do
+    source=$(ls $dir*.txt | grep -v MIPS.txt)
+    $CC -w -o $OUT.ref $dir/cREF.c || { status=1; continue; }
+    ./$OUT.ref > $OUT.want
+    for opt in -O0 -O -O2; do
+        flags=$([ $opt == -O0 ] || echo $opt)
+        bin/compiler $flags --target=x86_64 -S $source -o $OUT.s || { status=1; continue; }
+        $CC -o $OUT $OUT.s || { status=1; continue; }
+        ./$OUT > $OUT.got
+        if ! diff $OUT.want $OUT.got > $OUT.diff; then
+            echo "$source $opt: output differs from $dir""cREF.c"
+            head -20 $OUT.diff
+            status=1
+        fi
+        checked=$((checked + 1))
+    done
+done
+echo "$checked programs checked"
+rm -f $OUT $OUT.ref $OUT.s $OUT.want $OUT.got $OUT.diff
+exit $status
@@ -5,11 +5,9 @@
 #include "ast/decl.hpp"
 #include "ast/operations.hpp"
 #include "ast/statement.hpp"
+#include "source.hpp"
 
-
-extern const Node *parseAST();
-extern FILE *yyin;
-extern FILE *yyout;
+#include "session.hpp"
 
 
 ////OLD STUFF///////
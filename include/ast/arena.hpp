@@ -0,0 +1,97 @@
+#ifndef arena_hpp
+#define arena_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+//! Bump allocator the AST is built in. Nodes are never freed one by one;
+//! the whole tree goes away with release() once code has been generated.
+class Arena
+{
+private:
+    static const size_t block_size = 64 * 1024;
+
+    struct Block
+    {
+        char *data;
+        size_t size;
+    };
+
+    std::vector<Block> blocks;
+    size_t active = 0; //blocks handed out since the last reset
+    char *cursor = nullptr;
+    char *limit = nullptr;
+    size_t used = 0;
+
+    static char *align_up(char *p, size_t align)
+    { return reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(p) + align - 1) & ~(uintptr_t)(align - 1)); }
+
+    void grow(size_t size)
+    {
+        //reuse blocks kept by reset() before asking for more memory
+        while (active < blocks.size()) {
+            Block &block = blocks[active++];
+            if (block.size >= size) {
+                cursor = block.data;
+                limit = block.data + block.size;
+                return;
+            }
+        }
+
+        size_t bytes = size > block_size ? size : block_size;
+        char *data = static_cast<char *>(malloc(bytes));
+        if (data == nullptr) throw std::bad_alloc();
+        blocks.push_back(Block{data, bytes});
+        active = blocks.size();
+        cursor = data;
+        limit = data + bytes;
+    }
+
+public:
+    Arena() = default;
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena()
+    { release(); }
+
+    void *allocate(size_t size, size_t align = alignof(std::max_align_t))
+    {
+        char *p = align_up(cursor, align);
+        if (cursor == nullptr || p + size > limit) {
+            grow(size + align);
+            p = align_up(cursor, align);
+        }
+        cursor = p + size;
+        used += size;
+        return p;
+    }
+
+    template<class T>
+    T *allocate_array(size_t count)
+    { return static_cast<T *>(allocate(count * sizeof(T), alignof(T))); }
+
+    //! Free every block at once
+    void release()
+    {
+        for (const Block &block : blocks) free(block.data);
+        blocks.clear();
+        reset();
+    }
+
+    //! Forget everything allocated but keep the blocks for reuse
+    void reset()
+    {
+        active = 0;
+        cursor = limit = nullptr;
+        used = 0;
+    }
+
+    size_t bytes_used() const
+    { return used; }
+};
+
+#endif
@@ -1,6 +1,11 @@
 #ifndef base_hpp
 #define base_hpp
 
+#include "arena.hpp"
+#include "symbols.hpp"
+#include "registers.hpp"
+
+#include <algorithm>
 #include <string>
 #include <iostream>
 #include <map>
@@ -9,38 +14,101 @@
 #include <sstream>
 
 #include <memory>
-#include <regex>
 
 class Node;
 class Context;
+class CodegenStack;
+struct Task;
 
 typedef const Node *NodePtr;
-static const std::regex reNum("^-?[0-9]+$");
-static const std::regex reId("^[a-z][a-z0-9]*$");
-
-static int NameUnq=0;
-static std::vector<std::string> FnTracker;
 
-static std::string make_name(std::string base)
+//! Concrete type of a node, so passes can switch on it without dynamic_cast
+enum class NodeKind : unsigned char
 {
-    return "$"+base+std::to_string(NameUnq++);
-}
+    Variable, Number, ExprList,
+    Add, Sub, Mul, Div, Equals, Less, Assign,
+    Print, Compound, Sequence, Stat, If, IfElse, While, Program,
+    Parameter, ParameterList, DeclList, VariableDecl, InitParams,
+    GlobalDeclList, GlobalDeclList2, GlobalInitParams
+};
 
 class Node
 {
 public:
-    static std::vector<std::string>& getGlobals()  { static std::vector<std::string> globals; return globals; }
-    static std::vector<std::string>& getGlobalsArray()  { static std::vector<std::string> globals; return globals; }
-    static std::stringstream& getGlobalDec()  { static std::stringstream global; return global; }
-    static bool& getRData()  { static bool has_r; return has_r; }
+    const NodeKind kind;
+
+    Node(NodeKind _kind)
+        : kind(_kind)
+    {}
+
+    //nodes live in the arena and are released together after codegen
+    static void *operator new(size_t size, Arena &arena) { return arena.allocate(size); }
+    static void operator delete(void *, Arena &) {}
+    static void operator delete(void *) {}
+    static void *operator new(size_t size) = delete;
+
     virtual ~Node()
     {}
 
     //! Generate the mips code to the given stream
-    virtual void generate_assembly(std::ostream &dst, Context &context) const
+    virtual void generate_assembly(std::ostream &dst, Context &context) const;
+
+    //! Emit the code for one phase of this node. Instead of recursing, a
+    //! node that needs a child's code pushes its own next phase and then
+    //! the child onto the stack.
+    virtual void generate_step(std::ostream &dst, Context &context, CodegenStack &stack, const Task &task) const
     { throw std::runtime_error("Not implemented yet"); }
 };
 
+//! A pending phase of a node's code generation
+struct Task
+{
+    NodePtr node;
+    unsigned phase;
+    int saved; //value kept between phases, e.g. the slot of a left operand
+};
+
+//! Explicit work stack driving code generation, so the native stack depth
+//! does not depend on the length or nesting of the program
+class CodegenStack
+{
+private:
+    std::vector<Task> tasks;
+public:
+    void push(NodePtr node, unsigned phase = 0, int saved = 0) {
+        tasks.push_back(Task{node, phase, saved});
+    }
+
+    void run(std::ostream &dst, Context &context) {
+        while (!tasks.empty()) {
+            Task task = tasks.back();
+            tasks.pop_back();
+            task.node->generate_step(dst, context, *this, task);
+        }
+    }
+};
+
+inline void Node::generate_assembly(std::ostream &dst, Context &context) const
+{
+    CodegenStack stack;
+    stack.push(this);
+    stack.run(dst, context);
+}
+
+//! Emit op reg,offset($fp). Offsets past the 16 bits an instruction holds
+//! are added to $fp in $3 first, which nothing else keeps a value in.
+inline void frame_access(std::ostream &dst, const char *op, const std::string &reg, int offset)
+{
+    if (offset >= -32768 && offset <= 32767) {
+        dst<<"\t"<<op<<"\t"<<reg<<","<<offset<<"($fp)\n";
+        return;
+    }
+    int high = (offset + 0x8000) >> 16;
+    dst<<"\tlui\t$3,"<<high<<"\n";
+    dst<<"\taddu\t$3,$3,$fp\n";
+    dst<<"\t"<<op<<"\t"<<reg<<","<<offset - high * 65536<<"($3)\n";
+}
+
 
 
 
@@ -48,90 +116,130 @@ class Context {
 private:
     unsigned int _size = 52;
     int current_mem = -4;
+    int peak_mem = -4; //highest current_mem reached, which sizes the frame
     int current_register = -1;
-    std::unordered_map<std::string,unsigned int> bindings;
-    std::unordered_map<std::string,std::string> types;
-    std::unordered_map<std::string,std::pair<std::string,unsigned int> > Arrtypes;
-    std::unordered_map<std::string,unsigned int> functions;
-    std::vector<std::string> declarations;
+    ScopedBindings own_bindings;
+    ScopedBindings *bindings;
+    size_t scope_mark;
+    unsigned int depth;
+    std::unordered_map<Symbol,std::string> types;
+    std::unordered_map<Symbol,std::pair<std::string,unsigned int> > Arrtypes;
+    std::unordered_map<Symbol,unsigned int> functions;
+    std::vector<Symbol> declarations;
+    Symbols &symbol_table;
+    unsigned int label_count = 0;
+    RegisterAllocation *allocation = nullptr;
+    bool printf_calls = false;
     Context* parent;
+
+    const std::string &name(Symbol key) const {
+        return symbol_table.name(key);
+    }
 public:
     bool is_first_global = true;
     bool is_first_global_ptr = true;
     bool is_first_text = true;
 
+    //the outermost scope of a compilation
+    Context(Symbols &_symbols)
+        : bindings(&own_bindings),
+        scope_mark(0),
+        depth(0),
+        symbol_table(_symbols),
+        parent(nullptr)
+    {}
+
+    //a child scope binds into its parent's table and restores it on exit
     Context(Context* _parent)
-        : parent(_parent)
+        : bindings(_parent->bindings),
+        scope_mark(bindings->mark()),
+        depth(_parent->depth+1),
+        symbol_table(_parent->symbol_table),
+        allocation(_parent->allocation),
+        printf_calls(_parent->printf_calls),
+        parent(_parent)
     {
-        if(_parent != NULL) current_mem = (*_parent).mem_init();
+        current_mem = (*_parent).mem_init();
+        peak_mem = current_mem;
     }
 
-    unsigned int set_binding(std::string key, std::string reg, std::ostream &dst, int offset) {
+    Context(const Context&) = delete;
+    Context& operator=(const Context&) = delete;
+
+    ~Context() {
+        bindings->restore(scope_mark);
+    }
+
+    void set_binding(Symbol key, const std::string &reg, std::ostream &dst, int offset) {
         int address = get_binding(key);
-        if (address < 0) { //global
-            dst<<"\tla\t$t0,"<<key<<std::endl;
-            dst<<"\tsw\t$"<<reg<<",0($t0)"<<std::endl;
+        int home = register_of(key);
+        if (home >= 0) {
+            dst<<"\tmove\t$s"<<home<<",$"<<reg<<"\n";
+            allocation->assign(key);
+        } else if (address < 0) { //global
+            global_access(dst, symbol_table, "sw", "$"+reg, key);
         } else {
-            dst<<"\tsw\t$"<<reg<<","<<get_binding(key)+offset<<"($fp)"<<std::endl;
+            frame_access(dst, "sw", "$"+reg, address+offset);
         }
     }
 
-    void load_binding(std::string key, std::string reg, std::ostream &dst, int offset) {
+    void load_binding(Symbol key, const std::string &reg, std::ostream &dst, int offset) {
         int address = get_binding(key);
-        if (address < 0) { //global
-            dst<<"\tla\t$t0,"<<key<<std::endl;
-            dst<<"\tlw\t$"<<reg<<","<<offset<<"($t0)"<<std::endl;
+        int home = register_of(key);
+        if (home >= 0) {
+            dst<<"\tmove\t$"<<reg<<",$s"<<home<<"\n";
+        } else if (address < 0) { //global
+            global_access(dst, symbol_table, "lw", "$"+reg, key, offset);
         } else {
-            dst<<"\tlw\t$"<<reg<<","<<get_binding(key)+offset<<"($fp)"<<std::endl;
+            frame_access(dst, "lw", "$"+reg, address+offset);
         }
     }
 
-    void load_array(std::string key, std::string reg, std::ostream &dst) {
+    void load_array(Symbol key, const std::string &reg, std::ostream &dst) {
         int address = get_binding(key);
         if (address < 0) { //global
-            dst<<"\tlw\t$s2,%got("<<key<<")($28)"<<std::endl;
-            dst<<"\taddu\t$"<<reg<<",$s1,$s2"<<std::endl;
+            dst<<"\tlw\t$s2,%got("<<name(key)<<")($28)\n";
+            dst<<"\taddu\t$"<<reg<<",$s1,$s2\n";
         } else {
-            dst<<"\tli\t$s2,"<<get_binding(key)<<std::endl;
-            dst<<"\taddu\t$"<<reg<<",$s1,$s2"<<std::endl;
-            dst<<"\taddu\t$"<<reg<<",$fp,$t0"<<std::endl;
+            dst<<"\tli\t$s2,"<<address<<"\n";
+            dst<<"\taddu\t$"<<reg<<",$s1,$s2\n";
+            dst<<"\taddu\t$"<<reg<<",$fp,$t0\n";
         }
     }
 
-    void add_declaration(std::string id) {
+    void add_declaration(Symbol id) {
         declarations.push_back(id);
     }
 
-    int get_binding(std::string key) {
-        std::unordered_map<std::string,unsigned int>::iterator it = bindings.find(key);
+    int get_binding(Symbol key) const {
+        int address = bindings->lookup(key);
 
-        if (it == bindings.end()) {
-            if (parent != nullptr) return parent->get_binding(key);
-            else if (std::find(Node::getGlobals().begin(), Node::getGlobals().end(),key) != Node::getGlobals().end()) return -1;
-            else if (std::find(Node::getGlobalsArray().begin(), Node::getGlobalsArray().end(),key) != Node::getGlobalsArray().end()) return -1;
-            else throw std::runtime_error("error: '" + key + "' undeclared");
-        } else return it->second;
+        if (address != ScopedBindings::unbound) return address;
+
+        //variables are declared on first use and all have global scope
+        symbol_table.set_global(key);
+        return -1;
     }
 
-    std::string get_type(std::string key) const {
+    std::string get_type(Symbol key) const {
         auto it = types.find(key);
 
         if (it == types.end()) {
             if (parent != nullptr) return parent->get_type(key);
-            else throw std::runtime_error("error: '" + key + "' undeclared");
+            else throw std::runtime_error("error: '" + name(key) + "' undeclared");
         } else return it->second;
     }
 
-    std::string get_arr_type(std::string key) {
-        std::unordered_map<std::string,std::pair<std::string,unsigned int> >::iterator it = Arrtypes.find(key);
+    std::string get_arr_type(Symbol key) const {
+        auto it = Arrtypes.find(key);
 
         if (it == Arrtypes.end()) {
             if (parent != nullptr) return parent->get_arr_type(key);
-            else throw std::runtime_error("error: '" + key + "' undeclared");
+            else throw std::runtime_error("error: '" + name(key) + "' undeclared");
         } else return it->second.first; //get the type within the pair
     }
 
-    unsigned int get_size_bind(std::string const& key) const {
+    unsigned int get_size_bind(Symbol key) const {
         unsigned int size = get_size(get_type(key));
         if (size != 0) return size;
         else return get_arr_size(key);
@@ -144,50 +252,50 @@ public:
         else return 0;
     }
 
-    unsigned int get_arr_size (std::string const& key) const {
+    unsigned int get_arr_size (Symbol key) const {
         auto it = Arrtypes.find(key);
 
         if (it == Arrtypes.end()) {
             if (parent != nullptr) return parent->get_arr_size(key);
-            else throw std::runtime_error("error: '" + key + "' undeclared");
+            else throw std::runtime_error("error: '" + name(key) + "' undeclared");
         } else return it->second.second; //get the size within the pair
     }
 
-    unsigned int get_function(std::string key) {
-        if (parent != nullptr) parent->get_function(key);
-    }
+    unsigned int get_function(Symbol key) const {
+        auto it = functions.find(key);
 
-    void add_binding(std::string type, std::string key) {
+        if (it != functions.end()) return it->second;
+        else if (parent != nullptr) return parent->get_function(key);
+        else throw std::runtime_error("error: '" + name(key) + "' undeclared");
+    }
 
-        std::unordered_map<std::string,unsigned int>::iterator it = bindings.find(key);
+    void add_binding(const std::string &type, Symbol key) {
 
-        if (it == bindings.end()) {
-            bindings[key] = _size;
+        if (!bindings->bound_at(key, depth)) {
+            bindings->bind(key, _size, depth);
             _size += 4;
 
             types[key] = type;
-        } else throw std::runtime_error("redefinition of '"+key+"'");
+        } else throw std::runtime_error("redefinition of '"+name(key)+"'");
     }
 
-    void add_arr_binding(std::string type, std::string key, unsigned int size) {
+    void add_arr_binding(const std::string &type, Symbol key, unsigned int size) {
 
-        std::unordered_map<std::string,unsigned int>::iterator it = bindings.find(key);
-
-        if (it == bindings.end()) {
-            bindings[key] = _size;
+        if (!bindings->bound_at(key, depth)) {
+            bindings->bind(key, _size, depth);
             _size += size*get_size(type);
 
             Arrtypes[key] = std::make_pair(type, size);
-        } else throw std::runtime_error("redefinition of '"+key+"'");
+        } else throw std::runtime_error("redefinition of '"+name(key)+"'");
     }
 
-    void add_arr_type(std::string type, std::string key, unsigned int size) {
+    void add_arr_type(const std::string &type, Symbol key, unsigned int size) {
         Arrtypes[key] = std::make_pair(type, size);
     }
 
-    void add_function(std::string key, unsigned int param_num) {
+    void add_function(Symbol key, unsigned int param_num) {
 
-        std::unordered_map<std::string,unsigned int>::iterator it = functions.find(key);
+        auto it = functions.find(key);
         auto dec = std::find(declarations.begin(), declarations.end(), key);
 
         if (it == functions.end() || dec != declarations.end()) {
@@ -195,11 +303,44 @@ public:
             if (dec != declarations.end()) {
                 declarations.erase(dec);
             }
-        } else throw std::runtime_error("conflicting types for ‘"+key+"’");
+        } else throw std::runtime_error("conflicting types for ‘"+name(key)+"’");
+    }
+
+    Symbols &symbols() const {
+        return symbol_table;
+    }
+
+    //! Set for optimized code, where some variables live in $s registers
+    void set_registers(RegisterAllocation *_allocation) {
+        allocation = _allocation;
+    }
+
+    //! Print through printf rather than the runtime in runtime.hpp
+    void set_printf(bool _printf_calls) {
+        printf_calls = _printf_calls;
+    }
+
+    bool calls_printf() const {
+        return printf_calls;
+    }
+
+    RegisterAllocation *registers() const {
+        return allocation;
+    }
+
+    //! n of the $sn holding a global, or -1 if it is in memory
+    int register_of(Symbol key) const {
+        return allocation != nullptr ? allocation->register_of(key) : -1;
+    }
+
+    //labels are numbered per compilation, shared by all scopes
+    unsigned int next_label() {
+        if (parent != nullptr) return parent->next_label();
+        return label_count++;
     }
 
     unsigned int size() {
-        return _size+current_mem+4;
+        return _size+peak_mem+4;
     }
 
     int next_register() {
@@ -220,11 +361,19 @@ public:
         current_register = -1;
     }
 
+    //! Temporaries are allocated like a stack: a slot is taken when a
+    //! value is stored and handed out again once it has been read back
     int next_mem() {
         current_mem = current_mem + 4;
+        peak_mem = std::max(peak_mem, current_mem);
         return _size+current_mem;
     }
 
+    //! Release the slot at offset and every one taken after it
+    void free_mem(int offset) {
+        current_mem = offset - _size - 4;
+    }
+
     int get_current_mem() {
         return _size+current_mem;
     }
@@ -246,40 +395,60 @@ public:
 class Variable : public Node
 {
 private:
-    std::string id;
+    Symbol id;
 public:
-    Variable(const std::string &_id)
-        : id(_id)
+    Variable(Symbol _id)
+        : Node(NodeKind::Variable),
+        id(_id)
     {}
 
-    const std::string getId() const
+    Symbol getId() const
     { return id; }
 
 
-    virtual void generate_assembly(std::ostream &dst, Context &context) const override
+    virtual void generate_step(std::ostream &dst, Context &context, CodegenStack &stack, const Task &task) const override
     {
+        int home = context.register_of(id);
+        if (home >= 0) {
+            context.get_binding(id);
+            frame_access(dst, "sw", "$s" + std::to_string(home), context.next_mem());
+            return;
+        }
         context.load_binding(id,"s0",dst,0);
-        dst << "\tsw\t$s0,"<<context.next_mem()<<"($fp)"<<std::endl;
+        frame_access(dst, "sw", "$s0", context.next_mem());
     }
 };
 
+//! "$sn" when node is a variable held in a register, so it can be used
+//! where it is without evaluating it into a stack slot; empty otherwise
+inline std::string register_operand(NodePtr node, Context &context)
+{
+    if (node->kind != NodeKind::Variable) return std::string();
+    Symbol id = static_cast<const Variable *>(node)->getId();
+    int home = context.register_of(id);
+    if (home < 0) return std::string();
+    context.get_binding(id);
+    return "$s" + std::to_string(home);
+}
+
 class Number : public Node
 {
 private:
     int value;
 public:
     Number(int _value)
-        : value(_value)
+        : Node(NodeKind::Number),
+        value(_value)
     {}
 
     int getValue() const
     { return value; }
 
 
-    virtual void generate_assembly(std::ostream &dst, Context &context) const override
+    virtual void generate_step(std::ostream &dst, Context &context, CodegenStack &stack, const Task &task) const override
     {
-        dst<<"\tli\t$s0,"<<value<<std::endl;
-        dst<<"\tsw\t$s0,"<<context.next_mem()<<"($fp)"<<std::endl;
+        dst<<"\tli\t$s0,"<<value<<"\n";
+        frame_access(dst, "sw", "$s0", context.next_mem());
     }
 };
 
@@ -290,7 +459,8 @@ protected:
     NodePtr expr_list, expr;
 public:
     ExprList(NodePtr _expr_list, NodePtr _expr)
-            : expr_list(_expr_list),
+            : Node(NodeKind::ExprList),
+            expr_list(_expr_list),
             expr(_expr)
         {}
 };
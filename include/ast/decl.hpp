@@ -9,14 +9,16 @@
 class Parameter : public Node
 {
 private:
-    std::string type, id;
+    const char *type;
+    Symbol id;
 public:
-    Parameter(const std::string &_type, const std::string &_id)
-        : type(_type),
+    Parameter(const char *_type, Symbol _id)
+        : Node(NodeKind::Parameter),
+        type(_type),
         id(_id)
     {}
 
-    const std::string getId() const
+    Symbol getId() const
     { return id; }
 
     virtual void generate_assembly(std::ostream &dst, Context &context) const override
@@ -38,7 +40,8 @@ protected:
     NodePtr list, parameter;
 public:
     ParameterList (NodePtr _list, NodePtr _parameter)
-            : list(_list),
+            : Node(NodeKind::ParameterList),
+            list(_list),
             parameter(_parameter)
         {}
 
@@ -71,6 +74,10 @@ public:
 
 class List : public Node {
 public:
+    List(NodeKind _kind)
+        : Node(_kind)
+    {}
+
     virtual void generate_assembly(std::ostream &dst, Context &context) const override //required by Node
     {
     }
@@ -80,11 +87,12 @@ public:
 class DeclList : public List
 {
 private:
-    std::string id;
+    Symbol id;
     NodePtr list, value;
 public:
-    DeclList(NodePtr _list, const std::string &_id, NodePtr _value)
-        : list(_list),
+    DeclList(NodePtr _list, Symbol _id, NodePtr _value)
+        : List(NodeKind::DeclList),
+        list(_list),
         id(_id),
         value(_value)
     {}
@@ -95,7 +103,7 @@ public:
         context.add_binding(type, id);
         if (value != nullptr) {
             value->generate_assembly(dst, context);
-            dst<<"\tlw\t$s0,"<<context.get_current_mem()<<"($fp)"<<std::endl;
+            frame_access(dst, "lw", "$s0", context.get_current_mem());
             context.set_binding(id,"s0",dst,0);
         }
         if (list != nullptr) {
@@ -109,11 +117,12 @@ public:
 class VariableDecl : public Node
 {
 private:
-    std::string type;
+    const char *type;
     NodePtr list;
 public:
-    VariableDecl(const std::string &_type, NodePtr _list)
-        : type(_type),
+    VariableDecl(const char *_type, NodePtr _list)
+        : Node(NodeKind::VariableDecl),
+        type(_type),
         list(_list)
     {}
 
@@ -131,7 +140,8 @@ protected:
     NodePtr list, expr;
 public:
     InitParams(NodePtr _list, NodePtr _expr)
-            : list(_list),
+            : Node(NodeKind::InitParams),
+            list(_list),
             expr(_expr)
         {}
 
@@ -143,8 +153,8 @@ public:
             current++;
         }
         expr->generate_assembly(dst,context);
-        dst<<"\tlw\t$s0"<<","<<context.get_current_mem()<<"($fp)"<<std::endl;
-        dst<<"\tsw\t$s0"<<","<<mem+type_size*current<<"($fp)"<<std::endl;
+        frame_access(dst, "lw", "$s0", context.get_current_mem());
+        frame_access(dst, "sw", "$s0", mem+type_size*current);
     }
 };
 
@@ -152,19 +162,21 @@ public:
 class GlobalDeclList : public List
 {
 private:
-    std::string id;
+    Symbol id;
     NodePtr list;
 public:
-    GlobalDeclList(NodePtr _list, const std::string &_id)
-        : list(_list),
+    GlobalDeclList(NodePtr _list, Symbol _id)
+        : List(NodeKind::GlobalDeclList),
+        list(_list),
         id(_id)
-    {
-        getGlobals().push_back(id);
-    }
+    {}
 
     virtual void generate_assembly(std::ostream &dst, Context &context, const std::string &type) const override
     {
-        dst<<"\t.comm\t"<<id<<","<<context.get_size(type)<<","<<context.get_size(type)<<"\n";
+        //zeroed, in the .sbss or .bss section the caller has switched to
+        const std::string &name = context.symbols().name(id);
+        dst<<"\t.type\t"<<name<<", @object\n\t.size\t"<<name<<", "<<context.get_size(type)<<"\n"
+           <<name<<":\n\t.space\t"<<context.get_size(type)<<"\n";
         if (list != nullptr) {
             const List* declarations = dynamic_cast<const List *>(list);
             declarations->generate_assembly(dst, context,type);
@@ -175,30 +187,30 @@ public:
 class GlobalDeclList2 : public List
 {
 private:
-    std::string id;
+    Symbol id;
     NodePtr list;
     int value;
 public:
-    GlobalDeclList2(NodePtr _list, const std::string &_id, const int _value)
-        : list(_list),
+    GlobalDeclList2(NodePtr _list, Symbol _id, const int _value)
+        : List(NodeKind::GlobalDeclList2),
+        list(_list),
         id(_id),
         value(_value)
-    {
-        getGlobals().push_back(id);
-    }
+    {}
 
     virtual void generate_assembly(std::ostream &dst, Context &context, const std::string &type) const override
     {
-        dst<<"\t.globl\t"<<id<<std::endl;
+        const std::string &name = context.symbols().name(id);
+        dst<<"\t.globl\t"<<name<<"\n";
         if (context.is_first_global) {
-            dst<<"\t.data"<<std::endl;
+            dst<<"\t.data\n";
             context.is_first_global = false;
         }
-        dst<<"\t.align\t2"<<std::endl;
-        dst<<"\t.type\t"<<id<<", @object"<<std::endl;
-        dst<<"\t.size\t"<<id<<", "<<context.get_size(type)<<std::endl;
-        dst<<id<<":"<<std::endl;
-        dst<<"\t.word\t"<<(int)value<<std::endl;
+        dst<<"\t.align\t2\n";
+        dst<<"\t.type\t"<<name<<", @object\n";
+        dst<<"\t.size\t"<<name<<", "<<context.get_size(type)<<"\n";
+        dst<<name<<":\n";
+        dst<<"\t.word\t"<<(int)value<<"\n";
         if (list != nullptr) {
             const List* declarations = dynamic_cast<const List *>(list);
             declarations->generate_assembly(dst, context,type);
@@ -214,7 +226,8 @@ protected:
     int value;
 public:
     GlobalInitParams(NodePtr _list, int _value)
-            : list(_list),
+            : Node(NodeKind::GlobalInitParams),
+            list(_list),
             value(_value)
         {}
 
@@ -225,7 +238,7 @@ public:
             const GlobalInitParams* params = dynamic_cast<const GlobalInitParams *>(list);
             params->generate_assembly(dst, context);
         }
-        dst<<"\t.word\t"<<value<<std::endl;
+        dst<<"\t.word\t"<<value<<"\n";
     }
 };
 
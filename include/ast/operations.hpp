@@ -13,15 +13,32 @@ protected:
     NodePtr left;
     NodePtr right;
 
-    Operator(NodePtr _left, NodePtr _right)
-        : left(_left)
+    Operator(NodeKind _kind, NodePtr _left, NodePtr _right)
+        : Node(_kind)
+        , left(_left)
         , right(_right)
     {}
 public:
-    virtual const char *getOpcode() const =0;
-    virtual const char *getOp() const {
-        throw std::runtime_error("getOp() not implemented");
-    };
+    const char *getOpcode() const {
+        switch (kind) {
+            case NodeKind::Add: return "+";
+            case NodeKind::Sub: return "-";
+            case NodeKind::Mul: return "*";
+            case NodeKind::Div: return "/";
+            case NodeKind::Equals: return "==";
+            case NodeKind::Less: return "<";
+            default: throw std::runtime_error("getOpcode() on a non-operator");
+        }
+    }
+    const char *getOp() const {
+        switch (kind) {
+            case NodeKind::Add: return "addu";
+            case NodeKind::Sub: return "subu";
+            case NodeKind::Mul: return "mul";
+            case NodeKind::Div: return "div";
+            default: throw std::runtime_error("getOp() not implemented");
+        }
+    }
 
     NodePtr getLeft() const
     { return left; }
@@ -30,81 +47,97 @@ public:
     { return right; }
 
 
-    virtual void generate_assembly(std::ostream &dst, Context &context) const override
+    //! Phases from here on evaluate only the operands, leaving them in the
+    //! registers operand_registers() names, for a comparison that is
+    //! branched on directly
+    static const unsigned operands_phase = 3;
+
+    virtual void generate_step(std::ostream &dst, Context &context, CodegenStack &stack, const Task &task) const override
     {
-        left->generate_assembly(dst,context);
-        int res = context.get_current_mem();
-        right->generate_assembly(dst,context);
-        dst<<"\tlw\t$s1,"<<res<<"($fp)"<<std::endl;
-        dst<<"\tlw\t$s0,"<<context.get_current_mem()<<"($fp)"<<std::endl;
-        dst<<"\t"<<getOp()<<"\t$s2,$s1,$s0"<<std::endl;
-        dst<<"\tsw\t$s2,"<<context.next_mem()<<"($fp)"<<std::endl;
+        //operands held in registers are not evaluated into stack slots
+        unsigned first = task.phase >= operands_phase ? operands_phase : 0;
+        switch (task.phase - first) {
+        case 0:
+            stack.push(this, first+1);
+            if (register_operand(left, context).empty()) stack.push(left);
+            break;
+        case 1: //remember where the left operand went
+            stack.push(this, first+2, context.get_current_mem());
+            if (register_operand(right, context).empty()) stack.push(right);
+            break;
+        default:
+            std::string lhs, rhs;
+            operand_registers(context, lhs, rhs);
+            if (lhs == "$s1") frame_access(dst, "lw", "$s1", task.saved);
+            if (rhs == "$s0") frame_access(dst, "lw", "$s0", context.get_current_mem());
+            //the operands are loaded, so their slots can be taken again
+            if (lhs == "$s1") context.free_mem(task.saved);
+            else if (rhs == "$s0") context.free_mem(context.get_current_mem());
+            if (first == 0) generate_operation(dst, context, lhs, rhs);
+        }
     }
+
+    //! The operands' own registers if they are variables held in one,
+    //! otherwise $s1 and $s0 they are loaded into
+    void operand_registers(Context &context, std::string &lhs, std::string &rhs) const
+    {
+        lhs = register_operand(left, context);
+        rhs = register_operand(right, context);
+        if (lhs.empty()) lhs = "$s1";
+        if (rhs.empty()) rhs = "$s0";
+    }
+
+    //! Combine the operands, normally loaded in $s1 and $s0, and store the result
+    virtual void generate_operation(std::ostream &dst, Context &context, const std::string &lhs, const std::string &rhs) const
+    {
+        dst<<"\t"<<getOp()<<"\t$s2,"<<lhs<<","<<rhs<<"\n";
+        frame_access(dst, "sw", "$s2", context.next_mem());
+    }
+
+    //! Branch to label when the comparison of the operands comes out as
+    //! when, without materializing its value
+    virtual void generate_branch(std::ostream &dst, const std::string &lhs, const std::string &rhs, bool when, const std::string &label) const
+    { throw std::runtime_error("generate_branch() on a non-comparison"); }
 };
 
 class AddOp : public Operator
 {
-protected:
-    virtual const char *getOpcode() const override
-    { return "+"; }
-    virtual const char *getOp() const override
-    { return "addu"; }
 public:
     AddOp(NodePtr _left, NodePtr _right)
-        : Operator(_left, _right)
+        : Operator(NodeKind::Add, _left, _right)
     {}
 };
 
 class SubOp : public Operator
 {
-protected:
-    virtual const char *getOpcode() const override
-    { return "-"; }
-    virtual const char *getOp() const override
-    { return "sub"; }
 public:
     SubOp(NodePtr _left, NodePtr _right)
-        : Operator(_left, _right)
+        : Operator(NodeKind::Sub, _left, _right)
     {}
 };
 
 
 class MulOp : public Operator
 {
-protected:
-    virtual const char *getOpcode() const override
-    { return "*"; }
-    virtual const char *getOp() const override
-    { return "mul"; }
 public:
     MulOp(NodePtr _left, NodePtr _right)
-        : Operator(_left, _right)
+        : Operator(NodeKind::Mul, _left, _right)
     {}
 };
 
 class DivOp : public Operator
 {
-protected:
-    virtual const char *getOpcode() const override
-    { return "/"; }
-    virtual const char *getOp() const override
-    { return "div"; }
 public:
     DivOp(NodePtr _left, NodePtr _right)
-        : Operator(_left, _right)
+        : Operator(NodeKind::Div, _left, _right)
     {}
 
-    virtual void generate_assembly(std::ostream &dst, Context &context) const override
+    virtual void generate_operation(std::ostream &dst, Context &context, const std::string &lhs, const std::string &rhs) const override
     {
-        left->generate_assembly(dst,context);
-        int res = context.get_current_mem();
-        right->generate_assembly(dst,context);
-        dst<<"\tlw\t$s1,"<<res<<"($fp)"<<std::endl;
-        dst<<"\tlw\t$s0,"<<context.get_current_mem()<<"($fp)"<<std::endl;
-        dst<<"\t"<<getOp()<<"\t$0,$s1,$s0"<<std::endl;
-        dst<<"\tteq\t$s0,$0,7"<<std::endl; //trap with code 7 if denominator is eqaul to zero
-        dst<<"\tmflo\t$s0"<<std::endl;
-        dst<<"\tsw\t$s0,"<<context.next_mem()<<"($fp)"<<std::endl;
+        dst<<"\t"<<getOp()<<"\t$0,"<<lhs<<","<<rhs<<"\n";
+        dst<<"\tteq\t"<<rhs<<",$0,7\n"; //trap with code 7 if denominator is eqaul to zero
+        dst<<"\tmflo\t$s0\n";
+        frame_access(dst, "sw", "$s0", context.next_mem());
     }
 };
 
@@ -112,49 +145,43 @@ public:
 
 class EqualsOp : public Operator
 {
-protected:
-    virtual const char *getOpcode() const override
-    { return "=="; }
 public:
     EqualsOp(NodePtr _left, NodePtr _right)
-        : Operator(_left, _right)
+        : Operator(NodeKind::Equals, _left, _right)
     {}
 
-    virtual void generate_assembly(std::ostream &dst, Context &context) const override
+    virtual void generate_operation(std::ostream &dst, Context &context, const std::string &lhs, const std::string &rhs) const override
+    {
+        dst<<"\txor\t$s0,"<<lhs<<","<<rhs<<"\n";
+        dst<<"\tsltu\t$s0,$s0,1\n";
+        dst<<"\tandi\t$s0,$s0,0x00ff\n";
+        frame_access(dst, "sw", "$s0", context.next_mem());
+    }
+
+    virtual void generate_branch(std::ostream &dst, const std::string &lhs, const std::string &rhs, bool when, const std::string &label) const override
     {
-        left->generate_assembly(dst,context);
-        int res = context.get_current_mem();
-        right->generate_assembly(dst,context);
-        dst<<"\tlw\t$s1,"<<res<<"($fp)"<<std::endl;
-        dst<<"\tlw\t$s0,"<<context.get_current_mem()<<"($fp)"<<std::endl;
-        dst<<"\txor\t$s0,$s1,$s0"<<std::endl;
-        dst<<"\tsltu\t$s0,$s0,1"<<std::endl;
-        dst<<"\tandi\t$s0,$s0,0x00ff"<<std::endl;
-        dst<<"\tsw\t$s0,"<<context.next_mem()<<"($fp)"<<std::endl;
+        dst<<"\t"<<(when ? "beq" : "bne")<<"\t"<<lhs<<","<<rhs<<","<<label<<"\n";
     }
 };
 
 
 class LessOp : public Operator
 {
-protected:
-    virtual const char *getOpcode() const override
-    { return "<"; }
 public:
     LessOp(NodePtr _left, NodePtr _right)
-        : Operator(_left, _right)
+        : Operator(NodeKind::Less, _left, _right)
     {}
 
-    virtual void generate_assembly(std::ostream &dst, Context &context) const override
+    virtual void generate_operation(std::ostream &dst, Context &context, const std::string &lhs, const std::string &rhs) const override
     {
-        left->generate_assembly(dst,context);
-        int res = context.get_current_mem();
-        right->generate_assembly(dst,context);
-        dst<<"\tlw\t$s1,"<<res<<"($fp)"<<std::endl;
-        dst<<"\tlw\t$s0,"<<context.get_current_mem()<<"($fp)"<<std::endl;
-        dst<<"\tsltu\t$s0,$s1,$s0"<<std::endl;
-        dst<<"\tandi\t$s0,$s0,0x00ff"<<std::endl;
-        dst<<"\tsw\t$s0,"<<context.next_mem()<<"($fp)"<<std::endl;
+        dst<<"\tslt\t$s0,"<<lhs<<","<<rhs<<"\n";
+        frame_access(dst, "sw", "$s0", context.next_mem());
+    }
+
+    virtual void generate_branch(std::ostream &dst, const std::string &lhs, const std::string &rhs, bool when, const std::string &label) const override
+    {
+        dst<<"\tslt\t$s0,"<<lhs<<","<<rhs<<"\n";
+        dst<<"\t"<<(when ? "bne" : "beq")<<"\t$s0,$0,"<<label<<"\n";
     }
 };
 
@@ -163,36 +190,56 @@ public:
 class AssignOp : public Node
 {
 protected:
-    std::string id;
+    Symbol id;
     NodePtr offset, right;
 
     virtual const std::string getOpcode() const
     { return ":="; }
 
 public:
-    AssignOp(std::string &_id, NodePtr _offset, NodePtr _right)
-        : id(_id),
+    AssignOp(Symbol _id, NodePtr _offset, NodePtr _right)
+        : Node(NodeKind::Assign),
+        id(_id),
         offset(_offset),
         right(_right)
     {}
 
+    Symbol getId() const
+    { return id; }
 
-    virtual void generate_assembly(std::ostream &dst, Context &context) const override
-    {   right->generate_assembly(dst, context);
-        dst<<"\tlw\t$s3,"<<context.get_current_mem()<<"($fp)"<<std::endl;
-
+    NodePtr getRight() const
+    { return right; }
 
-        if (offset != nullptr) {
-            offset->generate_assembly(dst, context);
-            dst<<"\tlw\t$s1,"<<context.get_current_mem()<<"($fp)"<<std::endl;
-            dst<<"\tli\t$s2,"<<context.get_size(context.get_arr_type(id))<<std::endl;
 
-            dst<<"\tmul\t$s1,$s1,$s2"<<std::endl;
+    virtual void generate_step(std::ostream &dst, Context &context, CodegenStack &stack, const Task &task) const override
+    {
+        switch (task.phase) {
+        case 0:
+            stack.push(this, 1);
+            stack.push(right);
+            break;
+        case 1:
+            if (offset == nullptr && context.register_of(id) >= 0) {
+                context.get_binding(id);
+                frame_access(dst, "lw", "$s" + std::to_string(context.register_of(id)), context.get_current_mem());
+                context.registers()->assign(id);
+                break;
+            }
+            frame_access(dst, "lw", "$s3", context.get_current_mem());
+            if (offset != nullptr) {
+                stack.push(this, 2);
+                stack.push(offset);
+            }
+            else context.set_binding(id, "s3", dst, 0);
+            break;
+        default:
+            frame_access(dst, "lw", "$s1", context.get_current_mem());
+            dst<<"\tli\t$s2,"<<context.get_size(context.get_arr_type(id))<<"\n";
+
+            dst<<"\tmul\t$s1,$s1,$s2\n";
             context.load_array(id, "t0",dst);
-            dst<<"\tsw\t$s3,($t0)"<<std::endl;
+            dst<<"\tsw\t$s3,($t0)\n";
         }
-
-        else context.set_binding(id, "s3", dst, 0);
     }
 };
 
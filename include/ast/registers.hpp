@@ -0,0 +1,190 @@
+#ifndef registers_hpp
+#define registers_hpp
+
+#include "symbols.hpp"
+
+#include <algorithm>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class Node;
+
+//! Program variables kept in callee-saved registers. Allocation is a
+//! linear scan over live intervals measured in top-level statements, which
+//! run in order, so an interval that starts or ends inside a loop or a
+//! branch still starts or ends on every path. An allocated variable is
+//! only referenced inside its interval: its memory still holds the initial
+//! 0 where the interval starts, so the register is just cleared.
+//!
+//! During code generation the allocation tracks which registers may differ
+//! from memory, so only those are written back before a print and at the
+//! end of their interval.
+class RegisterAllocation
+{
+public:
+    //! $s0-$s3 are expression scratch, so variables get $s4-$s7
+    static constexpr int first_register = 4;
+    static constexpr int register_count = 4;
+
+    struct Interval
+    {
+        Symbol id;
+        unsigned start, end; //top-level statements, inclusive
+        double weight;       //uses, scaled up inside loops
+    };
+
+private:
+    Symbols &symbols;
+    std::vector<int> reg; //by symbol, -1 for memory
+    std::vector<std::pair<unsigned,Symbol> > starts, ends; //sorted by statement
+    std::unordered_map<const Node *,unsigned> loop_writes; //registers assigned in each loop
+    int highest = -1;
+
+    //code generation state
+    size_t next_start = 0, next_end = 0;
+    std::vector<Symbol> live; //allocated variables whose interval is open
+    unsigned dirty = 0;       //bit n set when $sn may differ from memory
+    std::vector<unsigned> branches;
+
+    void store(std::ostream &dst, Symbol id)
+    { global_access(dst, symbols, "sw", "$s" + std::to_string(reg[id]), id); }
+
+public:
+    RegisterAllocation(Symbols &_symbols, std::vector<Interval> intervals)
+        : symbols(_symbols),
+        reg(_symbols.size(), -1)
+    {
+        std::sort(intervals.begin(), intervals.end(), [](const Interval &a, const Interval &b) {
+            return a.start != b.start ? a.start < b.start : a.id < b.id;
+        });
+
+        //spill the interval with the lowest weight per statement it spans
+        auto cost = [](const Interval &i) { return i.weight / (i.end - i.start + 1); };
+        std::vector<const Interval *> active;
+        std::vector<int> free;
+        for (int r = first_register + register_count - 1; r >= first_register; r--) free.push_back(r);
+
+        for (const Interval &current : intervals) {
+            for (size_t i = 0; i < active.size(); ) {
+                if (active[i]->end < current.start) {
+                    free.push_back(reg[active[i]->id]);
+                    active[i] = active.back();
+                    active.pop_back();
+                }
+                else i++;
+            }
+
+            if (!free.empty()) {
+                reg[current.id] = free.back();
+                free.pop_back();
+                active.push_back(&current);
+                continue;
+            }
+            auto victim = std::min_element(active.begin(), active.end(), [&](const Interval *a, const Interval *b) {
+                return cost(*a) < cost(*b);
+            });
+            if (cost(**victim) < cost(current)) {
+                reg[current.id] = reg[(*victim)->id];
+                reg[(*victim)->id] = -1;
+                *victim = &current;
+            }
+        }
+
+        for (const Interval &interval : intervals) {
+            if (reg[interval.id] < 0) continue;
+            starts.emplace_back(interval.start, interval.id);
+            ends.emplace_back(interval.end, interval.id);
+            highest = std::max(highest, reg[interval.id]);
+        }
+        std::sort(ends.begin(), ends.end());
+    }
+
+    //! Register number n of $sn holding id, or -1 if it lives in memory
+    int register_of(Symbol id) const
+    { return id < reg.size() ? reg[id] : -1; }
+
+    //! $s registers the program uses, scratch included
+    int saved_registers() const
+    { return std::max(highest + 1, first_register); }
+
+    //! Record that loop assigns id somewhere in its body or condition
+    void loop_assigns(const Node *loop, Symbol id)
+    {
+        if (register_of(id) >= 0) loop_writes[loop] |= 1u << reg[id];
+    }
+
+    //! Everything inner assigns, outer assigns too
+    void loop_includes(const Node *outer, const Node *inner)
+    {
+        auto it = loop_writes.find(inner);
+        if (it != loop_writes.end()) loop_writes[outer] |= it->second;
+    }
+
+    //! Before top-level statement i: clear registers of intervals opening
+    void enter(std::ostream &dst, unsigned statement)
+    {
+        for (; next_start < starts.size() && starts[next_start].first == statement; next_start++) {
+            Symbol id = starts[next_start].second;
+            dst<<"\tmove\t$s"<<reg[id]<<",$0\n";
+            live.push_back(id);
+        }
+    }
+
+    //! After top-level statement i: write back intervals closing
+    void leave(std::ostream &dst, unsigned statement)
+    {
+        for (; next_end < ends.size() && ends[next_end].first == statement; next_end++) {
+            Symbol id = ends[next_end].second;
+            if (dirty & 1u << reg[id]) store(dst, id);
+            dirty &= ~(1u << reg[id]);
+            live.erase(std::find(live.begin(), live.end(), id));
+        }
+    }
+
+    void assign(Symbol id)
+    { dirty |= 1u << reg[id]; }
+
+    //! Make memory current before control leaves the program, e.g. printf
+    void write_back(std::ostream &dst)
+    {
+        for (Symbol id : live) {
+            if (dirty & 1u << reg[id]) store(dst, id);
+        }
+        dirty = 0;
+    }
+
+    //! The head of a loop is also reached from the end of its body
+    void enter_loop(const Node *loop)
+    {
+        branches.push_back(dirty);
+        auto it = loop_writes.find(loop);
+        if (it != loop_writes.end()) dirty |= it->second;
+    }
+
+    //! The condition is also reached straight from before the loop, past
+    //! any write-back in the body
+    void loop_condition()
+    {
+        dirty |= branches.back();
+        branches.pop_back();
+    }
+
+    //! Code after a branch may follow either arm, so it starts with what
+    //! is dirty after either of them
+    void open_branch()
+    { branches.push_back(dirty); }
+
+    void else_branch()
+    { std::swap(dirty, branches.back()); }
+
+    void close_branch()
+    {
+        dirty |= branches.back();
+        branches.pop_back();
+    }
+};
+
+#endif
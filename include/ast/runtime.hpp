@@ -0,0 +1,72 @@
+#ifndef runtime_hpp
+#define runtime_hpp
+
+#include <ostream>
+#include <string>
+
+//! The print runtime emitted after main unless printf is asked for. A
+//! print is a bal to $PRINT with the value put in $4 by its delay slot.
+//! $PRINT formats the number into a buffer, which $FLUSH writes out with
+//! the write system call when it is nearly full and when main returns.
+//! Both clobber only registers printf may clobber too, and leave $28.
+
+const unsigned print_buffer_size = 65536;
+
+inline void generate_print_runtime(std::ostream &dst)
+{
+    dst<<"\t.text\n\t.align\t2\n\t.set\tnoreorder\n"
+       //"-2147483648\n" is the longest line
+       <<"$PRINT:\n"
+       <<"\tlw\t$8,%gp_rel($OUTLEN)($28)\n"
+       <<"\tli\t$9,"<<print_buffer_size - 11<<"\n"
+       <<"\tsltu\t$9,$8,$9\n"
+       <<"\tbne\t$9,$0,$PRINT_ROOM\n\tnop\n"
+       <<"\taddiu\t$sp,$sp,-8\n\tsw\t$31,4($sp)\n"
+       <<"\tbal\t$FLUSH\n\tsw\t$4,0($sp)\n"
+       <<"\tlw\t$4,0($sp)\n\tlw\t$31,4($sp)\n\taddiu\t$sp,$sp,8\n"
+       <<"\tmove\t$8,$0\n"
+       <<"$PRINT_ROOM:\n"
+       <<"\tlw\t$9,%got($OUTBUF)($28)\n"
+       <<"\taddiu\t$9,$9,%lo($OUTBUF)\n"
+       <<"\taddu\t$9,$9,$8\n"
+       <<"\tbgez\t$4,$PRINT_DIGITS\n\tmove\t$10,$4\n"
+       <<"\tli\t$11,45\n\tsb\t$11,0($9)\n\taddiu\t$9,$9,1\n"
+       <<"\tsubu\t$10,$0,$4\n"
+       //step $9 past as many places as $10 has digits, dividing by 10
+       //as a multiply by 0xcccccccd and a shift
+       <<"$PRINT_DIGITS:\n"
+       <<"\tli\t$11,0xcccccccd\n"
+       <<"\tmove\t$12,$10\n"
+       <<"$PRINT_COUNT:\n"
+       <<"\tmultu\t$12,$11\n\tmfhi\t$12\n\tsrl\t$12,$12,3\n"
+       <<"\tbne\t$12,$0,$PRINT_COUNT\n\taddiu\t$9,$9,1\n"
+       <<"\tli\t$13,10\n\tsb\t$13,0($9)\n\taddiu\t$14,$9,1\n"
+       //then fill them in from the right
+       <<"$PRINT_NEXT:\n"
+       <<"\tmultu\t$10,$11\n\tmfhi\t$12\n\tsrl\t$12,$12,3\n"
+       <<"\tsll\t$13,$12,1\n\tsll\t$15,$12,3\n\taddu\t$13,$13,$15\n"
+       <<"\tsubu\t$13,$10,$13\n\taddiu\t$13,$13,48\n"
+       <<"\taddiu\t$9,$9,-1\n\tsb\t$13,0($9)\n"
+       <<"\tbne\t$12,$0,$PRINT_NEXT\n\tmove\t$10,$12\n"
+       <<"\tlw\t$9,%got($OUTBUF)($28)\n"
+       <<"\taddiu\t$9,$9,%lo($OUTBUF)\n"
+       <<"\tsubu\t$14,$14,$9\n"
+       <<"\tjr\t$31\n\tsw\t$14,%gp_rel($OUTLEN)($28)\n"
+       //write(1, buffer, length) until it is all out or fails
+       <<"$FLUSH:\n"
+       <<"\tlw\t$6,%gp_rel($OUTLEN)($28)\n"
+       <<"\tlw\t$5,%got($OUTBUF)($28)\n"
+       <<"\tbeq\t$6,$0,$FLUSH_DONE\n\taddiu\t$5,$5,%lo($OUTBUF)\n"
+       <<"$FLUSH_MORE:\n"
+       <<"\tli\t$4,1\n\tli\t$2,4004\n\tsyscall\n"
+       <<"\tbne\t$7,$0,$FLUSH_DONE\n\taddu\t$5,$5,$2\n"
+       <<"\tsubu\t$6,$6,$2\n"
+       <<"\tbgtz\t$6,$FLUSH_MORE\n\tnop\n"
+       <<"$FLUSH_DONE:\n"
+       <<"\tjr\t$31\n\tsw\t$0,%gp_rel($OUTLEN)($28)\n"
+       <<"\t.set\treorder\n\n"
+       <<"\t.section\t.sbss,\"aw\",@nobits\n\t.align\t2\n$OUTLEN:\n\t.space\t4\n"
+       <<"\t.section\t.bss,\"aw\",@nobits\n\t.align\t2\n$OUTBUF:\n\t.space\t"<<print_buffer_size<<"\n";
+}
+
+#endif
@@ -2,16 +2,57 @@
 #define statement_hpp
 
 #include "base.hpp"
+#include "decl.hpp"
+#include "operations.hpp"
+#include "runtime.hpp"
 
+#include <algorithm>
 #include <string>
 #include <cmath>
 #include <iostream>
 #include <vector>
 
-static std::vector<std::string> condTracker;
-static std::vector<std::string> endTracker;
-static std::vector<NodePtr> switchTracker;
 
+//! Register holding the value of an evaluated condition, whose slot is
+//! then free again
+inline std::string load_condition(std::ostream &dst, Context &context, NodePtr condition)
+{
+    std::string value = register_operand(condition, context);
+    if (!value.empty()) return value;
+    frame_access(dst, "lw", "$s0", context.get_current_mem());
+    context.free_mem(context.get_current_mem());
+    return "$s0";
+}
+
+//! Conditions that branch on their operands, with nothing materialized
+inline bool is_comparison(NodePtr node)
+{
+    return node->kind == NodeKind::Equals || node->kind == NodeKind::Less;
+}
+
+//! Push what branch_on needs evaluated first: a comparison's operands, or
+//! any other condition's value
+inline void push_condition(CodegenStack &stack, Context &context, NodePtr condition)
+{
+    if (is_comparison(condition)) stack.push(condition, Operator::operands_phase);
+    else if (register_operand(condition, context).empty()) stack.push(condition);
+}
+
+//! Branch to label if condition comes out as when, with a nop in the delay slot
+inline void branch_on(std::ostream &dst, Context &context, NodePtr condition, bool when, const std::string &label)
+{
+    if (is_comparison(condition)) {
+        const Operator *compare = static_cast<const Operator *>(condition);
+        std::string lhs, rhs;
+        compare->operand_registers(context, lhs, rhs);
+        compare->generate_branch(dst, lhs, rhs, when, label);
+    }
+    else {
+        std::string test = load_condition(dst, context, condition);
+        dst<<"\t"<<(when ? "bne" : "beq")<<"\t"<<test<<",$0,"<<label<<"\n";
+    }
+    dst<<"\tnop\n";
+}
 
 class PrintStat : public Node
 {
@@ -19,12 +60,35 @@ protected:
     NodePtr expr;
 public:
     PrintStat(NodePtr _expr)
-            : expr(_expr)
+            : Node(NodeKind::Print),
+            expr(_expr)
         {}
 
-    virtual void generate_assembly(std::ostream &dst, Context &context) const override
+    NodePtr getExpr() const
+    { return expr; }
+
+    virtual void generate_step(std::ostream &dst, Context &context, CodegenStack &stack, const Task &task) const override
     {
-        expr->generate_assembly(dst,context);
+        std::string value = register_operand(expr, context);
+        if (task.phase == 0) {
+            stack.push(this, 1);
+            if (value.empty()) stack.push(expr);
+            return;
+        }
+        //globals are observable once control leaves the program
+        if (context.registers() != nullptr) context.registers()->write_back(dst);
+
+        if (!context.calls_printf()) {
+            //the value is set in the delay slot, unless its slot is too
+            //far from $fp to load in one instruction
+            bool far = value.empty() && context.get_current_mem() > 32767;
+            if (!far) dst<<"\tbal\t$PRINT\n";
+            if (value.empty()) frame_access(dst, "lw", "$4", context.get_current_mem());
+            else dst<<"\tmove\t$4,"<<value<<"\n";
+            if (far) dst<<"\tbal\t$PRINT\n\tnop\n";
+            return;
+        }
+
 //MIPS code for printf
 
       // 	lw	$2,%got(y)($28)
@@ -44,9 +108,13 @@ public:
       //  lw	$28,16($fp)
       // 	nop
 
-        dst<<"\tlw\t$2,%got("<<context.get_current_mem()<<")($fp)\n"
-           <<"\tnop\n"<<"\tlw\t$2,0($2)\n"<<"\tnop\n\tmove\t$5,$2\n"
-           <<"\tlw\t$2,%got($LC0)($28)\n"<<"\tnop\n"
+        if (value.empty()) {
+            frame_access(dst, "lw", "$2", context.get_current_mem());
+            dst<<"\tnop\n\tmove\t$5,$2\n";
+        } else {
+            dst<<"\tmove\t$5,"<<value<<"\n";
+        }
+        dst<<"\tlw\t$2,%got($LC0)($28)\n"<<"\tnop\n"
         	 <<"\taddiu\t$4,$2,%lo($LC0)\n"<<"\tlw\t$2,%call16(printf)($28)\n"
         	 <<"\tnop\n"<<"\tmove\t$25,$2\n"<<"\t.reloc\t1f,R_MIPS_JALR,printf\n"
            <<"1:\tjalr\t$25\n"<<"\tnop\n"<<"\tlw\t$28,16($fp)\n"<<"\tnop\n";
@@ -60,13 +128,17 @@ protected:
     NodePtr seq;
 public:
     CompoundStat(NodePtr _seq)
-            : seq(_seq)
+            : Node(NodeKind::Compound),
+            seq(_seq)
         {}
 
-    virtual void generate_assembly(std::ostream &dst, Context &context) const override
+    NodePtr getSequence() const
+    { return seq; }
+
+    virtual void generate_step(std::ostream &dst, Context &context, CodegenStack &stack, const Task &task) const override
     {
         if (seq != nullptr) { //compound statement could be empty
-            seq->generate_assembly(dst,context);
+            stack.push(seq);
         }
     }
 };
@@ -74,19 +146,31 @@ public:
 class Sequence : public Node
 {
 protected:
-    NodePtr sequence_nest, next;
+    const NodePtr *statements; //flat array in the arena
+    unsigned count;
 public:
-    Sequence(NodePtr _sequence_nest, NodePtr _next)
-            : sequence_nest(_sequence_nest),
-            next(_next)
+    Sequence(const NodePtr *_statements, unsigned _count)
+            : Node(NodeKind::Sequence),
+            statements(_statements),
+            count(_count)
         {}
 
-    virtual void generate_assembly(std::ostream &dst, Context &context) const override
+    unsigned size() const
+    { return count; }
+
+    NodePtr at(unsigned i) const
+    { return statements[i]; }
+
+    virtual void generate_step(std::ostream &dst, Context &context, CodegenStack &stack, const Task &task) const override
     {
-        if (sequence_nest != nullptr) { //sequence could be only 1 statement
-            sequence_nest->generate_assembly(dst,context);
+        //the phase is the index of the next statement; each one starts
+        //with the temporary slots free that were free before the first
+        int mark = task.phase == 0 ? context.mem_init() : task.saved;
+        context.set_mem(mark);
+        if (task.phase < count) {
+            stack.push(this, task.phase+1, mark);
+            stack.push(statements[task.phase]);
         }
-        next->generate_assembly(dst,context);
     }
 };
 
@@ -96,12 +180,16 @@ protected:
     NodePtr expr;
 public:
     Stat(NodePtr _expr)
-            : expr(_expr)
+            : Node(NodeKind::Stat),
+            expr(_expr)
         {}
 
-    virtual void generate_assembly(std::ostream &dst, Context &context) const override
+    NodePtr getExpr() const
+    { return expr; }
+
+    virtual void generate_step(std::ostream &dst, Context &context, CodegenStack &stack, const Task &task) const override
     {
-        expr->generate_assembly(dst,context);
+        stack.push(expr);
         // context.reset_mem();
     }
 };
@@ -110,26 +198,38 @@ class ifStat : public Node
 {
 protected:
     NodePtr condition, sequence;
-    std::string endLabel;
 public:
-    static int ifCounter;
     ifStat(NodePtr _condition, NodePtr _sequence)
-        : condition(_condition),
+        : Node(NodeKind::If),
+        condition(_condition),
         sequence(_sequence)
-    {  endLabel = makeIfLabel();  }
+    {}
 
-    std::string makeIfLabel(){
-        return "$IL"+std::to_string(ifCounter++);
-    }
+    NodePtr getCondition() const
+    { return condition; }
 
-    virtual void generate_assembly(std::ostream &dst, Context &context) const override
+    NodePtr getSequence() const
+    { return sequence; }
+
+    //the end label is numbered in phase 0 and carried in task.saved
+    virtual void generate_step(std::ostream &dst, Context &context, CodegenStack &stack, const Task &task) const override
     {
-        condition->generate_assembly(dst,context);
-        dst<<"\tlw\t$s0,"<<context.get_current_mem()<<"($fp)"<<std::endl;
-        dst<<"\tbeq\t$s0,$0,"<<endLabel;
-        dst<<std::endl<<"\tnop"<<std::endl;
-        sequence->generate_assembly(dst,context);
-        dst<<endLabel<<":"<<std::endl;
+        int endLabel = task.saved;
+        switch (task.phase) {
+        case 0:
+            stack.push(this, 1, context.next_label());
+            push_condition(stack, context, condition);
+            break;
+        case 1:
+            branch_on(dst, context, condition, false, "$IL" + std::to_string(endLabel));
+            if (context.registers() != nullptr) context.registers()->open_branch();
+            stack.push(this, 2, endLabel);
+            stack.push(sequence);
+            break;
+        default:
+            dst<<"$IL"<<endLabel<<":\n";
+            if (context.registers() != nullptr) context.registers()->close_branch();
+        }
     }
 };
 
@@ -137,36 +237,53 @@ class ifElseStat : public Node
 {
 protected:
     NodePtr condition, ifSequence, elseSequence;
-    std::string elseLabel, endLabel;
 public:
-    static int ifElseCounter;
     ifElseStat(NodePtr _condition, NodePtr _ifSequence, NodePtr _elseSequence)
-            : condition(_condition),
+            : Node(NodeKind::IfElse),
+            condition(_condition),
             ifSequence(_ifSequence),
             elseSequence(_elseSequence)
-        {
-            elseLabel = makeIfElseLabel();
-            endLabel = makeIfElseLabel();
-        }
+        {}
 
-    std::string makeIfElseLabel()
-    {
-        return "$IEL"+std::to_string(ifElseCounter++);
-    }
+    NodePtr getCondition() const
+    { return condition; }
+
+    NodePtr getIfSequence() const
+    { return ifSequence; }
 
+    NodePtr getElseSequence() const
+    { return elseSequence; }
 
-    virtual void generate_assembly(std::ostream &dst, Context &context) const override
+
+    //takes two consecutive labels: else at task.saved, end just after it
+    virtual void generate_step(std::ostream &dst, Context &context, CodegenStack &stack, const Task &task) const override
     {
-        condition->generate_assembly(dst,context);
-        dst<<"\tlw\t$s0,"<<context.get_current_mem()<<"($fp)"<<std::endl;
-        dst<<"\tbeq\t$s0,$0,"<<elseLabel;
-        dst<<std::endl<<"\tnop"<<std::endl;
-        ifSequence->generate_assembly(dst,context);
-        dst<<"\tbeq\t$0,$0,"<<endLabel;
-        dst<<std::endl<<"\tnop"<<std::endl;
-        dst<<elseLabel<<":"<<std::endl;
-        elseSequence->generate_assembly(dst,context);
-        dst<<endLabel<<":"<<std::endl;
+        int elseLabel = task.saved, endLabel = task.saved+1;
+        switch (task.phase) {
+        case 0:
+            elseLabel = context.next_label();
+            context.next_label();
+            stack.push(this, 1, elseLabel);
+            push_condition(stack, context, condition);
+            break;
+        case 1:
+            branch_on(dst, context, condition, false, "$IEL" + std::to_string(elseLabel));
+            if (context.registers() != nullptr) context.registers()->open_branch();
+            stack.push(this, 2, elseLabel);
+            stack.push(ifSequence);
+            break;
+        case 2:
+            dst<<"\tbeq\t$0,$0,$IEL"<<endLabel;
+            dst<<"\n"<<"\tnop\n";
+            dst<<"$IEL"<<elseLabel<<":\n";
+            if (context.registers() != nullptr) context.registers()->else_branch();
+            stack.push(this, 3, elseLabel);
+            stack.push(elseSequence);
+            break;
+        default:
+            dst<<"$IEL"<<endLabel<<":\n";
+            if (context.registers() != nullptr) context.registers()->close_branch();
+        }
     }
 
 };
@@ -175,42 +292,333 @@ class whileStat : public Node
 {
 protected:
     NodePtr condition, sequence;
-    std::string seqLabel, condLabel, endLabel;
 public:
-    static int whileCounter;
-    std::string makeWhileLabel()
-    {
-        return "$WL"+std::to_string(whileCounter++);
-    }
     whileStat(NodePtr _condition, NodePtr _sequence)
-            : condition(_condition),
+            : Node(NodeKind::While),
+            condition(_condition),
             sequence(_sequence)
-        {
-            seqLabel = makeWhileLabel();
-            condLabel = makeWhileLabel();
-            endLabel = makeWhileLabel();
-            condTracker.push_back(condLabel);
-            endTracker.push_back(endLabel);
+        {}
+
+    NodePtr getCondition() const
+    { return condition; }
+
+    NodePtr getSequence() const
+    { return sequence; }
+
+
+
+    //takes three consecutive labels: body, condition and end
+    virtual void generate_step(std::ostream &dst, Context &context, CodegenStack &stack, const Task &task) const override
+    {
+        int seqLabel = task.saved, condLabel = task.saved+1, endLabel = task.saved+2;
+        switch (task.phase) {
+        case 0:
+            seqLabel = context.next_label();
+            condLabel = context.next_label();
+            context.next_label();
+            dst<<"\tb\t$WL"<<condLabel<<"\n";
+            dst<<"\tnop\n";
+            dst<<"$WL"<<seqLabel<<":\n";
+            if (context.registers() != nullptr) context.registers()->enter_loop(this);
+            stack.push(this, 1, seqLabel);
+            stack.push(sequence);
+            break;
+        case 1:
+            dst<<"$WL"<<condLabel<<":\n";
+            if (context.registers() != nullptr) context.registers()->loop_condition();
+            stack.push(this, 2, seqLabel);
+            push_condition(stack, context, condition);
+            break;
+        default:
+            branch_on(dst, context, condition, true, "$WL" + std::to_string(seqLabel));
+            dst<<"$WL"<<endLabel<<":\n";
         }
+    }
+};
 
 
+//! The whole program, compiled as the body of main. Temporaries are only
+//! all allocated once the body has been generated, so the frame set-up is
+//! emitted after the body and entered with a branch from main.
+class Program : public Node
+{
+protected:
+    NodePtr body;
+public:
+    Program(NodePtr _body)
+            : Node(NodeKind::Program),
+            body(_body)
+        {}
+
+    const Sequence &getBody() const
+    { return static_cast<const Sequence &>(*body); }
 
-    virtual void generate_assembly(std::ostream &dst, Context &context) const override
+    //! With registers allocated, the top-level statements are generated
+    //! one per phase from 2 on, so intervals can open and close between them
+    virtual void generate_step(std::ostream &dst, Context &context, CodegenStack &stack, const Task &task) const override
     {
-        dst<<"\tb\t"<<condLabel<<std::endl;
-        dst<<"\tnop\n";
-        dst<<seqLabel<<":"<<std::endl;
-        sequence->generate_assembly(dst,context);
-        dst<<condLabel<<":"<<std::endl;
-        condition->generate_assembly(dst,context);
-        dst<<"\tlw\t$s0,"<<context.get_current_mem()<<"($fp)"<<std::endl;
-        dst<<"\tbne\t$s0,$0,"<<seqLabel;
-        dst<<std::endl<<"\tnop"<<std::endl;
-        dst<<endLabel<<":"<<std::endl;
-        condTracker.erase(condTracker.begin());
-        endTracker.erase(endTracker.begin());
+        RegisterAllocation *registers = context.registers();
+        if (task.phase == 0) {
+            if (context.symbols().size() > Symbols::small_data_capacity) place_small_data(context.symbols());
+            generate_prologue(dst, context);
+            if (registers != nullptr) stack.push(this, 2, context.mem_init());
+            else {
+                stack.push(this, 1);
+                stack.push(body);
+            }
+            return;
+        }
+        if (registers == nullptr) {
+            generate_epilogue(dst, context);
+            return;
+        }
+
+        unsigned statement = task.phase - 2;
+        context.set_mem(task.saved);
+        if (statement > 0) registers->leave(dst, statement - 1);
+        if (statement < getBody().size()) {
+            registers->enter(dst, statement);
+            stack.push(this, task.phase + 1, task.saved);
+            stack.push(getBody().at(statement));
+        }
+        else generate_epilogue(dst, context);
+    }
+
+    //! Call f(child, in_loop) for each child of node, where in_loop is
+    //! true for the condition and body of a while
+    template<class F>
+    static void for_each_child(NodePtr node, F f)
+    {
+        switch (node->kind) {
+        case NodeKind::Assign:
+            f(static_cast<const AssignOp *>(node)->getRight(), false);
+            break;
+        case NodeKind::Add: case NodeKind::Sub: case NodeKind::Mul:
+        case NodeKind::Div: case NodeKind::Equals: case NodeKind::Less:
+            f(static_cast<const Operator *>(node)->getLeft(), false);
+            f(static_cast<const Operator *>(node)->getRight(), false);
+            break;
+        case NodeKind::Print:
+            f(static_cast<const PrintStat *>(node)->getExpr(), false);
+            break;
+        case NodeKind::Stat:
+            f(static_cast<const Stat *>(node)->getExpr(), false);
+            break;
+        case NodeKind::Compound:
+            f(static_cast<const CompoundStat *>(node)->getSequence(), false);
+            break;
+        case NodeKind::Sequence: {
+            const Sequence *seq = static_cast<const Sequence *>(node);
+            for (unsigned i = 0; i < seq->size(); i++) f(seq->at(i), false);
+            break;
+        }
+        case NodeKind::If:
+            f(static_cast<const ifStat *>(node)->getCondition(), false);
+            f(static_cast<const ifStat *>(node)->getSequence(), false);
+            break;
+        case NodeKind::IfElse:
+            f(static_cast<const ifElseStat *>(node)->getCondition(), false);
+            f(static_cast<const ifElseStat *>(node)->getIfSequence(), false);
+            f(static_cast<const ifElseStat *>(node)->getElseSequence(), false);
+            break;
+        case NodeKind::While:
+            f(static_cast<const whileStat *>(node)->getCondition(), true);
+            f(static_cast<const whileStat *>(node)->getSequence(), true);
+            break;
+        default:
+            break;
+        }
+    }
+
+    //! Where each variable is used, in top-level statements, for register
+    //! allocation. Uses inside loops weigh 8 times those outside.
+    std::vector<RegisterAllocation::Interval> live_intervals(const Symbols &symbols) const
+    {
+        std::vector<RegisterAllocation::Interval> intervals;
+        std::vector<int> index(symbols.size(), -1);
+        std::vector<std::pair<NodePtr,unsigned> > pending; //node and loop depth
+
+        for (unsigned statement = 0; statement < getBody().size(); statement++) {
+            pending.emplace_back(getBody().at(statement), 0);
+            while (!pending.empty()) {
+                NodePtr node = pending.back().first;
+                unsigned depth = pending.back().second;
+                pending.pop_back();
+
+                bool uses = node->kind == NodeKind::Variable || node->kind == NodeKind::Assign;
+                if (uses) {
+                    Symbol id = node->kind == NodeKind::Variable ? static_cast<const Variable *>(node)->getId()
+                                                                 : static_cast<const AssignOp *>(node)->getId();
+                    if (index[id] < 0) {
+                        index[id] = intervals.size();
+                        intervals.push_back(RegisterAllocation::Interval{id, statement, statement, 0});
+                    }
+                    intervals[index[id]].end = statement;
+                    intervals[index[id]].weight += 1 << (3 * std::min(depth, 8u));
+                }
+                for_each_child(node, [&](NodePtr child, bool in_loop) {
+                    if (child != nullptr) pending.emplace_back(child, depth + in_loop);
+                });
+            }
+        }
+        return intervals;
+    }
+
+    //! When small data cannot hold every variable, keep it for the most
+    //! used ones, weighed as for register allocation
+    void place_small_data(Symbols &symbols) const
+    {
+        std::vector<RegisterAllocation::Interval> intervals = live_intervals(symbols);
+        std::stable_sort(intervals.begin(), intervals.end(), [](const RegisterAllocation::Interval &a, const RegisterAllocation::Interval &b) {
+            return a.weight > b.weight;
+        });
+        std::vector<Symbol> ids;
+        for (const RegisterAllocation::Interval &interval : intervals) ids.push_back(interval.id);
+        symbols.place_small_data(ids);
+    }
+
+    //! Tell registers which allocated variables each while loop assigns,
+    //! folding inner loops into the loops around them
+    void find_loop_writes(RegisterAllocation &registers) const
+    {
+        std::vector<std::pair<NodePtr,bool> > pending; //node, and whether it is being left
+        std::vector<NodePtr> loops;
+        pending.emplace_back(body, false);
+        while (!pending.empty()) {
+            NodePtr node = pending.back().first;
+            bool leaving = pending.back().second;
+            pending.pop_back();
+
+            if (leaving) {
+                loops.pop_back();
+                if (!loops.empty()) registers.loop_includes(loops.back(), node);
+                continue;
+            }
+            if (node->kind == NodeKind::Assign && !loops.empty()) {
+                registers.loop_assigns(loops.back(), static_cast<const AssignOp *>(node)->getId());
+            }
+            if (node->kind == NodeKind::While) {
+                loops.push_back(node);
+                pending.emplace_back(node, true);
+            }
+            for_each_child(node, [&](NodePtr child, bool) {
+                if (child != nullptr) pending.emplace_back(child, false);
+            });
+        }
+    }
+
+    static void generate_prologue(std::ostream &dst, const Context &context)
+    {
+        if (context.calls_printf()) dst<<"\t.rdata\n\t.align\t2\n$LC0:\n\t.ascii\t\"%d\\012\\000\"\n";
+        dst<<"\t.text\n\t.align\t2\n\t.globl\tmain\n"
+           <<"\t.set\tnomips16\n\t.set\tnomicromips\n"
+           <<"\t.ent\tmain\n\t.type\tmain, @function\nmain:\n"
+           <<"\t.set\tnoreorder\n\t.cpload\t$25\n"
+           <<"\tb\t$FRAME\n\tnop\n$BODY:\n";
+    }
+
+    static void generate_epilogue(std::ostream &dst, Context &context)
+    {
+        //$ra, $fp and the $s registers in use sit at the top
+        int saved = context.registers() != nullptr ? context.registers()->saved_registers() : 4;
+        unsigned frame = (context.size() + 8 + 4*saved + 7) & ~7u;
+        //past 32KB the frame is too big for addiu and the offsets of the
+        //saved registers, so they get a frame of their own at the top and
+        //the rest is allocated below it
+        unsigned top = frame <= 32767 ? frame : (8 + 4*saved + 7) & ~7u;
+        if (!context.calls_printf()) dst<<"\tbal\t$FLUSH\n\tnop\n";
+        dst<<"\tmove\t$2,$0\n\tmove\t$sp,$fp\n";
+        if (top != frame) dst<<"\tli\t$3,"<<frame - top<<"\n\taddu\t$sp,$sp,$3\n";
+        restore_registers(dst, top, saved);
+        dst<<"\taddiu\t$sp,$sp,"<<top<<"\n"
+           <<"\tj\t$31\n\tnop\n";
+
+        dst<<"$FRAME:\n"
+           <<"\t.frame\t$fp,"<<frame<<",$31\n"
+           <<"\t.mask\t0x"<<std::hex<<(0xc0000000u | ((1u << saved) - 1) << 16)<<std::dec<<",-4\n"
+           <<"\t.fmask\t0x00000000,0\n"
+           <<"\taddiu\t$sp,$sp,-"<<top<<"\n";
+        save_registers(dst, top, saved);
+        if (top != frame) dst<<"\tli\t$3,"<<frame - top<<"\n\tsubu\t$sp,$sp,$3\n";
+        dst<<"\tmove\t$fp,$sp\n\t.cprestore\t16\n"
+           <<"\tb\t$BODY\n\tnop\n"
+           <<"\t.set\treorder\n\t.end\tmain\n\t.size\tmain, .-main\n\n";
+        if (!context.calls_printf()) generate_print_runtime(dst);
+
+        //variables go next to each other in small data, reached from $gp
+        //in one instruction, with the most used ones first so they share
+        //cache lines; those it had no room for go to .bss
+        const Symbols &symbols = context.symbols();
+        std::vector<Symbol> small, large;
+        for (Symbol id = 0; id < symbols.size(); id++) {
+            if (symbols.is_global(id)) (symbols.placed_small(id) ? small : large).push_back(id);
+        }
+        std::stable_sort(small.begin(), small.end(), [&](Symbol a, Symbol b) {
+            return symbols.access_count(a) > symbols.access_count(b);
+        });
+        if (!small.empty()) dst<<"\t.section\t.sbss,\"aw\",@nobits\n\t.align\t2\n";
+        for (Symbol id : small) GlobalDeclList(nullptr, id).generate_assembly(dst, context, "int");
+        if (!large.empty()) dst<<"\t.section\t.bss,\"aw\",@nobits\n\t.align\t2\n";
+        for (Symbol id : large) GlobalDeclList(nullptr, id).generate_assembly(dst, context, "int");
+    }
+
+private:
+    static void save_registers(std::ostream &dst, unsigned frame, int saved)
+    {
+        dst<<"\tsw\t$31,"<<frame-4<<"($sp)\n\tsw\t$fp,"<<frame-8<<"($sp)\n";
+        for (int i = saved-1; i >= 0; i--) dst<<"\tsw\t$s"<<i<<","<<frame-8-4*saved+4*i<<"($sp)\n";
+    }
+
+    static void restore_registers(std::ostream &dst, unsigned frame, int saved)
+    {
+        dst<<"\tlw\t$31,"<<frame-4<<"($sp)\n\tlw\t$fp,"<<frame-8<<"($sp)\n";
+        for (int i = saved-1; i >= 0; i--) dst<<"\tlw\t$s"<<i<<","<<frame-8-4*saved+4*i<<"($sp)\n";
     }
 };
 
+//! Receives each top-level statement as soon as the parser completes it
+class StatementSink
+{
+public:
+    virtual ~StatementSink()
+    {}
+
+    virtual void statement(NodePtr stat) =0;
+};
+
+//! Streaming form of Program: main is generated one top-level statement
+//! at a time and each statement's nodes are dropped once written, so
+//! memory is bounded by the largest statement rather than the program.
+class ProgramStream : public StatementSink
+{
+private:
+    std::ostream &dst;
+    Context &context;
+    Arena &arena;
+    CodegenStack stack;
+    int mark;
+public:
+    ProgramStream(std::ostream &_dst, Context &_context, Arena &_arena)
+            : dst(_dst),
+            context(_context),
+            arena(_arena),
+            mark(_context.mem_init())
+        {
+            Program::generate_prologue(dst, context);
+        }
+
+    virtual void statement(NodePtr stat) override
+    {
+        context.set_mem(mark);
+        stack.push(stat);
+        stack.run(dst, context);
+        arena.reset();
+    }
+
+    void finish()
+    {
+        Program::generate_epilogue(dst, context);
+    }
+};
 
 #endif
@@ -0,0 +1,169 @@
+#ifndef symbols_hpp
+#define symbols_hpp
+
+#include <cstdint>
+#include <deque>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+//! Dense id of an interned identifier
+typedef unsigned Symbol;
+
+//! Interns identifiers as they are lexed so the rest of the compiler
+//! works with dense integer ids. Names live in a deque so the views used
+//! as hash keys stay valid as the table grows.
+class Symbols
+{
+private:
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, Symbol> ids;
+    std::vector<bool> globals;
+    std::vector<unsigned> accesses; //loads and stores emitted, by global
+    enum Placement : uint8_t { Unplaced, Small, Large };
+    std::vector<Placement> placement; //by global
+    unsigned small_left = small_data_capacity;
+
+public:
+    //! Globals .sbss can hold: a %gp_rel offset into it is a signed 16-bit
+    //! field, so 32KB, less the word the print runtime keeps there
+    static const unsigned small_data_capacity = 32768 / 4 - 1;
+
+    Symbol intern(std::string_view text)
+    {
+        auto it = ids.find(text);
+        if (it != ids.end()) return it->second;
+
+        Symbol id = names.size();
+        names.emplace_back(text);
+        globals.push_back(false);
+        accesses.push_back(0);
+        placement.push_back(Unplaced);
+        ids.emplace(names.back(), id);
+        return id;
+    }
+
+    const std::string &name(Symbol id) const
+    { return names[id]; }
+
+    unsigned size() const
+    { return names.size(); }
+
+    void set_global(Symbol id)
+    { globals[id] = true; }
+
+    bool is_global(Symbol id) const
+    { return globals[id]; }
+
+    //! Record a load or store of global id in the generated code, so the
+    //! most used ones can be laid out first
+    void count_access(Symbol id)
+    { accesses[id]++; }
+
+    unsigned access_count(Symbol id) const
+    { return accesses[id]; }
+
+    //! Whether global id is in small data, reached from $gp in one
+    //! instruction, rather than in .bss. The first time a global is asked
+    //! about it takes a place there while any are left.
+    bool small_data(Symbol id)
+    {
+        if (placement[id] == Unplaced) {
+            placement[id] = small_left > 0 ? Small : Large;
+            if (small_left > 0) small_left--;
+        }
+        return placement[id] == Small;
+    }
+
+    bool placed_small(Symbol id) const
+    { return placement[id] == Small; }
+
+    //! Give the places in small data out up front, in the order of ids,
+    //! and leave every global not among them to .bss
+    void place_small_data(const std::vector<Symbol> &ids)
+    {
+        for (Symbol id : ids) {
+            if (small_left == 0) break;
+            if (placement[id] != Unplaced) continue;
+            placement[id] = Small;
+            small_left--;
+        }
+        small_left = 0;
+    }
+
+    void clear()
+    {
+        ids.clear();
+        names.clear();
+        globals.clear();
+        accesses.clear();
+        placement.clear();
+        small_left = small_data_capacity;
+    }
+};
+
+//! Load or store ("lw" or "sw") of global id and register reg. Small data
+//! takes one instruction from $gp; a global in .bss has its address read
+//! from the GOT first, into reg for a load and into $t0 for a store.
+inline void global_access(std::ostream &dst, Symbols &symbols, const char *op, const std::string &reg, Symbol id, int offset = 0)
+{
+    symbols.count_access(id);
+    std::string name = symbols.name(id);
+    if (offset != 0) name += "+" + std::to_string(offset);
+    if (symbols.small_data(id)) {
+        dst<<"\t"<<op<<"\t"<<reg<<",%gp_rel("<<name<<")($28)\n";
+        return;
+    }
+    std::string base = op[0] == 'l' ? reg : "$t0";
+    dst<<"\tlw\t"<<base<<",%got("<<symbols.name(id)<<")($28)\n"
+       <<"\t"<<op<<"\t"<<reg<<",%lo("<<name<<")("<<base<<")\n";
+}
+
+//! Bindings of every open scope in one array indexed by symbol. Binding a
+//! name records the entry it shadows so closing the scope can restore it.
+class ScopedBindings
+{
+public:
+    static const int unbound = -2;
+
+private:
+    struct Entry
+    {
+        int offset = unbound;
+        unsigned depth = 0;
+    };
+
+    std::vector<Entry> entries;
+    std::vector<std::pair<Symbol,Entry> > shadowed;
+
+public:
+    int lookup(Symbol id) const
+    { return id < entries.size() ? entries[id].offset : unbound; }
+
+    //! Whether id is already bound by the scope at the given depth
+    bool bound_at(Symbol id, unsigned depth) const
+    { return lookup(id) != unbound && entries[id].depth == depth; }
+
+    void bind(Symbol id, int offset, unsigned depth)
+    {
+        if (id >= entries.size()) entries.resize(id + 1);
+        shadowed.emplace_back(id, entries[id]);
+        entries[id].offset = offset;
+        entries[id].depth = depth;
+    }
+
+    size_t mark() const
+    { return shadowed.size(); }
+
+    void restore(size_t mark)
+    {
+        while (shadowed.size() > mark) {
+            entries[shadowed.back().first] = shadowed.back().second;
+            shadowed.pop_back();
+        }
+    }
+};
+
+#endif
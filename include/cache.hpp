@@ -0,0 +1,58 @@
+#ifndef cache_hpp
+#define cache_hpp
+
+#include "session.hpp"
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//! On-disk cache of generated assembly, keyed by a hash of the token
+//! stream, the options and the compiler binary, so edits that only touch
+//! whitespace still hit. Entries are written to a temporary file and
+//! renamed into place, so readers never see a partial entry and parallel
+//! builds can share one directory. Each process counts its hits, misses and
+//! stored bytes in memory and writes them to a file of its own in
+//! DIR/counts, so lookups never wait on another compile. They are added
+//! into DIR/stats under an flock of DIR/lock after a store, which may have
+//! pushed the cache over its size limit, and by --cache-stats. Hits refresh
+//! an entry's mtime; when the entries outgrow the size limit the least
+//! recently used are removed.
+class CompileCache
+{
+private:
+    std::string dir;
+    unsigned long long max_bytes;
+
+    struct Stats
+    {
+        unsigned long long hits = 0, misses = 0, bytes = 0, evictions = 0;
+    };
+
+    std::mutex pending_lock; //--batch threads share one cache
+    Stats pending;           //counted since the last flush
+
+    std::string entry_path(const std::string &key) const;
+    //! Write the pending counts to DIR/counts; then, if something was
+    //! stored and no other compile holds the lock, fold them into DIR/stats
+    void flush();
+    //! Add every file in DIR/counts to DIR/stats, evicting if over the
+    //! limit; the caller holds the lock
+    Stats fold_counts();
+    void evict(Stats &stats);
+
+public:
+    CompileCache(const std::string &dir, unsigned long long max_bytes);
+    ~CompileCache();
+
+    std::string key(const Symbols &symbols, const std::vector<Token> &tokens, const std::string &options) const;
+
+    //! Fill body with the cached assembly for key; counts a hit or a miss
+    bool lookup(const std::string &key, std::string &body);
+    void store(const std::string &key, const std::string &body);
+
+    void print_stats(FILE *out);
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef emitter_hpp
+#define emitter_hpp
+
+#include "peephole.hpp"
+
+#include <climits>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <errno.h>
+#include <unistd.h>
+
+//! Generated assembly collected in memory. Code generation writes to it as
+//! to any ostream, but nothing reaches the file until a whole buffer is
+//! full: with no file the buffer grows to hold everything, and its text can
+//! be read back or handed to the peephole rules as AsmLine records; with a
+//! file it is written out a megabyte at a time and by finish().
+class AsmEmitter : public std::ostream
+{
+private:
+    static const size_t spill_size = 1 << 20;
+
+    class Buffer : public std::streambuf
+    {
+    public:
+        std::string text;
+        int fd;
+
+        explicit Buffer(int _fd)
+            : fd(_fd)
+        { resize(fd >= 0 ? spill_size : 4096); }
+
+        size_t used() const
+        { return pptr() - pbase(); }
+
+        //! Move the put area to a buffer of size bytes, keeping what is in it
+        void resize(size_t size)
+        {
+            size_t kept = pbase() == nullptr ? 0 : used();
+            text.resize(size);
+            setp(&text[0], &text[0] + size);
+            for (; kept > INT_MAX; kept -= INT_MAX) pbump(INT_MAX);
+            pbump(kept);
+        }
+
+        void write_out()
+        {
+            for (const char *data = pbase(); data < pptr(); ) {
+                ssize_t n = ::write(fd, data, pptr() - data);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) throw std::runtime_error("out_file could not be written.");
+                data += n;
+            }
+            rewind();
+        }
+
+        void rewind()
+        { setp(pbase(), epptr()); }
+
+    protected:
+        //! Called when the put area is full, and never per line: std::flush
+        //! and std::endl do not write anything out
+        int_type overflow(int_type c) override
+        {
+            if (fd >= 0) write_out();
+            else resize(text.size() * 2);
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                *pptr() = traits_type::to_char_type(c);
+                pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+    };
+
+    Buffer buffer;
+
+public:
+    //! Keep all the text in memory
+    AsmEmitter()
+        : std::ostream(nullptr),
+        buffer(-1)
+    { rdbuf(&buffer); }
+
+    //! Write the text to fd as it fills the buffer; the caller still owns fd
+    explicit AsmEmitter(int fd)
+        : std::ostream(nullptr),
+        buffer(fd)
+    { rdbuf(&buffer); }
+
+    AsmEmitter(const AsmEmitter &) = delete;
+    AsmEmitter &operator=(const AsmEmitter &) = delete;
+
+    //! Text not yet written out; all of it when there is no file
+    std::string_view text() const
+    { return std::string_view(buffer.text.data(), buffer.used()); }
+
+    //! The text as lines for the peephole rules to work on
+    std::vector<AsmLine> lines() const
+    { return decode_assembly(text()); }
+
+    //! Start over, keeping the memory for the next compile
+    void clear()
+    {
+        buffer.rewind();
+        std::ostream::clear();
+    }
+
+    //! Write out what is left; throws if the file could not take it, now or
+    //! when the buffer last filled up
+    void finish()
+    {
+        if (bad()) throw std::runtime_error("out_file could not be written.");
+        if (buffer.fd >= 0) buffer.write_out();
+    }
+};
+
+#endif
@@ -0,0 +1,256 @@
+#ifndef ir_hpp
+#define ir_hpp
+
+#include "ast/symbols.hpp"
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+class Program;
+
+//! Three-address code for the optimizing pipeline. Operands are program
+//! variables, virtual registers ("temps") or 32-bit constants. Variables
+//! are only ever read back by the program itself, so like temps they are
+//! plain values that start at 0, with no memory behind them.
+enum class Opcode : uint8_t
+{
+    Copy,                                //dst = a
+    Add, Sub, Mul, Div, Less, Equals,    //dst = a op b; Div traps on a zero divisor
+    Print,                               //print a
+    Jump,                                //to succ[0]
+    Branch,                              //to succ[0] if a is non-zero, else succ[1]
+    Return                               //leave main
+};
+
+enum class OperandKind : uint8_t
+{
+    None, Temp, Var, Imm
+};
+
+struct Operand
+{
+    OperandKind kind;
+    int32_t value; //temp number, symbol or constant
+
+    static Operand none() { return Operand{OperandKind::None, 0}; }
+    static Operand temp(unsigned n) { return Operand{OperandKind::Temp, (int32_t)n}; }
+    static Operand var(Symbol id) { return Operand{OperandKind::Var, (int32_t)id}; }
+    static Operand imm(int32_t value) { return Operand{OperandKind::Imm, value}; }
+
+    //! Temps and variables, as opposed to constants and nothing
+    bool is_value() const
+    { return kind == OperandKind::Temp || kind == OperandKind::Var; }
+
+    bool operator==(const Operand &other) const
+    { return kind == other.kind && value == other.value; }
+    bool operator!=(const Operand &other) const
+    { return !(*this == other); }
+};
+
+//! 16 bytes: the opcode and the kinds of dst, a and b, then their values
+struct Instruction
+{
+    Opcode op;
+    OperandKind kinds[3];
+    int32_t values[3];
+
+    Instruction(Opcode _op, Operand dst = Operand::none(), Operand a = Operand::none(), Operand b = Operand::none())
+        : op(_op),
+        kinds{dst.kind, a.kind, b.kind},
+        values{dst.value, a.value, b.value}
+    {}
+
+    Operand operand(unsigned i) const
+    { return Operand{kinds[i], values[i]}; }
+
+    void set(unsigned i, Operand o)
+    {
+        kinds[i] = o.kind;
+        values[i] = o.value;
+    }
+
+    Operand dst() const { return operand(0); }
+    Operand a() const { return operand(1); }
+    Operand b() const { return operand(2); }
+
+    bool is_terminator() const
+    { return op == Opcode::Jump || op == Opcode::Branch || op == Opcode::Return; }
+};
+
+//! Instructions [first, first+count) of the program's code; the last one
+//! is the terminator
+struct BasicBlock
+{
+    unsigned first, count;
+    int succ[2]; //-1 when absent
+
+    unsigned end() const
+    { return first + count; }
+};
+
+//! Block 0 is the entry. Blocks are kept in layout order and their code
+//! is contiguous in it, so a pass walks one array front to back.
+class IrProgram
+{
+public:
+    const Symbols *symbols;
+    std::vector<Instruction> code;
+    std::vector<BasicBlock> blocks;
+    unsigned temps = 0;
+
+    IrProgram(const Symbols &_symbols)
+        : symbols(&_symbols)
+    {}
+
+    //! Dense numbering of variables then temps, for per-value tables
+    unsigned values() const
+    { return symbols->size() + temps; }
+
+    unsigned value_index(Operand o) const
+    { return o.kind == OperandKind::Var ? o.value : symbols->size() + o.value; }
+
+    Operand new_temp()
+    { return Operand::temp(temps++); }
+
+    const Instruction &terminator(unsigned block) const
+    { return code[blocks[block].end() - 1]; }
+
+    std::vector<std::vector<unsigned> > predecessors() const;
+
+    //! Drop every instruction remove(insn) accepts, other than terminators,
+    //! closing the gaps so blocks stay contiguous and in order
+    template<class F>
+    void erase_if(F remove)
+    {
+        unsigned out = 0;
+        for (BasicBlock &block : blocks) {
+            unsigned first = out;
+            for (unsigned i = block.first; i < block.end(); i++) {
+                if (!code[i].is_terminator() && remove(code[i])) continue;
+                code[out++] = code[i];
+            }
+            block.first = first;
+            block.count = out - first;
+        }
+        code.resize(out, Instruction(Opcode::Return));
+    }
+};
+
+//! Set of value indexes
+class ValueSet
+{
+private:
+    std::vector<uint64_t> words;
+public:
+    ValueSet(unsigned size = 0)
+        : words((size + 63) / 64, 0)
+    {}
+
+    bool contains(unsigned i) const
+    { return words[i / 64] >> (i % 64) & 1; }
+
+    void insert(unsigned i)
+    { words[i / 64] |= uint64_t(1) << (i % 64); }
+
+    void erase(unsigned i)
+    { words[i / 64] &= ~(uint64_t(1) << (i % 64)); }
+
+    //! Add everything in other; true if that added anything
+    bool merge(const ValueSet &other)
+    {
+        bool changed = false;
+        for (size_t w = 0; w < words.size(); w++) {
+            uint64_t merged = words[w] | other.words[w];
+            changed |= merged != words[w];
+            words[w] = merged;
+        }
+        return changed;
+    }
+
+    template<class F>
+    void for_each(F f) const
+    {
+        for (size_t w = 0; w < words.size(); w++) {
+            for (uint64_t bits = words[w]; bits != 0; bits &= bits - 1) f(w * 64 + __builtin_ctzll(bits));
+        }
+    }
+};
+
+//! Values live on entry to and exit from each block. Most temps die in
+//! the block that defines them, so the sets only cover the values read
+//! somewhere before being written there, numbered by position in globals.
+struct Liveness
+{
+    std::vector<unsigned> globals; //value index of each set member
+    std::vector<ValueSet> in, out;
+
+    template<class F>
+    void for_each_in(unsigned block, F f) const
+    { in[block].for_each([&](unsigned g) { f(globals[g]); }); }
+
+    template<class F>
+    void for_each_out(unsigned block, F f) const
+    { out[block].for_each([&](unsigned g) { f(globals[g]); }); }
+};
+
+//! Natural loops found from the dominator tree, outermost first
+struct LoopNest
+{
+    struct Loop
+    {
+        unsigned header;
+        std::vector<unsigned> blocks; //in reverse post-order
+        int entry; //the only way in from outside, ending in a jump; -1 if none
+    };
+
+    std::vector<int> order; //position of each block in reverse post-order, -1 if unreachable
+    std::vector<unsigned> idom; //immediate dominator of each reachable block, 0 for the entry
+    std::vector<unsigned> pre, post; //dominator tree numbering
+    std::vector<Loop> loops;
+
+    bool dominates(unsigned a, unsigned b) const
+    { return pre[a] <= pre[b] && post[b] <= post[a]; }
+};
+
+//! The blocks in layout order as instruction selection emits them: each
+//! falls through to the next where it can, so only blocks branched to get
+//! a label, and a comparison whose result only the block's branch reads
+//! is done by the branch itself
+struct BlockLayout
+{
+    std::vector<bool> labelled;
+    bool exit_labelled = false;              //a return before the last block
+    std::vector<const Instruction *> fused;  //by block, the comparison or nullptr
+};
+
+//! Defined in ir.cpp
+IrProgram lower_program(const Program &program, const Symbols &symbols);
+Liveness compute_liveness(const IrProgram &ir);
+LoopNest find_loops(const IrProgram &ir);
+BlockLayout lay_out_blocks(const IrProgram &ir);
+void print_ir(std::ostream &dst, const IrProgram &ir);
+
+//! Where each value lives for the code of one target
+struct Allocation
+{
+    std::vector<int> reg;     //by value index, -1 when spilled or unused
+    std::vector<int> slot;    //spill slot of spilled values from 0, -1 otherwise
+    unsigned slots = 0;       //spill slots needed
+    unsigned used_saved = 0;  //saved registers handed out
+};
+
+//! Defined in allocate.cpp: linear scan over one interval per value,
+//! giving out the registers of the two masks. Values live across a print,
+//! which is a call, only get saved registers; others prefer temporary ones.
+Allocation allocate_registers(const IrProgram &ir, const Liveness &live, unsigned temporary, unsigned saved);
+
+//! Defined in select.cpp: main in MIPS assembly, without the file header,
+//! printing through printf or the runtime of ast/runtime.hpp
+void select_mips(std::ostream &dst, const IrProgram &ir, bool printf_calls = false);
+
+//! Defined in select_x86_64.cpp: main in System V x86-64 assembly, in AT&T
+//! syntax without the file header, printing through printf
+void select_x86_64(std::ostream &dst, const IrProgram &ir);
+
+#endif
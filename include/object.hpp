@@ -0,0 +1,15 @@
+#ifndef object_hpp
+#define object_hpp
+
+#include "peephole.hpp"
+
+#include <ostream>
+#include <vector>
+
+//! Assemble the lines of a whole file, .file directive to data, into a
+//! MIPS32 o32 ELF relocatable object and write it to dst. Only what the
+//! code generators emit is understood; anything else throws a
+//! std::runtime_error naming the line. Defined in object.cpp.
+void write_object(std::ostream &dst, const std::vector<AsmLine> &lines, bool little_endian = false);
+
+#endif
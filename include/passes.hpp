@@ -0,0 +1,42 @@
+#ifndef passes_hpp
+#define passes_hpp
+
+#include "ir.hpp"
+
+#include <utility>
+#include <vector>
+
+//! Optimizations over the IR, one per file
+
+//! Result of op on two constants as MIPS computes it, or false if op
+//! cannot be evaluated early, as when a division by zero has to trap
+bool evaluate(Opcode op, int32_t a, int32_t b, int32_t &result);
+
+//! fold.cpp: evaluate operations on known values with the results MIPS
+//! would give, replace uses of variables holding a known constant at that
+//! point, and turn branches on a known condition into jumps
+void fold_constants(IrProgram &ir);
+
+//! licm.cpp: move what a loop computes the same way on every iteration
+//! in front of it, unless that could print or trap sooner
+void hoist_loop_invariants(IrProgram &ir);
+
+//! strength.cpp: keep products of a loop counter and a constant up to
+//! date by adding to them as the counter steps, instead of multiplying
+void reduce_induction_variables(IrProgram &ir);
+
+//! dce.cpp: drop blocks nothing branches to, instructions whose result
+//! is never read and blocks that only jump on, then merge straight-line
+//! blocks
+void eliminate_dead_code(IrProgram &ir);
+
+//! Instructions left after each step of the pipeline, for --pass-report
+struct PassReport
+{
+    std::vector<std::pair<const char *,size_t> > counts;
+
+    void record(const char *step, size_t instructions)
+    { counts.emplace_back(step, instructions); }
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef peephole_hpp
+#define peephole_hpp
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+//! A line of generated assembly as the peephole rules see it: an
+//! instruction split into its mnemonic and operands, a label, or anything
+//! else (directives, .reloc) kept whole in op. Operand spellings are kept
+//! as written, so a line the rules leave alone prints back unchanged.
+struct AsmLine
+{
+    enum Kind : uint8_t
+    {
+        Instruction, Label, Other, Removed
+    };
+
+    Kind kind;
+    uint8_t count = 0;  //operands in use
+    std::string label;  //label sharing the line, as in "1:\tjalr"
+    std::string op;
+    std::string args[3];
+
+    AsmLine(Kind _kind, std::string _op)
+        : kind(_kind),
+        op(std::move(_op))
+    {}
+};
+
+//! Rewrites made by each rule of the table, in table order
+struct PeepholeReport
+{
+    std::vector<std::pair<const char *,size_t> > hits;
+};
+
+//! Defined in peephole.cpp
+std::vector<AsmLine> decode_assembly(std::string_view text);
+void encode_assembly(std::ostream &dst, const std::vector<AsmLine> &lines);
+
+//! Number of a register operand, whether written $16 or $s0; -1 otherwise
+int register_number(const std::string &name);
+
+//! Apply every rule of the table wherever it matches, until none does
+void run_peephole(std::vector<AsmLine> &lines, PeepholeReport *report = nullptr);
+
+//! Fill branch delay slots and split loads from their first use, for
+//! .set noreorder code; the counts are added to the report
+void fill_delay_slots(std::vector<AsmLine> &lines, PeepholeReport *report = nullptr);
+
+#endif
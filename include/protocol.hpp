@@ -0,0 +1,183 @@
+#ifndef protocol_hpp
+#define protocol_hpp
+
+// Wire format of the compile server, shared by the server, the client and
+// the benchmarks. Only POSIX calls are used so the client stays small and
+// starts fast.
+//
+// A connection carries any number of requests, each answered in turn:
+//
+//   request:  <path|source> <flags> <name-length> <source-length>\n<name><source>
+//   reply:    <ok|error> <length>\n<assembly or message>
+//
+// <name> is only used in the .file directive. A source request compiles the
+// text that follows it; a path request sends instead the absolute path of
+// the file for the server to map. <flags> is "-" or any of "s" for the
+// streaming code generator, "O" for -O, "O2" for -O2 and "p" for --printf.
+// A request over the limits below is answered with an error and the
+// connection is closed.
+//
+// The socket lives in a directory no other user can write to, and each end
+// checks that the other runs as the same user, so nobody else can compile
+// through our server or hand our client their own assembly.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define COMPILER_SOCKET_NAME "compiler.sock"
+#define MAX_NAME_LENGTH 4096
+#define MAX_SOURCE_LENGTH (64u << 20)
+
+//! Socket path from $COMPILER_SOCKET, else compiler.sock in $XDG_RUNTIME_DIR,
+//! else in /tmp/compiler-<uid>, which the server creates with mode 0700
+inline const char *server_socket_path()
+{
+    static std::string path;
+    if (path.empty()) {
+        const char *socket = getenv("COMPILER_SOCKET");
+        const char *runtime = getenv("XDG_RUNTIME_DIR");
+        if (socket != nullptr && *socket != '\0') path = socket;
+        else if (runtime != nullptr && *runtime != '\0') path = std::string(runtime) + "/" COMPILER_SOCKET_NAME;
+        else path = "/tmp/compiler-" + std::to_string(getuid()) + "/" COMPILER_SOCKET_NAME;
+    }
+    return path.c_str();
+}
+
+//! Create the directory of the socket if it is missing, then check that it
+//! is ours and that no one else can write to it; false with errno set if not
+inline bool private_socket_directory(const char *path)
+{
+    std::string directory(path);
+    size_t slash = directory.rfind('/');
+    if (slash == std::string::npos) directory = ".";
+    else directory.resize(slash == 0 ? 1 : slash);
+    if (mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST) return false;
+    struct stat info;
+    if (lstat(directory.c_str(), &info) != 0) return false;
+    if (!S_ISDIR(info.st_mode) || info.st_uid != geteuid() || (info.st_mode & 022) != 0) {
+        errno = EACCES;
+        return false;
+    }
+    return true;
+}
+
+//! Whether the process at the other end of fd runs as this user
+inline bool same_user_peer(int fd)
+{
+#ifdef SO_PEERCRED
+    ucred credentials;
+    socklen_t size = sizeof credentials;
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) == 0
+        && credentials.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(fd, &uid, &gid) == 0 && uid == geteuid();
+#endif
+}
+
+inline bool socket_address(const char *path, sockaddr_un &address)
+{
+    memset(&address, 0, sizeof address);
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof address.sun_path) return false;
+    strcpy(address.sun_path, path);
+    return true;
+}
+
+//! Connected socket, or -1 if no server of this user is listening
+inline int connect_server(const char *path)
+{
+    sockaddr_un address;
+    if (!socket_address(path, address)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (sockaddr *)&address, sizeof address) != 0 || !same_user_peer(fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline bool write_all(int fd, const char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+//! Write every part with writev, picking up where a short write stopped
+inline bool write_all(int fd, iovec *parts, int count)
+{
+    for (ssize_t n = 0; ; ) {
+        for (; count > 0 && (size_t)n >= parts->iov_len; parts++, count--) n -= parts->iov_len;
+        if (count == 0) return true;
+        parts->iov_base = (char *)parts->iov_base + n;
+        parts->iov_len -= n;
+        do n = writev(fd, parts, count); while (n < 0 && errno == EINTR);
+        if (n <= 0) return false;
+    }
+}
+
+inline bool read_all(int fd, char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = read(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+//! Read a header line a byte at a time so nothing past it is consumed
+inline bool read_header(int fd, char *line, size_t size)
+{
+    for (size_t i = 0; i + 1 < size; i++) {
+        if (!read_all(fd, line + i, 1)) return false;
+        if (line[i] == '\n') {
+            line[i] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+//! Send one request; source is the file's path for a path request
+inline bool send_request(int fd, bool is_path, const char *flags, const std::string &name, const std::string &source)
+{
+    char header[96];
+    int length = snprintf(header, sizeof header, "%s %s %zu %zu\n", is_path ? "path" : "source",
+                          *flags != '\0' ? flags : "-", name.size(), source.size());
+    return write_all(fd, header, length) && write_all(fd, name.data(), name.size())
+        && write_all(fd, source.data(), source.size());
+}
+
+//! Wait for the reply to a request; false if the connection dropped
+inline bool read_reply(int fd, bool &ok, std::string &body)
+{
+    char header[96], status[16];
+    size_t length;
+    if (!read_header(fd, header, sizeof header)) return false;
+    if (sscanf(header, "%15s %zu", status, &length) != 2) return false;
+    ok = strcmp(status, "ok") == 0;
+    body.resize(length);
+    return read_all(fd, &body[0], length);
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef server_hpp
+#define server_hpp
+
+#include "session.hpp"
+#include "target.hpp"
+
+#include <ostream>
+#include <string>
+
+//! Code generation entry points, defined in compiler.cpp
+void print_assembly(std::ostream &dst, std::string fileName, Session &session, int optimize = 0, const Target &target = mips_target());
+void stream_assembly(std::ostream &dst, std::string fileName, Session &session);
+
+//! Serve compile requests on a Unix socket until killed. Each worker
+//! keeps one Session for every request it handles, so compiles after the
+//! first reuse the arena blocks, parser lists and scanner.
+int run_server(const char *socket_path, unsigned workers);
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef session_hpp
+#define session_hpp
+
+#include "ast/base.hpp"
+#include "ast/symbols.hpp"
+#include "ast/arena.hpp"
+#include "source.hpp"
+
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+typedef void *yyscan_t;
+
+class StatementSink;
+
+//! A lexed token kept for hashing or parsing later. value is the integer
+//! of a T_INT or the symbol of a T_STRING, otherwise 0.
+struct Token
+{
+    int kind;
+    int value;
+};
+
+//! Everything one compilation owns: the scanner, the parser's scratch
+//! lists, the AST arena and the symbol table. Nothing is shared between
+//! sessions, so separate files can be compiled on separate threads.
+class Session
+{
+private:
+    yyscan_t scanner;
+    void *buffer = nullptr; //flex buffer over in-memory text, if any
+
+    //statement lists are collected in reusable vectors, then copied into
+    //a flat array in the arena once the list is complete
+    std::deque<std::vector<NodePtr> > lists;
+    std::vector<std::vector<NodePtr> *> spare_lists;
+
+public:
+    Arena arena;
+    Symbols symbols;
+
+    const Node *root = nullptr;
+    StatementSink *sink = nullptr; //set when statements are compiled as they are parsed
+    bool printf_calls = false;     //print through printf, not the runtime in ast/runtime.hpp
+    std::string error;
+
+    Session();
+    ~Session();
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
+
+    //! Scan from a stdio stream
+    void read_file(FILE *source);
+    //! Scan a mapped file in place; source must outlive the parse
+    void read_mapped(const MappedSource &source)
+    { read_buffer(source.data(), source.scan_size()); }
+    //! Scan text in place; the last two of size bytes must be NUL
+    void read_buffer(char *text, size_t size);
+
+    //! Drop the previous compilation's tree and symbols but keep the
+    //! memory, so a long-running process starts each compile warm
+    void reset()
+    {
+        arena.reset();
+        symbols.clear();
+        root = nullptr;
+        error.clear();
+    }
+
+    yyscan_t lexer() const
+    { return scanner; }
+
+    //! Parse the whole program; throws std::runtime_error on a syntax error
+    const Node *parse();
+    //! Hand each top-level statement to sink as soon as it is complete
+    void parse_statements(StatementSink &sink);
+
+    //! Lex the whole input without parsing it
+    void tokenize(std::vector<Token> &tokens);
+    //! parse() and parse_statements() over tokens recorded by tokenize()
+    const Node *parse(const std::vector<Token> &tokens);
+    void parse_statements(StatementSink &sink, const std::vector<Token> &tokens);
+
+    std::vector<NodePtr> *new_list()
+    {
+        if (spare_lists.empty()) {
+            lists.emplace_back();
+            return &lists.back();
+        }
+        std::vector<NodePtr> *list = spare_lists.back();
+        spare_lists.pop_back();
+        return list;
+    }
+
+    void free_list(std::vector<NodePtr> *list)
+    {
+        list->clear();
+        spare_lists.push_back(list);
+    }
+};
+
+#endif
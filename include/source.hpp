@@ -0,0 +1,74 @@
+#ifndef source_hpp
+#define source_hpp
+
+#include <string>
+#include <string_view>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//! A source file mapped into memory so the lexer can scan it in place.
+//! flex needs two NUL bytes after the text, so the mapping is laid over an
+//! anonymous reservation that is at least two bytes longer than the file.
+class MappedSource
+{
+private:
+    char *base = nullptr;
+    size_t length = 0;
+    size_t reserved = 0;
+
+public:
+    explicit MappedSource(const std::string &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("source_file could not be opened.");
+
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            throw std::runtime_error("source_file could not be read.");
+        }
+        length = info.st_size;
+
+        size_t page = sysconf(_SC_PAGESIZE);
+        reserved = (length + 2 + page - 1) / page * page;
+        void *region = mmap(nullptr, reserved, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("source_file could not be mapped.");
+        }
+        // flex briefly writes a NUL after each token, so the file mapping is
+        // private: only the pages it touches are ever copied
+        if (length != 0 && mmap(region, length, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            munmap(region, reserved);
+            close(fd);
+            throw std::runtime_error("source_file could not be mapped.");
+        }
+        close(fd);
+        madvise(region, reserved, MADV_SEQUENTIAL);
+        base = static_cast<char *>(region);
+    }
+
+    MappedSource(const MappedSource &) = delete;
+    MappedSource &operator=(const MappedSource &) = delete;
+
+    ~MappedSource()
+    { if (base != nullptr) munmap(base, reserved); }
+
+    char *data() const
+    { return base; }
+
+    size_t size() const
+    { return length; }
+
+    //! Size of the buffer handed to yy_scan_buffer, including the two NULs
+    size_t scan_size() const
+    { return length + 2; }
+};
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef target_hpp
+#define target_hpp
+
+#include "ir.hpp"
+
+#include <ostream>
+#include <string>
+
+//! A machine to generate code for. Every target selects instructions for
+//! main from the IR; MIPS is also generated straight from the AST below
+//! -O2, and only its code goes through the peephole rules.
+class Target
+{
+public:
+    virtual ~Target() {}
+
+    //! As given to --target
+    virtual const char *name() const = 0;
+
+    //! The directives in front of main
+    virtual void print_header(std::ostream &dst, const std::string &fileName) const = 0;
+
+    //! main and the data it needs, from the IR of the whole program
+    virtual void select(std::ostream &dst, const IrProgram &ir, bool printf_calls) const = 0;
+
+    virtual bool generates_from_ast() const
+    { return false; }
+};
+
+//! Defined in target.cpp: the default target, and the one named, or
+//! nullptr if there is none
+const Target &mips_target();
+const Target *find_target(const std::string &name);
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef thread_pool_hpp
+#define thread_pool_hpp
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//! Fixed set of workers, each with its own deque of jobs. A worker takes
+//! the newest job from its own deque and, once that is empty, steals the
+//! oldest job from another worker. Jobs are all queued before run(), so a
+//! worker that finds every deque empty is done.
+class WorkStealingPool
+{
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<std::function<void()> > jobs;
+    };
+
+    std::vector<std::unique_ptr<Queue> > queues;
+    unsigned next = 0;
+
+    bool pop_own(unsigned id, std::function<void()> &job)
+    {
+        Queue &queue = *queues[id];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.jobs.empty()) return false;
+        job = std::move(queue.jobs.back());
+        queue.jobs.pop_back();
+        return true;
+    }
+
+    bool steal(unsigned id, std::function<void()> &job)
+    {
+        for (unsigned i = 1; i < queues.size(); i++) {
+            Queue &victim = *queues[(id + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (victim.jobs.empty()) continue;
+            job = std::move(victim.jobs.front());
+            victim.jobs.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void work(unsigned id)
+    {
+        std::function<void()> job;
+        while (pop_own(id, job) || steal(id, job)) job();
+    }
+
+public:
+    explicit WorkStealingPool(unsigned workers)
+    {
+        if (workers == 0) workers = 1;
+        for (unsigned i = 0; i < workers; i++) queues.emplace_back(new Queue);
+    }
+
+    unsigned size() const
+    { return queues.size(); }
+
+    //! Queue a job; jobs are dealt to the workers round-robin
+    void submit(std::function<void()> job)
+    {
+        queues[next]->jobs.push_back(std::move(job));
+        next = (next + 1) % queues.size();
+    }
+
+    //! Run every queued job, using the calling thread as worker 0
+    void run()
+    {
+        std::vector<std::thread> threads;
+        for (unsigned id = 1; id < queues.size(); id++) threads.emplace_back(&WorkStealingPool::work, this, id);
+        work(0);
+        for (std::thread &thread : threads) thread.join();
+    }
+};
+
+#endif
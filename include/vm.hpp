@@ -0,0 +1,49 @@
+#ifndef vm_hpp
+#define vm_hpp
+
+#include "ir.hpp"
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+//! Register bytecode for --run, lowered from the IR. Every operand is a
+//! slot of one frame of 32-bit values: the variables and the temps that
+//! live across blocks, then the temps of a single block, reused by every
+//! block, then the constants. Superinstructions take a constant k in b.
+enum class VmOp : uint8_t
+{
+    Copy,                                //dst = a
+    Add, Sub, Mul, Div, Less, Equals,    //dst = a op b, as the IR computes them
+    AddK,                                //dst = a + k, for x := x + 1 or y - 2
+    Print,                               //print a
+    Jump,                                //to target
+    JumpIf, JumpIfNot,                   //to target if a is non-zero, or zero
+    JumpLess, JumpNotLess,               //to target if a < b, or not
+    JumpLessK, JumpNotLessK,             //to target if a < k, or not: while x < K
+    JumpEqual, JumpNotEqual,             //to target if a = b, or not
+    AddKJumpLessK,                       //dst += a, then to target if dst < k: a loop's counter step and test
+    Halt                                 //leave main
+};
+
+struct VmInstruction
+{
+    VmOp op;
+    int32_t dst, a, b;
+    int32_t target; //index of the instruction jumped to
+};
+
+struct Bytecode
+{
+    std::vector<VmInstruction> code;
+    std::vector<int32_t> frame; //slots on entry: 0, apart from the constants
+};
+
+//! Defined in vm.cpp
+Bytecode compile_bytecode(const IrProgram &ir);
+
+//! Runs main, printing to dst. A division by zero throws once what was
+//! printed before it is written.
+void run_bytecode(const Bytecode &bytecode, std::ostream &dst);
+
+#endif
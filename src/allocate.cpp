@@ -0,0 +1,111 @@
+#include "ir.hpp"
+
+#include <algorithm>
+#include <climits>
+
+
+//positions: a use in instruction i is at 2i, its definition at 2i+1
+struct Interval
+{
+    unsigned value;
+    long start, end;
+    bool across_call;
+};
+
+Allocation allocate_registers(const IrProgram &ir, const Liveness &live, unsigned temporary, unsigned saved)
+{
+    unsigned count = ir.values();
+    std::vector<Interval> intervals(count);
+    for (unsigned v = 0; v < count; v++) intervals[v] = Interval{v, LONG_MAX, -1, false};
+    auto extend = [&](unsigned v, long position) {
+        intervals[v].start = std::min(intervals[v].start, position);
+        intervals[v].end = std::max(intervals[v].end, position);
+    };
+
+    std::vector<long> calls;
+    for (unsigned b = 0; b < ir.blocks.size(); b++) {
+        const BasicBlock &block = ir.blocks[b];
+        live.for_each_in(b, [&](unsigned v) { extend(v, 2*(long)block.first - 1); });
+        live.for_each_out(b, [&](unsigned v) { extend(v, 2*(long)block.end() - 1); });
+        for (unsigned i = block.first; i < block.end(); i++) {
+            const Instruction &insn = ir.code[i];
+            for (unsigned k = 1; k < 3; k++) {
+                if (insn.operand(k).is_value()) extend(ir.value_index(insn.operand(k)), 2*(long)i);
+            }
+            if (insn.dst().is_value()) extend(ir.value_index(insn.dst()), 2*(long)i + 1);
+            if (insn.op == Opcode::Print) calls.push_back(2*(long)i);
+        }
+    }
+
+    std::vector<Interval> order;
+    for (Interval &interval : intervals) {
+        if (interval.end < 0) continue;
+        auto call = std::upper_bound(calls.begin(), calls.end(), interval.start);
+        interval.across_call = call != calls.end() && *call < interval.end;
+        order.push_back(interval);
+    }
+    std::sort(order.begin(), order.end(), [](const Interval &a, const Interval &b) {
+        return a.start != b.start ? a.start < b.start : a.value < b.value;
+    });
+
+    Allocation result;
+    std::vector<int> &reg = result.reg, &slot = result.slot;
+    reg.assign(count, -1);
+    slot.assign(count, -1);
+    unsigned free = temporary | saved;
+    std::vector<const Interval *> active;
+    //end of the last interval spilled to each slot; a slot is only handed
+    //to an interval that starts after that, since a victim may have
+    //started well before the interval that pushed it out
+    std::vector<long> slot_end;
+    auto spill = [&](const Interval &interval) {
+        unsigned n = 0;
+        while (n < result.slots && slot_end[n] >= interval.start) n++;
+        if (n == result.slots) {
+            slot_end.push_back(interval.end);
+            result.slots++;
+        }
+        else slot_end[n] = interval.end;
+        slot[interval.value] = n;
+    };
+
+    for (const Interval &current : order) {
+        for (size_t i = 0; i < active.size(); ) {
+            if (active[i]->end < current.start) {
+                free |= 1u << reg[active[i]->value];
+                active[i] = active.back();
+                active.pop_back();
+            }
+            else i++;
+        }
+
+        unsigned allowed = current.across_call ? saved : temporary | saved;
+        unsigned candidates = free & allowed;
+        if (!current.across_call && (free & temporary) != 0) candidates &= temporary;
+        if (candidates != 0) {
+            int r = __builtin_ctz(candidates);
+            free &= ~(1u << r);
+            reg[current.value] = r;
+            active.push_back(&current);
+            continue;
+        }
+
+        //no register left: spill whichever suitable interval ends last
+        const Interval **victim = nullptr;
+        for (const Interval *&interval : active) {
+            if ((allowed >> reg[interval->value] & 1) && (victim == nullptr || interval->end > (*victim)->end)) victim = &interval;
+        }
+        if (victim != nullptr && (*victim)->end > current.end) {
+            reg[current.value] = reg[(*victim)->value];
+            reg[(*victim)->value] = -1;
+            spill(**victim);
+            *victim = &current;
+        }
+        else spill(current);
+    }
+
+    for (int r : reg) {
+        if (r >= 0 && (saved >> r & 1)) result.used_saved |= 1u << r;
+    }
+    return result;
+}
@@ -0,0 +1,309 @@
+#include "cache.hpp"
+#include "sha256.hpp"
+#include "parser.tab.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//bump when the entry format changes
+static const char entry_magic[] = "compiler-cache 1 ";
+
+//a temporary file this old was left by a compile that died
+static const time_t stale_tmp_seconds = 3600;
+
+//a long --batch flushes its counts after this many lookups
+static const unsigned long long flush_lookups = 1024;
+
+
+static bool read_file(const std::string &path, std::string &data)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    bool ok = fstat(fd, &info) == 0;
+    if (ok) {
+        data.resize(info.st_size);
+        size_t done = 0;
+        while (ok && done < data.size()) {
+            ssize_t n = read(fd, &data[done], data.size() - done);
+            if (n <= 0) ok = false;
+            else done += n;
+        }
+    }
+    if (ok) futimens(fd, nullptr); //a hit makes the entry most recently used
+    close(fd);
+    return ok;
+}
+
+static bool write_file(const std::string &path, const std::string &data)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    return close(fd) == 0 && done == data.size();
+}
+
+//unique within the machine, so concurrent writers never share a file
+static std::string temporary_name()
+{
+    static std::atomic<unsigned> counter(0);
+    return ".tmp." + std::to_string(getpid()) + "."
+        + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + "."
+        + std::to_string(counter++);
+}
+
+
+static std::string format_stats(unsigned long long hits, unsigned long long misses,
+                                unsigned long long bytes, unsigned long long evictions)
+{
+    return "hits " + std::to_string(hits) + " misses " + std::to_string(misses)
+        + " bytes " + std::to_string(bytes) + " evictions " + std::to_string(evictions) + "\n";
+}
+
+
+CompileCache::CompileCache(const std::string &_dir, unsigned long long _max_bytes)
+    : dir(_dir),
+    max_bytes(_max_bytes)
+{
+    mkdir(dir.c_str(), 0755);
+}
+
+CompileCache::~CompileCache()
+{
+    flush();
+}
+
+std::string CompileCache::entry_path(const std::string &key) const
+{
+    return dir + "/" + key.substr(0, 2) + "/" + key.substr(2) + ".s";
+}
+
+std::string CompileCache::key(const Symbols &symbols, const std::vector<Token> &tokens, const std::string &options) const
+{
+    Sha256 hash;
+    hash.update(entry_magic);
+    hash.update(options + "\n");
+
+    //any rebuild of the compiler invalidates what it generated before
+    struct stat self;
+    if (stat("/proc/self/exe", &self) == 0) {
+        hash.update(std::to_string(self.st_size) + " " + std::to_string(self.st_mtim.tv_sec)
+                    + "." + std::to_string(self.st_mtim.tv_nsec) + "\n");
+    }
+
+    //symbol ids depend on the order names first appear, so hash the names
+    std::string buffer;
+    for (const Token &token : tokens) {
+        buffer += (char)(token.kind - 256);
+        if (token.kind == T_INT) buffer.append((const char *)&token.value, sizeof token.value);
+        else if (token.kind == T_STRING) buffer.append(symbols.name(token.value)).push_back('\0');
+        if (buffer.size() >= 64 * 1024) {
+            hash.update(buffer);
+            buffer.clear();
+        }
+    }
+    hash.update(buffer);
+    return hash.hex();
+}
+
+bool CompileCache::lookup(const std::string &key, std::string &body)
+{
+    std::string data;
+    bool hit = read_file(entry_path(key), data);
+
+    //an entry is its header and exactly the number of bytes it announces
+    size_t length = 0, start = 0;
+    if (hit) {
+        const char *header = data.c_str();
+        hit = data.compare(0, sizeof entry_magic - 1, entry_magic) == 0
+            && sscanf(header + sizeof entry_magic - 1, "%zu", &length) == 1;
+        start = data.find('\n') + 1;
+        hit = hit && start != 0 && data.size() - start == length;
+    }
+    if (hit) body.assign(data, start, length);
+
+    bool full;
+    {
+        std::lock_guard<std::mutex> guard(pending_lock);
+        if (hit) pending.hits++;
+        else pending.misses++;
+        full = pending.hits + pending.misses >= flush_lookups;
+    }
+    if (full) flush();
+    return hit;
+}
+
+void CompileCache::store(const std::string &key, const std::string &body)
+{
+    std::string path = entry_path(key);
+    std::string shard = path.substr(0, path.rfind('/'));
+    mkdir(shard.c_str(), 0755);
+
+    std::string data = entry_magic + std::to_string(body.size()) + "\n" + body;
+    std::string temporary = shard + "/" + temporary_name();
+    if (!write_file(temporary, data) || rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        return;
+    }
+
+    bool full;
+    {
+        std::lock_guard<std::mutex> guard(pending_lock);
+        pending.bytes += data.size();
+        full = pending.bytes >= max_bytes / 16;
+    }
+    if (full) flush();
+}
+
+void CompileCache::flush()
+{
+    Stats counts;
+    {
+        std::lock_guard<std::mutex> guard(pending_lock);
+        counts = pending;
+        pending = Stats();
+    }
+
+    //named like a temporary file, so no two processes or threads share one
+    std::string counts_dir = dir + "/counts";
+    if (counts.hits + counts.misses + counts.bytes > 0) {
+        mkdir(counts_dir.c_str(), 0755);
+        std::string name = temporary_name();
+        std::string temporary = counts_dir + "/" + name, path = counts_dir + "/" + name.substr(5);
+        if (!write_file(temporary, format_stats(counts.hits, counts.misses, counts.bytes, 0))
+            || rename(temporary.c_str(), path.c_str()) != 0) unlink(temporary.c_str());
+    }
+    if (counts.bytes == 0) return;
+
+    //if another compile is folding already it will see these counts, or the
+    //next store will, so a store never queues behind it
+    std::string lock_path = dir + "/lock";
+    int lock = open(lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (lock < 0) return;
+    if (flock(lock, LOCK_EX | LOCK_NB) == 0) {
+        fold_counts();
+        flock(lock, LOCK_UN);
+    }
+    close(lock);
+}
+
+CompileCache::Stats CompileCache::fold_counts()
+{
+    std::string stats_path = dir + "/stats", counts_dir = dir + "/counts";
+    Stats stats;
+    std::string text;
+    if (read_file(stats_path, text)) {
+        sscanf(text.c_str(), "hits %llu misses %llu bytes %llu evictions %llu",
+               &stats.hits, &stats.misses, &stats.bytes, &stats.evictions);
+    }
+
+    if (DIR *counts = opendir(counts_dir.c_str())) {
+        time_t now = time(nullptr);
+        while (dirent *file = readdir(counts)) {
+            std::string path = counts_dir + "/" + file->d_name;
+            struct stat info;
+            if (file->d_name[0] == '.') {
+                if (strncmp(file->d_name, ".tmp.", 5) == 0 && stat(path.c_str(), &info) == 0
+                    && now - info.st_mtime > stale_tmp_seconds) unlink(path.c_str());
+                continue;
+            }
+            Stats counted;
+            if (read_file(path, text)
+                && sscanf(text.c_str(), "hits %llu misses %llu bytes %llu", &counted.hits, &counted.misses, &counted.bytes) == 3) {
+                stats.hits += counted.hits;
+                stats.misses += counted.misses;
+                stats.bytes += counted.bytes;
+            }
+            unlink(path.c_str());
+        }
+        closedir(counts);
+    }
+    if (stats.bytes > max_bytes) evict(stats);
+
+    std::string temporary = dir + "/" + temporary_name();
+    text = format_stats(stats.hits, stats.misses, stats.bytes, stats.evictions);
+    if (!write_file(temporary, text) || rename(temporary.c_str(), stats_path.c_str()) != 0) unlink(temporary.c_str());
+    return stats;
+}
+
+//recounts the entries, since writers racing on one key are counted twice,
+//then removes the least recently used until a tenth of the limit is free
+void CompileCache::evict(Stats &stats)
+{
+    struct Entry
+    {
+        timespec used;
+        off_t size;
+        std::string path;
+    };
+    std::vector<Entry> entries;
+    unsigned long long total = 0;
+    time_t now = time(nullptr);
+
+    DIR *top = opendir(dir.c_str());
+    if (top == nullptr) return;
+    while (dirent *shard = readdir(top)) {
+        //shards are the first two hex digits of the key; this skips "." and ".."
+        const char *name = shard->d_name;
+        if (strlen(name) != 2 || !isxdigit((unsigned char)name[0]) || !isxdigit((unsigned char)name[1])) continue;
+        std::string shard_path = dir + "/" + shard->d_name;
+        DIR *files = opendir(shard_path.c_str());
+        if (files == nullptr) continue;
+        while (dirent *file = readdir(files)) {
+            std::string path = shard_path + "/" + file->d_name;
+            struct stat info;
+            if (file->d_name[0] == '.' || stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+                if (strncmp(file->d_name, ".tmp.", 5) == 0 && stat(path.c_str(), &info) == 0
+                    && now - info.st_mtime > stale_tmp_seconds) unlink(path.c_str());
+                continue;
+            }
+            entries.push_back(Entry{info.st_mtim, info.st_size, path});
+            total += info.st_size;
+        }
+        closedir(files);
+    }
+    closedir(top);
+
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+    });
+    for (const Entry &entry : entries) {
+        if (total <= max_bytes / 10 * 9) break;
+        if (unlink(entry.path.c_str()) == 0) {
+            total -= entry.size;
+            stats.evictions++;
+        }
+    }
+    stats.bytes = total;
+}
+
+void CompileCache::print_stats(FILE *out)
+{
+    std::string lock_path = dir + "/lock";
+    int lock = open(lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (lock < 0) return;
+    flock(lock, LOCK_EX);
+    Stats shown = fold_counts();
+    flock(lock, LOCK_UN);
+    close(lock);
+    unsigned long long lookups = shown.hits + shown.misses;
+    fprintf(out, "hits=%llu misses=%llu hit_rate=%.1f%% bytes=%llu limit=%llu evictions=%llu\n",
+            shown.hits, shown.misses, lookups ? 100.0 * shown.hits / lookups : 0.0,
+            shown.bytes, max_bytes, shown.evictions);
+}
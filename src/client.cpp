@@ -0,0 +1,80 @@
+// Drop-in replacement for bin/compiler that hands the compile to a running
+// `bin/compiler --server`. Takes the same arguments; when no server is
+// listening, or for anything but a single -S/-o compile, it execs
+// bin/compiler from its own directory instead.
+
+#include "protocol.hpp"
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+static int run_compiler(char *argv[])
+{
+    char self[PATH_MAX];
+    ssize_t length = readlink("/proc/self/exe", self, sizeof self - 1);
+    std::string compiler = "bin/compiler";
+    if (length > 0) {
+        self[length] = '\0';
+        char *slash = strrchr(self, '/');
+        if (slash != nullptr) compiler = std::string(self, slash + 1 - self) + "compiler";
+    }
+    argv[0] = const_cast<char *>(compiler.c_str());
+    execv(argv[0], argv);
+    perror(argv[0]);
+    return EXIT_FAILURE;
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *source_name = nullptr, *out_name = nullptr;
+    const char *socket_path = server_socket_path();
+    std::string flags;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i],"-S")==0 && i+1 < argc) source_name = argv[++i];
+        else if (strcmp(argv[i],"-o")==0 && i+1 < argc) out_name = argv[++i];
+        else if (strcmp(argv[i],"--stream")==0) flags += 's';
+        else if (strcmp(argv[i],"-O")==0) flags += 'O';
+        else if (strcmp(argv[i],"-O2")==0) flags += "O2";
+        else if (strcmp(argv[i],"--printf")==0) flags += 'p';
+        else if (strcmp(argv[i],"--socket")==0 && i+1 < argc) socket_path = argv[++i];
+        else if (strcmp(argv[i],"--mmap")!=0) return run_compiler(argv);
+    }
+
+    //missing files are left to the compiler so its messages are unchanged
+    char path[PATH_MAX];
+    if (source_name == nullptr || out_name == nullptr || realpath(source_name, path) == nullptr) {
+        return run_compiler(argv);
+    }
+
+    int fd = connect_server(socket_path);
+    if (fd < 0) return run_compiler(argv);
+
+    bool ok;
+    std::string body;
+    if (!send_request(fd, true, flags.c_str(), source_name, path) || !read_reply(fd, ok, body)) {
+        close(fd);
+        return run_compiler(argv);
+    }
+    close(fd);
+
+    if (!ok) {
+        fprintf(stderr, "%s\n", body.c_str());
+        return EXIT_FAILURE;
+    }
+
+    int out = open(out_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0 || !write_all(out, body.data(), body.size())) {
+        printf("out_file could not be opened.\n");
+        return EXIT_FAILURE;
+    }
+    close(out);
+    return 0;
+}
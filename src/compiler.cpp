@@ -1,51 +1,505 @@
-#include "ast.hpp"
-
-#include <string.h>
-#include <cstddef>
-#include <fstream>
-
-
-void check_file(FILE *source_file, std::ofstream &out_file, char *argv[]) {
-
-    if (!out_file.is_open())
-    {
-        std::string message = "out_file could not be opened.\n";
-            printf("%s",message.c_str());
-        exit(EXIT_FAILURE);
-    }
-    else if (source_file == NULL)
-        {
-            std::string message = "source_file could not be opened.\n";
-            printf("%s",message.c_str());
-            exit(EXIT_FAILURE);
-        }
-}
-
-
-void print_assembly(FILE* is, std::ostream &dst, std::string fileName) {
-        yyin = is;
-        const Node *ast=parseAST();
-        Context context = new Context(nullptr);
-        dst <<"\t.file\t1 \""<<fileName<<"\"\n"
-            <<"\t.section .mdebug.abi32\n\t.previous\n"
-            <<"\t.nan\tlegacy\n\t.module fp=xx\n"
-            <<"\t.module nooddspreg\n\t.abicalls\n\n"   ;
-
-
-        ast->generate_assembly(dst, context);
-}
-
-
-int main(int argc, char *argv[])
-{
-    if (strcmp(argv[1],"-S")==0 && strcmp(argv[3],"-o")==0) {
-        std::string fileName = argv[2];
-        FILE *source_file =fopen(argv[2], "r");
-        std::ofstream out_file(argv[4]);
-        check_file(source_file, out_file, argv);
-
-        print_assembly(source_file, out_file, fileName);
-    }
-
-    return 0;
-}
+#include "ast.hpp"
+#include "thread_pool.hpp"
+#include "server.hpp"
+#include "protocol.hpp"
+#include "cache.hpp"
+#include "ir.hpp"
+#include "passes.hpp"
+#include "peephole.hpp"
+#include "emitter.hpp"
+#include "object.hpp"
+#include "target.hpp"
+#include "vm.hpp"
+
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+
+#ifdef COUNT_ALLOCATIONS
+//heap allocations by every thread so far, for --phase-report. Only
+//bin/compile_bench is built with this; bin/compiler keeps the library's
+//operator new
+static std::atomic<unsigned long> allocations(0);
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = malloc(size)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{ free(p); }
+
+void operator delete(void *p, size_t) noexcept
+{ free(p); }
+
+static unsigned long allocations_so_far()
+{ return allocations.load(); }
+#else
+static unsigned long allocations_so_far()
+{ return 0; }
+#endif
+
+
+void check_file(FILE *source_file, int out_file, char *argv[]) {
+
+    if (out_file < 0)
+    {
+        std::string message = "out_file could not be opened.\n";
+            printf("%s",message.c_str());
+        exit(EXIT_FAILURE);
+    }
+    else if (source_file == NULL)
+        {
+            std::string message = "source_file could not be opened.\n";
+            printf("%s",message.c_str());
+            exit(EXIT_FAILURE);
+        }
+}
+
+
+//the program in IR, with the passes of the optimization level run over it
+IrProgram optimized_ir(const Node *ast, Session &session, int optimize, PassReport *report = nullptr) {
+        IrProgram ir = lower_program(static_cast<const Program &>(*ast), session.symbols);
+        if (report != nullptr) report->record("lower", ir.code.size());
+        if (optimize >= 2) {
+            fold_constants(ir);
+            if (report != nullptr) report->record("fold", ir.code.size());
+            hoist_loop_invariants(ir);
+            if (report != nullptr) report->record("licm", ir.code.size());
+            reduce_induction_variables(ir);
+            if (report != nullptr) report->record("strength", ir.code.size());
+            eliminate_dead_code(ir);
+            if (report != nullptr) report->record("dce", ir.code.size());
+        }
+        return ir;
+}
+
+
+//instructions in assembly text: lines that are not labels or directives
+size_t count_instructions(std::string_view assembly) {
+        size_t count = 0;
+        for (size_t line = 0; line < assembly.size(); ) {
+            size_t end = assembly.find('\n', line);
+            if (end == std::string::npos) end = assembly.size();
+            size_t tab = assembly.find('\t', line);
+            if (tab < end && tab + 1 < end && assembly[tab + 1] != '.'
+                && assembly.compare(line, 1, "$") != 0 && assembly.compare(line, 1, ".") != 0) count++;
+            line = end + 1;
+        }
+        return count;
+}
+
+
+//compiles through the IR whatever the level, and prints how many
+//instructions are left after each pass to stderr
+void report_passes(std::ostream &dst, std::string fileName, Session &session, int optimize, const Target &target) {
+        const Node *ast = session.parse();
+        PassReport report;
+        IrProgram ir = optimized_ir(ast, session, optimize, &report);
+        AsmEmitter text;
+        target.select(text, ir, session.printf_calls);
+
+        std::string line = fileName + ":";
+        size_t previous = 0;
+        for (const auto &count : report.counts) {
+            line += std::string(" ") + count.first + " " + std::to_string(count.second);
+            if (previous != 0) line += " (" + std::to_string((long)count.second - (long)previous) + ")";
+            previous = count.second;
+        }
+        line += std::string(" ") + target.name() + " " + std::to_string(count_instructions(text.text()));
+        fprintf(stderr, "%s\n", line.c_str());
+
+        target.print_header(dst, fileName);
+        dst<<text.text();
+}
+
+
+//-O keeps program variables in registers where possible; -O2 compiles
+//through the IR instead of straight from the AST. Either way, and
+//whenever the rules are being reported on, the text is then cleaned up
+//by the peephole rules and its delay slots filled. Other targets always
+//select from the IR, running its passes only at -O2.
+void generate_program(std::ostream &dst, const Node *ast, Session &session, int optimize, const Target &target, PeepholeReport *report = nullptr) {
+        if (!target.generates_from_ast()) {
+            target.select(dst, optimized_ir(ast, session, optimize), session.printf_calls);
+            return;
+        }
+
+        Context context(session.symbols);
+        context.set_printf(session.printf_calls);
+        if (optimize == 0 && report == nullptr) {
+            ast->generate_assembly(dst, context);
+            return;
+        }
+
+        AsmEmitter text;
+        const Program &program = static_cast<const Program &>(*ast);
+        if (optimize >= 2) target.select(text, optimized_ir(ast, session, optimize), session.printf_calls);
+        else if (optimize == 1) {
+            RegisterAllocation registers(session.symbols, program.live_intervals(session.symbols));
+            program.find_loop_writes(registers);
+            context.set_registers(&registers);
+            ast->generate_assembly(text, context);
+        }
+        else ast->generate_assembly(text, context);
+
+        std::vector<AsmLine> lines = text.lines();
+        run_peephole(lines, report);
+        fill_delay_slots(lines, report);
+        encode_assembly(dst, lines);
+}
+
+
+void print_assembly(std::ostream &dst, std::string fileName, Session &session, int optimize, const Target &target) {
+        const Node *ast=session.parse();
+        target.print_header(dst, fileName);
+
+
+        generate_program(dst, ast, session, optimize, target);
+}
+
+
+//prints how often each peephole rule fired to stderr, then the assembly
+void report_peephole(std::ostream &dst, std::string fileName, Session &session, int optimize) {
+        const Node *ast = session.parse();
+        PeepholeReport report;
+        AsmEmitter text;
+        generate_program(text, ast, session, optimize, mips_target(), &report);
+
+        std::string line = fileName + ":";
+        for (const auto &hit : report.hits) line += std::string(" ") + hit.first + " " + std::to_string(hit.second);
+        fprintf(stderr, "%s\n", line.c_str());
+
+        mips_target().print_header(dst, fileName);
+        dst<<text.text();
+}
+
+
+//times tokenizing, parsing, generating the whole text in memory and
+//writing it to dst, and prints them to stderr as one JSON object with the
+//peak RSS of the process and, in bin/compile_bench, the heap allocations
+//made in each. The source is tokenized into an array first and the parser
+//then replays it, as --cache does; a plain compile instead lexes on demand
+//inside the push parser's loop, so there tokenize and parse overlap
+void report_phases(std::ostream &dst, std::string fileName, Session &session, int optimize, const Target &target) {
+        typedef std::chrono::steady_clock Clock;
+        struct Phase { const char *name; double seconds; unsigned long allocations; };
+        std::vector<Phase> phases;
+        Clock::time_point start = Clock::now();
+        unsigned long allocated = allocations_so_far();
+        auto finish = [&](const char *name) {
+            Clock::time_point now = Clock::now();
+            unsigned long total = allocations_so_far();
+            phases.push_back(Phase{name, std::chrono::duration<double>(now - start).count(), total - allocated});
+            start = now;
+            allocated = total;
+        };
+
+        std::vector<Token> tokens;
+        session.tokenize(tokens);
+        finish("tokenize");
+        const Node *ast = session.parse(tokens);
+        finish("parse");
+        AsmEmitter text;
+        target.print_header(text, fileName);
+        generate_program(text, ast, session, optimize, target);
+        finish("codegen");
+        std::string_view body = text.text();
+        dst.write(body.data(), body.size());
+        //bin/compiler writes to an AsmEmitter, which holds the last
+        //buffer back until finished
+        if (AsmEmitter *file = dynamic_cast<AsmEmitter *>(&dst)) file->finish();
+        finish("write");
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        std::string name;
+        for (char c : fileName) {
+            if (c == '"' || c == '\\') name += '\\';
+            name += c;
+        }
+        std::string line = "{\"file\": \"" + name + "\", \"target\": \"" + target.name()
+            + "\", \"optimize\": " + std::to_string(optimize)
+            + ", \"tokens\": " + std::to_string(tokens.size())
+            + ", \"output_bytes\": " + std::to_string(body.size());
+        double seconds = 0;
+        for (const Phase &phase : phases) {
+            line += std::string(", \"") + phase.name + "_seconds\": " + std::to_string(phase.seconds);
+#ifdef COUNT_ALLOCATIONS
+            line += std::string(", \"") + phase.name + "_allocations\": " + std::to_string(phase.allocations);
+#endif
+            seconds += phase.seconds;
+        }
+        line += ", \"seconds\": " + std::to_string(seconds) + ", \"peak_rss_kb\": " + std::to_string(usage.ru_maxrss) + "}";
+        fprintf(stderr, "%s\n", line.c_str());
+}
+
+
+//each top-level statement is compiled and released as soon as it is parsed
+void stream_assembly(std::ostream &dst, std::string fileName, Session &session) {
+        Context context(session.symbols);
+        context.set_printf(session.printf_calls);
+        mips_target().print_header(dst, fileName);
+
+        ProgramStream program(dst, context, session.arena);
+        session.parse_statements(program);
+        program.finish();
+}
+
+
+//looks the program up by its tokens and only parses and generates it on a
+//miss; the header names the file, so it is never cached
+void cached_assembly(std::ostream &dst, std::string fileName, Session &session, bool stream, int optimize, const Target &target, CompileCache &cache) {
+        std::vector<Token> tokens;
+        session.tokenize(tokens);
+        stream = stream && target.generates_from_ast();
+        std::string options = optimize == 1 ? "O" : optimize > 1 ? "O" + std::to_string(optimize) : stream ? "stream" : "";
+        if (session.printf_calls) options += " printf";
+        if (&target != &mips_target()) options += std::string(" ") + target.name();
+        std::string key = cache.key(session.symbols, tokens, options);
+
+        std::string body;
+        if (!cache.lookup(key, body)) {
+            AsmEmitter out;
+            if (stream && !optimize) {
+                Context context(session.symbols);
+                context.set_printf(session.printf_calls);
+                ProgramStream program(out, context, session.arena);
+                session.parse_statements(program, tokens);
+                program.finish();
+            }
+            else generate_program(out, session.parse(tokens), session, optimize, target);
+            body = out.text();
+            cache.store(key, body);
+        }
+
+        target.print_header(dst, fileName);
+        dst<<body;
+}
+
+
+struct Options {
+        bool use_mmap = false;
+        bool stream = false;
+        int optimize = 0; //needs the whole program, so it overrides stream
+        bool emit_ir = false;
+        bool pass_report = false;
+        bool peephole_report = false;
+        bool phase_report = false;
+        bool printf_calls = false;
+        bool object = false;
+        bool little_endian = false;
+        bool run = false; //execute instead of compiling, printing to -o or stdout
+        const Target *target = &mips_target();
+        CompileCache *cache = nullptr;
+};
+
+
+void write_assembly(std::ostream &dst, std::string fileName, Session &session, const Options &options) {
+        if (options.emit_ir) {
+            const Node *ast = session.parse();
+            print_ir(dst, optimized_ir(ast, session, options.optimize));
+        }
+        else if (options.pass_report) report_passes(dst, fileName, session, options.optimize, *options.target);
+        else if (options.peephole_report) report_peephole(dst, fileName, session, options.optimize);
+        else if (options.phase_report) report_phases(dst, fileName, session, options.optimize, *options.target);
+        else if (options.cache != nullptr) cached_assembly(dst, fileName, session, options.stream, options.optimize, *options.target, *options.cache);
+        else if (options.stream && !options.optimize && options.target->generates_from_ast()) stream_assembly(dst, fileName, session);
+        else print_assembly(dst, fileName, session, options.optimize, *options.target);
+}
+
+
+//compiles one file in a session of its own; safe to call from any thread
+void compile(std::ostream &dst, std::string fileName, FILE *source_file, const Options &options) {
+        Session session;
+        session.printf_calls = options.printf_calls;
+        std::unique_ptr<MappedSource> source;
+        if (options.use_mmap) {
+            //scan the file in place: keywords and operators never allocate
+            //and each distinct identifier is copied once when interned
+            source.reset(new MappedSource(fileName));
+            fclose(source_file);
+            source_file = nullptr;
+            session.read_mapped(*source);
+        } else {
+            session.read_file(source_file);
+        }
+
+        try {
+            if (options.run) {
+                //the IR of the optimization level, run as bytecode
+                const Node *ast = session.parse();
+                run_bytecode(compile_bytecode(optimized_ir(ast, session, options.optimize)), dst);
+            }
+            else if (options.object) {
+                //-c assembles the text in memory instead of writing it out
+                AsmEmitter text;
+                write_assembly(text, fileName, session, options);
+                write_object(dst, text.lines(), options.little_endian);
+            }
+            else write_assembly(dst, fileName, session, options);
+        } catch (...) {
+            if (source_file != nullptr) fclose(source_file);
+            throw;
+        }
+        if (source_file != nullptr) fclose(source_file);
+}
+
+
+//compiles every "source output" pair listed in the manifest, each file on
+//whichever worker gets to it first; returns the number of failures
+int compile_batch(const char *manifest_name, unsigned jobs, const Options &options) {
+        std::ifstream manifest(manifest_name);
+        if (!manifest.is_open()) {
+            printf("%s could not be opened.\n", manifest_name);
+            exit(EXIT_FAILURE);
+        }
+
+        std::vector<std::pair<std::string,std::string> > files;
+        std::string source_name, out_name;
+        while (manifest >> source_name >> out_name) files.emplace_back(source_name, out_name);
+
+        //one message slot per file so errors come out in manifest order
+        std::vector<std::string> errors(files.size());
+        WorkStealingPool pool(jobs);
+        for (size_t i = 0; i < files.size(); i++) {
+            pool.submit([&, i]() {
+                const std::string &fileName = files[i].first;
+                try {
+                    FILE *source_file = fopen(fileName.c_str(), "r");
+                    if (source_file == NULL) throw std::runtime_error("source_file could not be opened.");
+                    int out_file = open(files[i].second.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                    if (out_file < 0) {
+                        fclose(source_file);
+                        throw std::runtime_error("out_file could not be opened.");
+                    }
+                    try {
+                        AsmEmitter out(out_file);
+                        compile(out, fileName, source_file, options);
+                        out.finish();
+                    } catch (...) {
+                        close(out_file);
+                        throw;
+                    }
+                    close(out_file);
+                } catch (const std::exception &e) {
+                    errors[i] = fileName + ": " + e.what();
+                }
+            });
+        }
+        pool.run();
+
+        int failures = 0;
+        for (const std::string &error : errors) {
+            if (error.empty()) continue;
+            fprintf(stderr, "%s\n", error.c_str());
+            failures++;
+        }
+        return failures;
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *source_name = nullptr, *out_name = nullptr, *manifest_name = nullptr;
+    const char *socket_path = server_socket_path();
+    const char *cache_dir = getenv("COMPILER_CACHE");
+    unsigned long long cache_megabytes = 256;
+    bool serve = false, cache_stats = false;
+    Options options;
+    unsigned jobs = std::thread::hardware_concurrency();
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i],"-S")==0 && i+1 < argc) source_name = argv[++i];
+        else if (strcmp(argv[i],"-o")==0 && i+1 < argc) out_name = argv[++i];
+        else if (strcmp(argv[i],"--mmap")==0) options.use_mmap = true;
+        else if (strcmp(argv[i],"--stream")==0) options.stream = true;
+        else if (strcmp(argv[i],"-O")==0) options.optimize = 1;
+        else if (strcmp(argv[i],"-O2")==0) options.optimize = 2;
+        else if (strcmp(argv[i],"--emit-ir")==0) options.emit_ir = true;
+        else if (strcmp(argv[i],"--pass-report")==0) options.pass_report = true;
+        else if (strcmp(argv[i],"--peephole-report")==0) options.peephole_report = true;
+        else if (strcmp(argv[i],"--phase-report")==0) options.phase_report = true;
+        else if (strcmp(argv[i],"--printf")==0) options.printf_calls = true;
+        else if (strcmp(argv[i],"-c")==0) options.object = true;
+        else if (strcmp(argv[i],"-EL")==0) options.little_endian = true;
+        else if (strcmp(argv[i],"-EB")==0) options.little_endian = false;
+        else if (strcmp(argv[i],"--run")==0) options.run = true;
+        else if (strncmp(argv[i],"--target=",9)==0) {
+            options.target = find_target(argv[i] + 9);
+            if (options.target == nullptr) {
+                printf("unknown target %s: choose mips or x86_64\n", argv[i] + 9);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i],"--batch")==0 && i+1 < argc) manifest_name = argv[++i];
+        else if (strcmp(argv[i],"-j")==0 && i+1 < argc) jobs = atoi(argv[++i]);
+        else if (strcmp(argv[i],"--server")==0) serve = true;
+        else if (strcmp(argv[i],"--socket")==0 && i+1 < argc) socket_path = argv[++i];
+        else if (strcmp(argv[i],"--cache")==0 && i+1 < argc) cache_dir = argv[++i];
+        else if (strcmp(argv[i],"--no-cache")==0) cache_dir = nullptr;
+        else if (strcmp(argv[i],"--cache-max")==0 && i+1 < argc) cache_megabytes = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i],"--cache-stats")==0) cache_stats = true;
+    }
+
+    std::unique_ptr<CompileCache> cache;
+    if (cache_dir != nullptr && *cache_dir != '\0') {
+        cache.reset(new CompileCache(cache_dir, cache_megabytes << 20));
+        options.cache = cache.get();
+    }
+    if (cache_stats) {
+        if (cache == nullptr) {
+            printf("no cache directory: pass --cache DIR or set COMPILER_CACHE\n");
+            return EXIT_FAILURE;
+        }
+        cache->print_stats(stdout);
+        return 0;
+    }
+
+    if (options.object && options.target != &mips_target()) {
+        printf("-c only writes MIPS objects: assemble the -S output for %s instead\n", options.target->name());
+        return EXIT_FAILURE;
+    }
+
+    if (serve) return run_server(socket_path, jobs);
+
+    if (manifest_name != nullptr) {
+        return compile_batch(manifest_name, jobs, options) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (source_name != nullptr && (out_name != nullptr || options.run)) {
+        std::string fileName = source_name;
+        FILE *source_file = fopen(source_name, "r");
+        int out_file = out_name == nullptr ? STDOUT_FILENO : open(out_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        check_file(source_file, out_file, argv);
+
+        //written a buffer at a time, not a line at a time
+        AsmEmitter out(out_file);
+        try {
+            compile(out, fileName, source_file, options);
+            out.finish();
+        } catch (const std::exception &e) {
+            //a program that traps keeps what it printed first
+            if (options.run) out.finish();
+            fprintf(stderr, "%s: %s\n", source_name, e.what());
+            return EXIT_FAILURE;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,210 @@
+#include "passes.hpp"
+
+#include <algorithm>
+#include <unordered_set>
+#include <vector>
+
+
+//! Only division can fail, and not by a known non-zero constant
+static bool removable(const Instruction &insn)
+{
+    switch (insn.op) {
+    case Opcode::Copy: case Opcode::Add: case Opcode::Sub: case Opcode::Mul:
+    case Opcode::Less: case Opcode::Equals:
+        return true;
+    case Opcode::Div:
+        return insn.b().kind == OperandKind::Imm && insn.b().value != 0;
+    default:
+        return false;
+    }
+}
+
+//! Keep the blocks reachable from the entry, in their layout order
+static bool remove_unreachable(IrProgram &ir)
+{
+    std::vector<int> index(ir.blocks.size(), -1);
+    std::vector<unsigned> work(1, 0);
+    index[0] = 0;
+    while (!work.empty()) {
+        unsigned b = work.back();
+        work.pop_back();
+        for (int s : ir.blocks[b].succ) {
+            if (s >= 0 && index[s] < 0) {
+                index[s] = 0;
+                work.push_back(s);
+            }
+        }
+    }
+
+    unsigned kept = 0;
+    for (int &i : index) {
+        if (i == 0) i = kept++;
+    }
+    if (kept == ir.blocks.size()) return false;
+
+    std::vector<Instruction> code;
+    std::vector<BasicBlock> blocks;
+    code.reserve(ir.code.size());
+    blocks.reserve(kept);
+    for (unsigned b = 0; b < ir.blocks.size(); b++) {
+        if (index[b] < 0) continue;
+        BasicBlock block = ir.blocks[b];
+        unsigned first = code.size();
+        code.insert(code.end(), ir.code.begin() + block.first, ir.code.begin() + block.end());
+        block.first = first;
+        for (int &s : block.succ) {
+            if (s >= 0) s = index[s];
+        }
+        blocks.push_back(block);
+    }
+    ir.code.swap(code);
+    ir.blocks.swap(blocks);
+    return true;
+}
+
+//! Branch straight to where a chain of blocks holding only a jump leads
+static void thread_jumps(IrProgram &ir)
+{
+    std::vector<unsigned> seen(ir.blocks.size(), 0);
+    unsigned walk = 0;
+    for (BasicBlock &block : ir.blocks) {
+        for (int &s : block.succ) {
+            //an empty infinite loop has no end to go to
+            walk++;
+            while (s >= 0 && ir.blocks[s].count == 1 && ir.terminator(s).op == Opcode::Jump && seen[s] != walk) {
+                seen[s] = walk;
+                s = ir.blocks[s].succ[0];
+            }
+        }
+        Instruction &insn = ir.code[block.end() - 1];
+        if (insn.op == Opcode::Branch && block.succ[0] == block.succ[1]) {
+            insn = Instruction(Opcode::Jump);
+            block.succ[1] = -1;
+        }
+    }
+}
+
+//! Append each block to the one before it in the layout when that one
+//! jumps to it and nothing else does
+static void merge_blocks(IrProgram &ir)
+{
+    std::vector<unsigned> preds(ir.blocks.size(), 0);
+    for (const BasicBlock &block : ir.blocks) {
+        for (int s : block.succ) {
+            if (s >= 0) preds[s]++;
+        }
+    }
+
+    std::vector<int> index(ir.blocks.size());
+    std::vector<Instruction> code;
+    std::vector<BasicBlock> blocks;
+    code.reserve(ir.code.size());
+    for (unsigned b = 0; b < ir.blocks.size(); b++) {
+        const BasicBlock &block = ir.blocks[b];
+        bool merge = b > 0 && preds[b] == 1 && blocks.back().succ[0] == (int)b
+            && code.back().op == Opcode::Jump;
+        if (merge) code.pop_back();
+        else blocks.push_back(BasicBlock{(unsigned)code.size(), 0, {-1, -1}});
+        index[b] = blocks.size() - 1;
+        code.insert(code.end(), ir.code.begin() + block.first, ir.code.begin() + block.end());
+        BasicBlock &last = blocks.back();
+        last.count = code.size() - last.first;
+        last.succ[0] = block.succ[0];
+        last.succ[1] = block.succ[1];
+    }
+    for (BasicBlock &block : blocks) {
+        for (int &s : block.succ) {
+            if (s >= 0) s = index[s];
+        }
+    }
+    ir.code.swap(code);
+    ir.blocks.swap(blocks);
+}
+
+//! Mark what the program needs: instructions that print, branch or may
+//! trap, then backwards from each marked instruction the definitions its
+//! operands can read, in its own block or through the blocks before it.
+//! What is left unmarked is dropped in one sweep, dead cycles included.
+static void remove_dead_instructions(IrProgram &ir)
+{
+    unsigned count = ir.blocks.size();
+    std::vector<std::vector<unsigned> > preds = ir.predecessors();
+
+    //per operand the definition it reads in its own block, -1 for one
+    //from before the block; per block the last definition of each value
+    //it writes, sorted by value
+    std::vector<int> reads(2 * ir.code.size(), -1);
+    std::vector<unsigned> block_of(ir.code.size());
+    std::vector<std::pair<unsigned,unsigned> > last;
+    std::vector<unsigned> last_first(count + 1, 0);
+    std::vector<unsigned> def_at(ir.values(), 0), def_block(ir.values(), 0); //block + 1
+    for (unsigned b = 0; b < count; b++) {
+        const BasicBlock &block = ir.blocks[b];
+        for (unsigned i = block.first; i < block.end(); i++) {
+            const Instruction &insn = ir.code[i];
+            block_of[i] = b;
+            for (unsigned k = 1; k < 3; k++) {
+                if (!insn.operand(k).is_value()) continue;
+                unsigned v = ir.value_index(insn.operand(k));
+                if (def_block[v] == b + 1) reads[2 * i + k - 1] = def_at[v];
+            }
+            if (insn.dst().is_value()) {
+                unsigned v = ir.value_index(insn.dst());
+                if (def_block[v] != b + 1) last.emplace_back(v, 0);
+                def_at[v] = i;
+                def_block[v] = b + 1;
+            }
+        }
+        for (unsigned j = last_first[b]; j < last.size(); j++) last[j].second = def_at[last[j].first];
+        std::sort(last.begin() + last_first[b], last.end());
+        last_first[b + 1] = last.size();
+    }
+
+    std::vector<bool> needed(ir.code.size(), false);
+    std::vector<unsigned> work;
+    std::vector<std::pair<unsigned,unsigned> > entries; //values needed on entry to blocks
+    std::unordered_set<uint64_t> out; //block << 32 | value needed at its end
+    auto mark = [&](unsigned i) {
+        if (needed[i]) return;
+        needed[i] = true;
+        work.push_back(i);
+    };
+    for (unsigned i = 0; i < ir.code.size(); i++) {
+        if (!removable(ir.code[i])) mark(i);
+    }
+    while (!work.empty() || !entries.empty()) {
+        if (!work.empty()) {
+            unsigned i = work.back();
+            work.pop_back();
+            for (unsigned k = 1; k < 3; k++) {
+                const Instruction &insn = ir.code[i];
+                if (!insn.operand(k).is_value()) continue;
+                if (reads[2 * i + k - 1] >= 0) mark(reads[2 * i + k - 1]);
+                else entries.emplace_back(block_of[i], ir.value_index(insn.operand(k)));
+            }
+            continue;
+        }
+        unsigned b = entries.back().first, v = entries.back().second;
+        entries.pop_back();
+        for (unsigned p : preds[b]) {
+            if (!out.insert((uint64_t)p << 32 | v).second) continue;
+            auto first = last.begin() + last_first[p], end = last.begin() + last_first[p + 1];
+            auto def = std::lower_bound(first, end, std::make_pair(v, 0u));
+            if (def != end && def->first == v) mark(def->second);
+            else entries.emplace_back(p, v);
+        }
+    }
+
+    const Instruction *base = ir.code.data();
+    ir.erase_if([&](const Instruction &insn) { return !needed[&insn - base]; });
+}
+
+
+void eliminate_dead_code(IrProgram &ir)
+{
+    remove_unreachable(ir);
+    remove_dead_instructions(ir);
+    thread_jumps(ir);
+    remove_unreachable(ir);
+    merge_blocks(ir);
+}
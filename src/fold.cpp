@@ -0,0 +1,453 @@
+#include "passes.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <vector>
+
+
+bool evaluate(Opcode op, int32_t a, int32_t b, int32_t &result)
+{
+    //add, sub and mul wrap around like addu, subu and mul
+    uint32_t ua = a, ub = b;
+    switch (op) {
+    case Opcode::Add: result = (int32_t)(ua + ub); return true;
+    case Opcode::Sub: result = (int32_t)(ua - ub); return true;
+    case Opcode::Mul: result = (int32_t)(ua * ub); return true;
+    case Opcode::Div:
+        if (b == 0) return false; //teq traps at run time
+        result = a == INT_MIN && b == -1 ? INT_MIN : a / b; //div truncates, lo wraps
+        return true;
+    case Opcode::Less: result = a < b; return true;
+    case Opcode::Equals: result = a == b; return true;
+    default: return false;
+    }
+}
+
+
+//! What is known about a value: nothing yet, while no path to its
+//! definition has been found, one constant, or that it varies
+struct Known
+{
+    enum State : uint8_t { Unknown, Constant, Varying };
+    State state;
+    int32_t value;
+
+    static Known unknown() { return Known{Unknown, 0}; }
+    static Known varying() { return Known{Varying, 0}; }
+    static Known of(int32_t value) { return Known{Constant, value}; }
+
+    bool constant() const
+    { return state == Constant; }
+
+    bool operator!=(const Known &other) const
+    { return state != other.state || (state == Constant && value != other.value); }
+
+    //! What is known where this and other join
+    Known meet(Known other) const
+    {
+        if (state == Unknown) return other;
+        if (other.state == Unknown || !(*this != other)) return *this;
+        return varying();
+    }
+};
+
+//! A variable at a block where different definitions of it join
+struct Phi
+{
+    Symbol var;
+    unsigned block;
+    unsigned first; //its value along each edge in, from phi_args[first]
+};
+
+//! Sparse conditional constant propagation (Wegman and Zadeck) over SSA
+//! names: every definition, and every join of a variable, has one lattice
+//! cell, so the work grows with the definitions rather than with blocks x
+//! variables. Edges only become executable as branches that can take them
+//! are reached, so code behind a branch on a known condition does not
+//! spoil what is known after the join. Temps never outlive the block that
+//! defines them, so they never need a join.
+//!
+//! Values are numbered zero, what every variable starts as, then varying,
+//! then 2 + i for instruction i and 2 + code size + p for phi p; a value
+//! and the instruction or phi defining it share the number.
+class ConstantFolding
+{
+private:
+    enum : unsigned { zero, varying };
+
+    IrProgram &ir;
+    unsigned count, insns;
+    LoopNest nest;
+    std::vector<std::vector<unsigned> > incoming; //by block, edges as 2 x block + successor
+    std::vector<unsigned> edge_slot; //by edge, its position in incoming
+    std::vector<Phi> phis;
+    std::vector<unsigned> phi_args;
+    std::vector<std::vector<unsigned> > block_phis;
+    std::vector<unsigned> uses; //by instruction, the values operands a and b read
+    std::vector<unsigned> block_of; //by instruction of a reachable block
+    std::vector<unsigned> user_first, users; //values whose definition reads each value
+
+    std::vector<Known> cells; //by value
+    std::vector<bool> executable, edge_executable;
+    std::vector<unsigned> flow, ssa; //edges just made executable, values just lowered
+
+    bool reachable(unsigned block) const
+    { return nest.order[block] >= 0; }
+
+    //! Joins for the variables read in some block before being written
+    //! there, at the iterated dominance frontier of the blocks writing
+    //! them; the entry writes 0 to every variable
+    void place_phis()
+    {
+        //frontiers by Cooper, Harvey and Kennedy: a join is in the frontier
+        //of its predecessors and their dominators up to its own
+        std::vector<std::vector<unsigned> > frontier(count);
+        for (unsigned b = 0; b < count; b++) {
+            if (!reachable(b) || incoming[b].size() + (b == 0) < 2) continue;
+            for (unsigned e : incoming[b]) {
+                if (!reachable(e / 2)) continue;
+                for (unsigned runner = e / 2; b == 0 || runner != nest.idom[b]; runner = nest.idom[runner]) {
+                    if (!frontier[runner].empty() && frontier[runner].back() == b) break;
+                    frontier[runner].push_back(b);
+                    if (runner == 0) break;
+                }
+            }
+        }
+
+        unsigned variables = ir.symbols->size();
+        std::vector<bool> global(variables, false);
+        std::vector<unsigned> written(variables, 0); //block + 1 last writing each variable
+        std::vector<std::vector<unsigned> > writers(variables);
+        for (unsigned b = 0; b < count; b++) {
+            if (!reachable(b)) continue;
+            for (unsigned i = ir.blocks[b].first; i < ir.blocks[b].end(); i++) {
+                const Instruction &insn = ir.code[i];
+                for (unsigned k = 1; k < 3; k++) {
+                    Operand o = insn.operand(k);
+                    if (o.kind == OperandKind::Var && written[o.value] != b + 1) global[o.value] = true;
+                }
+                Operand dst = insn.dst();
+                if (dst.kind == OperandKind::Var && written[dst.value] != b + 1) {
+                    written[dst.value] = b + 1;
+                    writers[dst.value].push_back(b);
+                }
+            }
+        }
+
+        std::vector<unsigned> placed(count, 0), queued(count, 0); //variable + 1
+        std::vector<unsigned> work;
+        for (Symbol v = 0; v < variables; v++) {
+            if (!global[v]) continue;
+            work = writers[v];
+            work.push_back(0);
+            for (unsigned b : work) queued[b] = v + 1;
+            while (!work.empty()) {
+                unsigned b = work.back();
+                work.pop_back();
+                for (unsigned join : frontier[b]) {
+                    if (placed[join] == v + 1) continue;
+                    placed[join] = v + 1;
+                    block_phis[join].push_back(phis.size());
+                    phis.push_back(Phi{v, join, (unsigned)phi_args.size()});
+                    phi_args.resize(phi_args.size() + incoming[join].size(), varying);
+                    if (queued[join] != v + 1) {
+                        queued[join] = v + 1;
+                        work.push_back(join);
+                    }
+                }
+            }
+        }
+    }
+
+    //! Name the value each operand reads by walking the dominator tree in
+    //! pre-order, undoing the definitions of a subtree on leaving it
+    void rename()
+    {
+        std::vector<unsigned> current(ir.symbols->size(), zero);
+        std::vector<std::pair<Symbol,unsigned> > undo;
+        std::vector<unsigned> temp_value(ir.temps, varying), temp_block(ir.temps, 0);
+        auto define = [&](Symbol v, unsigned value) {
+            undo.emplace_back(v, current[v]);
+            current[v] = value;
+        };
+
+        std::vector<unsigned> walk;
+        for (unsigned b = 0; b < count; b++) {
+            if (reachable(b)) walk.push_back(b);
+        }
+        std::sort(walk.begin(), walk.end(), [&](unsigned a, unsigned b) { return nest.pre[a] < nest.pre[b]; });
+        std::vector<std::pair<unsigned,size_t> > open; //blocks and the undo log on entering them
+        for (unsigned b : walk) {
+            while (!open.empty() && !nest.dominates(open.back().first, b)) {
+                for (; undo.size() > open.back().second; undo.pop_back()) current[undo.back().first] = undo.back().second;
+                open.pop_back();
+            }
+            open.emplace_back(b, undo.size());
+
+            for (unsigned p : block_phis[b]) define(phis[p].var, 2 + insns + p);
+            const BasicBlock &range = ir.blocks[b];
+            for (unsigned i = range.first; i < range.end(); i++) {
+                const Instruction &insn = ir.code[i];
+                block_of[i] = b;
+                for (unsigned k = 1; k < 3; k++) {
+                    Operand o = insn.operand(k);
+                    if (o.kind == OperandKind::Var) uses[2 * i + k - 1] = current[o.value];
+                    else if (o.kind == OperandKind::Temp) uses[2 * i + k - 1] = temp_block[o.value] == b + 1 ? temp_value[o.value] : varying;
+                }
+                Operand dst = insn.dst();
+                if (dst.kind == OperandKind::Var) define(dst.value, 2 + i);
+                else if (dst.kind == OperandKind::Temp) {
+                    temp_value[dst.value] = 2 + i;
+                    temp_block[dst.value] = b + 1;
+                }
+            }
+            for (unsigned k = 0; k < 2; k++) {
+                int s = range.succ[k];
+                if (s < 0) continue;
+                for (unsigned p : block_phis[s]) phi_args[phis[p].first + edge_slot[2 * b + k]] = current[phis[p].var];
+            }
+        }
+    }
+
+    //! users, grouped by the value they read
+    void link_users()
+    {
+        user_first.assign(cells.size() + 1, 0);
+        auto each_use = [&](auto f) {
+            for (unsigned i = 0; i < insns; i++) {
+                for (unsigned k = 0; k < 2; k++) f(uses[2 * i + k], 2 + i);
+            }
+            for (unsigned p = 0; p < phis.size(); p++) {
+                for (unsigned j = 0; j < incoming[phis[p].block].size(); j++) f(phi_args[phis[p].first + j], 2 + insns + p);
+            }
+        };
+        each_use([&](unsigned used, unsigned) { if (used > varying) user_first[used + 1]++; });
+        for (size_t v = 0; v < cells.size(); v++) user_first[v + 1] += user_first[v];
+        users.resize(user_first.back());
+        std::vector<unsigned> next(user_first.begin(), user_first.end() - 1);
+        each_use([&](unsigned used, unsigned user) { if (used > varying) users[next[used]++] = user; });
+    }
+
+    Known lookup(unsigned i, unsigned k) const
+    {
+        Operand o = ir.code[i].operand(k);
+        if (o.kind == OperandKind::Imm) return Known::of(o.value);
+        if (o.is_value()) return cells[uses[2 * i + k - 1]];
+        return Known::varying();
+    }
+
+    //! Value of an operation when knowing one side, or both, is enough
+    static Known result(const Instruction &insn, Known a, Known b)
+    {
+        int32_t value;
+        if (a.constant() && b.constant() && evaluate(insn.op, a.value, b.value, value)) return Known::of(value);
+        if (insn.op == Opcode::Mul && ((a.constant() && a.value == 0) || (b.constant() && b.value == 0))) return Known::of(0);
+        if (insn.a().is_value() && insn.a() == insn.b()) {
+            if (insn.op == Opcode::Sub || insn.op == Opcode::Less) return Known::of(0);
+            if (insn.op == Opcode::Equals) return Known::of(1);
+        }
+        if (a.state == Known::Unknown || b.state == Known::Unknown) return Known::unknown();
+        return Known::varying();
+    }
+
+    //! The operand an operation reduces to with an identity element
+    static bool identity(const Instruction &insn, Known a, Known b, Operand &same)
+    {
+        switch (insn.op) {
+        case Opcode::Add:
+            if (b.constant() && b.value == 0) same = insn.a();
+            else if (a.constant() && a.value == 0) same = insn.b();
+            else return false;
+            return true;
+        case Opcode::Sub:
+            if (!b.constant() || b.value != 0) return false;
+            same = insn.a();
+            return true;
+        case Opcode::Mul:
+            if (b.constant() && b.value == 1) same = insn.a();
+            else if (a.constant() && a.value == 1) same = insn.b();
+            else return false;
+            return true;
+        case Opcode::Div:
+            if (!b.constant() || b.value != 1) return false;
+            same = insn.a();
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    void lower(unsigned value, Known known)
+    {
+        if (cells[value] != known) {
+            cells[value] = known;
+            ssa.push_back(value);
+        }
+    }
+
+    void take(unsigned block, unsigned k)
+    {
+        unsigned edge = 2 * block + k;
+        if (ir.blocks[block].succ[k] >= 0 && !edge_executable[edge]) {
+            edge_executable[edge] = true;
+            flow.push_back(edge);
+        }
+    }
+
+    void visit_phi(unsigned p)
+    {
+        const Phi &phi = phis[p];
+        Known known = phi.block == 0 ? Known::of(0) : Known::unknown();
+        for (unsigned j = 0; j < incoming[phi.block].size(); j++) {
+            if (edge_executable[incoming[phi.block][j]]) known = known.meet(cells[phi_args[phi.first + j]]);
+        }
+        lower(2 + insns + p, known);
+    }
+
+    //successors a branch on a known condition can never take are left out
+    void visit_instruction(unsigned i)
+    {
+        const Instruction &insn = ir.code[i];
+        Known a = lookup(i, 1);
+        switch (insn.op) {
+        case Opcode::Print: case Opcode::Return:
+            return;
+        case Opcode::Jump:
+            take(block_of[i], 0);
+            return;
+        case Opcode::Branch:
+            if (a.constant()) take(block_of[i], a.value != 0 ? 0 : 1);
+            else if (a.state == Known::Varying) {
+                take(block_of[i], 0);
+                take(block_of[i], 1);
+            }
+            return;
+        default:
+            lower(2 + i, insn.op == Opcode::Copy ? a : result(insn, a, lookup(i, 2)));
+        }
+    }
+
+    void visit(unsigned value)
+    {
+        if (value < 2 + insns) {
+            if (executable[block_of[value - 2]]) visit_instruction(value - 2);
+        }
+        else if (executable[phis[value - 2 - insns].block]) visit_phi(value - 2 - insns);
+    }
+
+    void visit_block(unsigned block)
+    {
+        for (unsigned p : block_phis[block]) visit_phi(p);
+        for (unsigned i = ir.blocks[block].first; i < ir.blocks[block].end(); i++) visit_instruction(i);
+    }
+
+    void propagate()
+    {
+        executable[0] = true;
+        visit_block(0);
+        while (!flow.empty() || !ssa.empty()) {
+            while (!flow.empty()) {
+                unsigned edge = flow.back();
+                flow.pop_back();
+                unsigned s = ir.blocks[edge / 2].succ[edge % 2];
+                if (!executable[s]) {
+                    executable[s] = true;
+                    visit_block(s);
+                }
+                else for (unsigned p : block_phis[s]) visit_phi(p);
+            }
+            while (!ssa.empty()) {
+                unsigned value = ssa.back();
+                ssa.pop_back();
+                for (unsigned u = user_first[value]; u < user_first[value + 1]; u++) visit(users[u]);
+            }
+        }
+    }
+
+    //! Replace what turned out to be known in the blocks that can run
+    void rewrite(unsigned block)
+    {
+        BasicBlock &range = ir.blocks[block];
+        for (unsigned i = range.first; i + 1 < range.end(); i++) {
+            Instruction &insn = ir.code[i];
+            Known a = lookup(i, 1), b = lookup(i, 2);
+            if (insn.op == Opcode::Print) {
+                if (a.constant()) insn.set(1, Operand::imm(a.value));
+                continue;
+            }
+
+            Known known = cells[2 + i];
+            Operand same;
+            if (known.constant()) insn = Instruction(Opcode::Copy, insn.dst(), Operand::imm(known.value));
+            else if (identity(insn, a, b, same)) insn = Instruction(Opcode::Copy, insn.dst(), same);
+            else {
+                if (a.constant()) insn.set(1, Operand::imm(a.value));
+                if (b.constant()) insn.set(2, Operand::imm(b.value));
+            }
+        }
+
+        unsigned last = range.end() - 1;
+        Known condition = lookup(last, 1);
+        if (ir.code[last].op == Opcode::Branch && condition.constant()) {
+            range.succ[0] = range.succ[condition.value != 0 ? 0 : 1];
+            range.succ[1] = -1;
+            ir.code[last] = Instruction(Opcode::Jump);
+        }
+    }
+
+public:
+    ConstantFolding(IrProgram &_ir)
+        : ir(_ir),
+        count(_ir.blocks.size()),
+        insns(_ir.code.size()),
+        nest(find_loops(_ir)),
+        incoming(count),
+        edge_slot(2 * count, 0),
+        block_phis(count),
+        uses(2 * insns, varying),
+        block_of(insns, 0),
+        executable(count, false),
+        edge_executable(2 * count, false)
+    {
+        for (unsigned b = 0; b < count; b++) {
+            for (unsigned k = 0; k < 2; k++) {
+                int s = ir.blocks[b].succ[k];
+                if (s < 0) continue;
+                edge_slot[2 * b + k] = incoming[s].size();
+                incoming[s].push_back(2 * b + k);
+            }
+        }
+    }
+
+    void run()
+    {
+        place_phis();
+        rename();
+        cells.assign(2 + insns + phis.size(), Known::unknown());
+        cells[zero] = Known::of(0);
+        cells[varying] = Known::varying();
+        link_users();
+        propagate();
+
+        for (unsigned b = 0; b < count; b++) {
+            if (executable[b]) rewrite(b);
+        }
+
+        //temps that became constants are not used any more
+        std::vector<unsigned> uses(ir.temps, 0);
+        for (const Instruction &insn : ir.code) {
+            for (unsigned k = 1; k < 3; k++) {
+                if (insn.operand(k).kind == OperandKind::Temp) uses[insn.operand(k).value]++;
+            }
+        }
+        ir.erase_if([&](const Instruction &insn) {
+            return insn.op == Opcode::Copy && insn.dst().kind == OperandKind::Temp && uses[insn.dst().value] == 0;
+        });
+    }
+};
+
+
+void fold_constants(IrProgram &ir)
+{
+    ConstantFolding(ir).run();
+}
@@ -0,0 +1,551 @@
+#include "ir.hpp"
+#include "ast.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+
+std::vector<std::vector<unsigned> > IrProgram::predecessors() const
+{
+    std::vector<std::vector<unsigned> > preds(blocks.size());
+    for (unsigned b = 0; b < blocks.size(); b++) {
+        for (int s : blocks[b].succ) {
+            if (s >= 0) preds[s].push_back(b);
+        }
+    }
+    return preds;
+}
+
+
+//! Builds the IR from the AST with the same kind of explicit work stack
+//! as code generation. Blocks are started in layout order, but branches
+//! name blocks that do not exist yet, so successors are recorded as labels
+//! and resolved once everything is lowered.
+class Lowering
+{
+private:
+    IrProgram &ir;
+    std::vector<Task> tasks;
+    std::vector<Operand> results; //values of the expressions lowered so far
+    std::vector<int> label_block; //block started at each label
+    unsigned labels = 0;
+
+    void push(NodePtr node, unsigned phase = 0, int saved = 0)
+    { tasks.push_back(Task{node, phase, saved}); }
+
+    Operand pop_result()
+    {
+        Operand o = results.back();
+        results.pop_back();
+        return o;
+    }
+
+    unsigned new_label()
+    {
+        label_block.push_back(-1);
+        return labels++;
+    }
+
+    void start(unsigned label)
+    {
+        label_block[label] = ir.blocks.size();
+        ir.blocks.push_back(BasicBlock{(unsigned)ir.code.size(), 0, {-1, -1}});
+    }
+
+    void emit(Opcode op, Operand dst = Operand::none(), Operand a = Operand::none(), Operand b = Operand::none())
+    { ir.code.emplace_back(op, dst, a, b); }
+
+    //successors are labels until resolve()
+    void terminate(Opcode op, Operand a = Operand::none(), int succ0 = -1, int succ1 = -1)
+    {
+        emit(op, Operand::none(), a);
+        BasicBlock &block = ir.blocks.back();
+        block.count = ir.code.size() - block.first;
+        block.succ[0] = succ0;
+        block.succ[1] = succ1;
+    }
+
+    void resolve()
+    {
+        for (BasicBlock &block : ir.blocks) {
+            for (int &s : block.succ) {
+                if (s >= 0) s = label_block[s];
+            }
+        }
+    }
+
+    static Opcode opcode(NodeKind kind)
+    {
+        switch (kind) {
+        case NodeKind::Add: return Opcode::Add;
+        case NodeKind::Sub: return Opcode::Sub;
+        case NodeKind::Mul: return Opcode::Mul;
+        case NodeKind::Div: return Opcode::Div;
+        case NodeKind::Less: return Opcode::Less;
+        case NodeKind::Equals: return Opcode::Equals;
+        default: throw std::runtime_error("no IR opcode for this node");
+        }
+    }
+
+    void step(const Task &task)
+    {
+        NodePtr node = task.node;
+        switch (node->kind) {
+        case NodeKind::Number:
+            results.push_back(Operand::imm(static_cast<const Number *>(node)->getValue()));
+            break;
+        case NodeKind::Variable:
+            results.push_back(Operand::var(static_cast<const Variable *>(node)->getId()));
+            break;
+        case NodeKind::Add: case NodeKind::Sub: case NodeKind::Mul:
+        case NodeKind::Div: case NodeKind::Equals: case NodeKind::Less: {
+            const Operator *op = static_cast<const Operator *>(node);
+            if (task.phase == 0) {
+                push(node, 1);
+                push(op->getRight());
+                push(op->getLeft());
+                break;
+            }
+            Operand b = pop_result(), a = pop_result(), dst = ir.new_temp();
+            emit(opcode(node->kind), dst, a, b);
+            results.push_back(dst);
+            break;
+        }
+        case NodeKind::Assign: {
+            //the value of an assignment is the variable it assigned
+            const AssignOp *assign = static_cast<const AssignOp *>(node);
+            if (task.phase == 0) {
+                push(node, 1);
+                push(assign->getRight());
+                break;
+            }
+            //the operation that computed the value can write the variable
+            Operand var = Operand::var(assign->getId()), value = pop_result();
+            if (value.kind == OperandKind::Temp && ir.code.size() > ir.blocks.back().first && ir.code.back().dst() == value) {
+                ir.code.back().set(0, var);
+            }
+            else emit(Opcode::Copy, var, value);
+            results.push_back(var);
+            break;
+        }
+        case NodeKind::Print:
+            if (task.phase == 0) {
+                push(node, 1);
+                push(static_cast<const PrintStat *>(node)->getExpr());
+            }
+            else emit(Opcode::Print, Operand::none(), pop_result());
+            break;
+        case NodeKind::Stat:
+            if (task.phase == 0) {
+                push(node, 1);
+                push(static_cast<const Stat *>(node)->getExpr());
+            }
+            else pop_result();
+            break;
+        case NodeKind::Compound: {
+            NodePtr seq = static_cast<const CompoundStat *>(node)->getSequence();
+            if (seq != nullptr) push(seq);
+            break;
+        }
+        case NodeKind::Sequence: {
+            const Sequence *seq = static_cast<const Sequence *>(node);
+            for (unsigned i = seq->size(); i-- > 0; ) push(seq->at(i));
+            break;
+        }
+        case NodeKind::If: {
+            const ifStat *stat = static_cast<const ifStat *>(node);
+            if (task.phase == 0) {
+                push(node, 1);
+                push(stat->getCondition());
+            } else if (task.phase == 1) {
+                unsigned then_label = new_label(), end_label = new_label();
+                terminate(Opcode::Branch, pop_result(), then_label, end_label);
+                start(then_label);
+                push(node, 2, end_label);
+                push(stat->getSequence());
+            } else {
+                terminate(Opcode::Jump, Operand::none(), task.saved);
+                start(task.saved);
+            }
+            break;
+        }
+        case NodeKind::IfElse: {
+            //three consecutive labels: then, else and end
+            const ifElseStat *stat = static_cast<const ifElseStat *>(node);
+            int else_label = task.saved, end_label = task.saved + 1;
+            if (task.phase == 0) {
+                push(node, 1);
+                push(stat->getCondition());
+            } else if (task.phase == 1) {
+                unsigned then_label = new_label();
+                else_label = new_label();
+                new_label();
+                terminate(Opcode::Branch, pop_result(), then_label, else_label);
+                start(then_label);
+                push(node, 2, else_label);
+                push(stat->getIfSequence());
+            } else if (task.phase == 2) {
+                terminate(Opcode::Jump, Operand::none(), end_label);
+                start(else_label);
+                push(node, 3, else_label);
+                push(stat->getElseSequence());
+            } else {
+                terminate(Opcode::Jump, Operand::none(), end_label);
+                start(end_label);
+            }
+            break;
+        }
+        case NodeKind::While: {
+            //tested at the bottom like the direct code generator does;
+            //three consecutive labels: body, condition and end
+            const whileStat *stat = static_cast<const whileStat *>(node);
+            int body_label = task.saved, cond_label = task.saved + 1, end_label = task.saved + 2;
+            if (task.phase == 0) {
+                body_label = new_label();
+                new_label();
+                new_label();
+                terminate(Opcode::Jump, Operand::none(), body_label + 1);
+                start(body_label);
+                push(node, 1, body_label);
+                push(stat->getSequence());
+            } else if (task.phase == 1) {
+                terminate(Opcode::Jump, Operand::none(), cond_label);
+                start(cond_label);
+                push(node, 2, body_label);
+                push(stat->getCondition());
+            } else {
+                terminate(Opcode::Branch, pop_result(), body_label, end_label);
+                start(end_label);
+            }
+            break;
+        }
+        case NodeKind::Program:
+            push(&static_cast<const Program *>(node)->getBody());
+            break;
+        default:
+            throw std::runtime_error("statement not supported by the IR");
+        }
+    }
+
+public:
+    Lowering(IrProgram &_ir)
+        : ir(_ir)
+    {}
+
+    void run(const Program &program)
+    {
+        start(new_label());
+        push(&program);
+        while (!tasks.empty()) {
+            Task task = tasks.back();
+            tasks.pop_back();
+            step(task);
+        }
+        terminate(Opcode::Return);
+        resolve();
+    }
+};
+
+
+IrProgram lower_program(const Program &program, const Symbols &symbols)
+{
+    IrProgram ir(symbols);
+    Lowering(ir).run(program);
+    return ir;
+}
+
+
+//backwards dataflow to a fixed point, visiting blocks last to first so
+//straight-line code settles in one pass and loops in a few
+Liveness compute_liveness(const IrProgram &ir)
+{
+    //a value is in some live-in set only if a block reads it before writing
+    //it; block + 1 stamps what each block has written so far
+    unsigned count = ir.blocks.size();
+    std::vector<unsigned> written(ir.values(), 0);
+    std::vector<int> global(ir.values(), -1);
+    Liveness live;
+    for (unsigned b = 0; b < count; b++) {
+        const BasicBlock &block = ir.blocks[b];
+        for (unsigned i = block.first; i < block.end(); i++) {
+            const Instruction &insn = ir.code[i];
+            for (unsigned k = 1; k < 3; k++) {
+                Operand o = insn.operand(k);
+                if (!o.is_value()) continue;
+                unsigned v = ir.value_index(o);
+                if (written[v] != b + 1 && global[v] < 0) {
+                    global[v] = live.globals.size();
+                    live.globals.push_back(v);
+                }
+            }
+            if (insn.dst().is_value()) written[ir.value_index(insn.dst())] = b + 1;
+        }
+    }
+
+    unsigned size = live.globals.size();
+    std::vector<ValueSet> uses(count, ValueSet(size)), defs(count, ValueSet(size));
+    for (unsigned b = 0; b < count; b++) {
+        const BasicBlock &block = ir.blocks[b];
+        for (unsigned i = block.first; i < block.end(); i++) {
+            const Instruction &insn = ir.code[i];
+            for (unsigned k = 1; k < 3; k++) {
+                Operand o = insn.operand(k);
+                if (!o.is_value()) continue;
+                int g = global[ir.value_index(o)];
+                if (g >= 0 && !defs[b].contains(g)) uses[b].insert(g);
+            }
+            if (insn.dst().is_value()) {
+                int g = global[ir.value_index(insn.dst())];
+                if (g >= 0) defs[b].insert(g);
+            }
+        }
+    }
+
+    live.in.assign(count, ValueSet(size));
+    live.out.assign(count, ValueSet(size));
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (unsigned b = count; b-- > 0; ) {
+            for (int s : ir.blocks[b].succ) {
+                if (s >= 0) live.out[b].merge(live.in[s]);
+            }
+            //in = uses + (out - defs)
+            ValueSet in = uses[b];
+            live.out[b].for_each([&](unsigned g) {
+                if (!defs[b].contains(g)) in.insert(g);
+            });
+            changed |= live.in[b].merge(in);
+        }
+    }
+    return live;
+}
+
+
+//reverse post-order, dominators by Cooper, Harvey and Kennedy's
+//iteration over it, then a loop for each block that a back edge goes to:
+//every block reaching the edge without passing through that header
+LoopNest find_loops(const IrProgram &ir)
+{
+    unsigned count = ir.blocks.size();
+    LoopNest nest;
+    std::vector<std::vector<unsigned> > preds = ir.predecessors();
+
+    std::vector<unsigned> postorder;
+    std::vector<std::pair<unsigned,unsigned> > stack(1, std::make_pair(0u, 0u));
+    std::vector<bool> seen(count, false);
+    seen[0] = true;
+    while (!stack.empty()) {
+        auto &top = stack.back();
+        if (top.second < 2) {
+            int s = ir.blocks[top.first].succ[top.second++];
+            if (s >= 0 && !seen[s]) {
+                seen[s] = true;
+                stack.emplace_back(s, 0);
+            }
+            continue;
+        }
+        postorder.push_back(top.first);
+        stack.pop_back();
+    }
+    std::vector<unsigned> rpo(postorder.rbegin(), postorder.rend());
+    std::vector<int> &order = nest.order;
+    order.assign(count, -1);
+    for (unsigned i = 0; i < rpo.size(); i++) order[rpo[i]] = i;
+
+    std::vector<unsigned> &idom = nest.idom;
+    idom.assign(count, 0);
+    std::vector<bool> done(count, false);
+    done[0] = true;
+    auto intersect = [&](unsigned a, unsigned b) {
+        while (a != b) {
+            while (order[a] > order[b]) a = idom[a];
+            while (order[b] > order[a]) b = idom[b];
+        }
+        return a;
+    };
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (unsigned i = 1; i < rpo.size(); i++) {
+            unsigned b = rpo[i];
+            int dom = -1;
+            for (unsigned p : preds[b]) {
+                if (!done[p]) continue;
+                dom = dom < 0 ? p : intersect(p, dom);
+            }
+            if (!done[b] || idom[b] != (unsigned)dom) {
+                idom[b] = dom;
+                done[b] = changed = true;
+            }
+        }
+    }
+
+    std::vector<std::vector<unsigned> > children(count);
+    for (unsigned i = 1; i < rpo.size(); i++) children[idom[rpo[i]]].push_back(rpo[i]);
+    nest.pre.assign(count, 0);
+    nest.post.assign(count, 0);
+    unsigned clock = 0;
+    stack.assign(1, std::make_pair(0u, 0u));
+    nest.pre[0] = clock++;
+    while (!stack.empty()) {
+        auto &top = stack.back();
+        if (top.second < children[top.first].size()) {
+            unsigned child = children[top.first][top.second++];
+            nest.pre[child] = clock++;
+            stack.emplace_back(child, 0);
+            continue;
+        }
+        nest.post[top.first] = clock++;
+        stack.pop_back();
+    }
+
+    std::vector<int> loop_of(count, -1);
+    std::vector<unsigned> mark(count, 0);
+    for (unsigned b : rpo) {
+        for (int h : ir.blocks[b].succ) {
+            if (h < 0 || !nest.dominates(h, b)) continue;
+            if (loop_of[h] < 0) {
+                loop_of[h] = nest.loops.size();
+                nest.loops.push_back(LoopNest::Loop{(unsigned)h, std::vector<unsigned>(1, h), -1});
+            }
+            LoopNest::Loop &loop = nest.loops[loop_of[h]];
+            unsigned id = loop_of[h] + 1;
+            for (unsigned block : loop.blocks) mark[block] = id;
+            std::vector<unsigned> work;
+            if (mark[b] != id) {
+                mark[b] = id;
+                work.push_back(b);
+            }
+            while (!work.empty()) {
+                unsigned block = work.back();
+                work.pop_back();
+                loop.blocks.push_back(block);
+                for (unsigned p : preds[block]) {
+                    if (order[p] >= 0 && mark[p] != id) {
+                        mark[p] = id;
+                        work.push_back(p);
+                    }
+                }
+            }
+        }
+    }
+
+    for (LoopNest::Loop &loop : nest.loops) {
+        std::sort(loop.blocks.begin(), loop.blocks.end(), [&](unsigned a, unsigned b) { return order[a] < order[b]; });
+        bool single = true;
+        for (unsigned p : preds[loop.header]) {
+            if (order[p] < 0 || std::binary_search(loop.blocks.begin(), loop.blocks.end(), p,
+                    [&](unsigned a, unsigned b) { return order[a] < order[b]; })) continue;
+            single = loop.entry < 0;
+            loop.entry = p;
+            if (!single) break;
+        }
+        if (!single || (loop.entry >= 0 && ir.terminator(loop.entry).op != Opcode::Jump)) loop.entry = -1;
+    }
+    //an outer loop holds all the blocks of the loops inside it
+    std::stable_sort(nest.loops.begin(), nest.loops.end(), [](const LoopNest::Loop &a, const LoopNest::Loop &b) {
+        return a.blocks.size() > b.blocks.size();
+    });
+    return nest;
+}
+
+
+//which blocks need labels, and which branches do their comparison
+BlockLayout lay_out_blocks(const IrProgram &ir)
+{
+    std::vector<unsigned> reads(ir.values(), 0);
+    for (const Instruction &insn : ir.code) {
+        for (unsigned k = 1; k < 3; k++) {
+            if (insn.operand(k).is_value()) reads[ir.value_index(insn.operand(k))]++;
+        }
+    }
+
+    BlockLayout layout;
+    layout.labelled.assign(ir.blocks.size(), false);
+    layout.fused.assign(ir.blocks.size(), nullptr);
+    for (unsigned b = 0; b < ir.blocks.size(); b++) {
+        const BasicBlock &block = ir.blocks[b];
+        const Instruction &insn = ir.terminator(b);
+        int next = b + 1;
+        switch (insn.op) {
+        case Opcode::Return:
+            layout.exit_labelled |= next != (int)ir.blocks.size();
+            break;
+        case Opcode::Jump:
+            if (block.succ[0] != next) layout.labelled[block.succ[0]] = true;
+            break;
+        default:
+            if (block.succ[0] != next) layout.labelled[block.succ[0]] = true;
+            if (block.succ[1] != next && block.succ[1] != block.succ[0]) layout.labelled[block.succ[1]] = true;
+        }
+
+        if (insn.op != Opcode::Branch || block.succ[0] == block.succ[1] || block.count < 2) continue;
+        const Instruction &compare = ir.code[block.end() - 2];
+        if (compare.op != Opcode::Less && compare.op != Opcode::Equals) continue;
+        if (insn.a().is_value() && compare.dst() == insn.a() && reads[ir.value_index(insn.a())] == 1) layout.fused[b] = &compare;
+    }
+    return layout;
+}
+
+
+static void print_operand(std::ostream &dst, const IrProgram &ir, Operand o)
+{
+    switch (o.kind) {
+    case OperandKind::Temp: dst<<"t"<<o.value; break;
+    case OperandKind::Var: dst<<ir.symbols->name(o.value); break;
+    case OperandKind::Imm: dst<<o.value; break;
+    case OperandKind::None: break;
+    }
+}
+
+//one block per paragraph: variables print as their names and, since
+//names are letters only, temps as t0, t1, ...
+void print_ir(std::ostream &dst, const IrProgram &ir)
+{
+    static const char *const names[] = { "copy", "add", "sub", "mul", "div", "less", "equals",
+                                         "print", "jump", "branch", "return" };
+    std::vector<std::vector<unsigned> > preds = ir.predecessors();
+    for (unsigned b = 0; b < ir.blocks.size(); b++) {
+        const BasicBlock &block = ir.blocks[b];
+        dst<<"B"<<b<<":";
+        if (!preds[b].empty()) {
+            dst<<"\t\t; from";
+            for (unsigned p : preds[b]) dst<<" B"<<p;
+        }
+        dst<<"\n";
+        for (unsigned i = block.first; i < block.end(); i++) {
+            const Instruction &insn = ir.code[i];
+            dst<<"\t";
+            switch (insn.op) {
+            case Opcode::Copy:
+                print_operand(dst, ir, insn.dst());
+                dst<<" = ";
+                print_operand(dst, ir, insn.a());
+                break;
+            case Opcode::Print:
+                dst<<"print ";
+                print_operand(dst, ir, insn.a());
+                break;
+            case Opcode::Jump:
+                dst<<"jump B"<<block.succ[0];
+                break;
+            case Opcode::Branch:
+                dst<<"branch ";
+                print_operand(dst, ir, insn.a());
+                dst<<", B"<<block.succ[0]<<", B"<<block.succ[1];
+                break;
+            case Opcode::Return:
+                dst<<"return";
+                break;
+            default:
+                print_operand(dst, ir, insn.dst());
+                dst<<" = "<<names[(int)insn.op]<<" ";
+                print_operand(dst, ir, insn.a());
+                dst<<", ";
+                print_operand(dst, ir, insn.b());
+            }
+            dst<<"\n";
+        }
+        dst<<"\n";
+    }
+}
@@ -0,0 +1,162 @@
+#include "passes.hpp"
+
+#include <vector>
+
+
+//! The instructions in each loop that compute the same value on every
+//! iteration, moved to the block that enters it. Loops are visited
+//! outermost first, so an instruction ends up in front of the outermost
+//! loop it does not depend on.
+class LoopMotion
+{
+private:
+    IrProgram &ir;
+    LoopNest nest;
+
+    Liveness live;
+    std::vector<int> global; //position of each value in the live sets
+
+    std::vector<bool> moved;                       //by instruction
+    std::vector<std::vector<Instruction> > hoisted; //by block they go to
+
+    //per loop, reset through touched
+    std::vector<unsigned> defs, stamp, in_loop;
+    std::vector<unsigned> touched;
+    unsigned loop_id = 0;
+
+    bool live_in(unsigned block, unsigned v) const
+    { return global[v] >= 0 && live.in[block].contains(global[v]); }
+
+    //! Values with no definition left in the loop, or defined by what was
+    //! already moved out of it
+    bool invariant(Operand o) const
+    {
+        if (!o.is_value()) return true;
+        unsigned v = ir.value_index(o);
+        return defs[v] == 0 || stamp[v] == loop_id;
+    }
+
+    static bool movable(Opcode op)
+    {
+        switch (op) {
+        case Opcode::Copy: case Opcode::Add: case Opcode::Sub: case Opcode::Mul:
+        case Opcode::Div: case Opcode::Less: case Opcode::Equals:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    void hoist(const LoopNest::Loop &loop)
+    {
+        //the code has to go somewhere that only ever leads into the loop
+        if (loop.entry < 0) return;
+        loop_id++;
+        unsigned header = loop.header;
+        for (unsigned b : loop.blocks) in_loop[b] = loop_id;
+
+        std::vector<unsigned> exiting, targets;
+        for (unsigned b : loop.blocks) {
+            for (int s : ir.blocks[b].succ) {
+                if (s >= 0 && in_loop[s] != loop_id) {
+                    exiting.push_back(b);
+                    targets.push_back(s);
+                }
+            }
+        }
+
+        for (unsigned v : touched) defs[v] = 0;
+        touched.clear();
+        for (unsigned b : loop.blocks) {
+            const BasicBlock &block = ir.blocks[b];
+            for (unsigned i = block.first; i < block.end(); i++) {
+                if (moved[i] || !ir.code[i].dst().is_value()) continue;
+                unsigned v = ir.value_index(ir.code[i].dst());
+                if (defs[v]++ == 0) touched.push_back(v);
+            }
+        }
+
+        //until a print is reached, the header runs whenever the loop is
+        //entered, before anything observable in it
+        unsigned first_print = ir.blocks[header].end();
+        for (unsigned i = ir.blocks[header].first; i < ir.blocks[header].end(); i++) {
+            if (ir.code[i].op == Opcode::Print) {
+                first_print = i;
+                break;
+            }
+        }
+
+        for (bool changed = true; changed; ) {
+            changed = false;
+            for (unsigned b : loop.blocks) {
+                const BasicBlock &block = ir.blocks[b];
+                for (unsigned i = block.first; i + 1 < block.end(); i++) {
+                    const Instruction &insn = ir.code[i];
+                    if (moved[i] || !movable(insn.op) || !invariant(insn.a()) || !invariant(insn.b())) continue;
+                    unsigned v = ir.value_index(insn.dst());
+                    if (defs[v] != 1 || live_in(header, v)) continue;
+
+                    //a division that may trap must not trap sooner than it would have
+                    if (insn.op == Opcode::Div && !(insn.b().kind == OperandKind::Imm && insn.b().value != 0)
+                        && (b != header || i > first_print)) continue;
+
+                    //the value left behind has to be the same on every way out
+                    bool everywhere = true;
+                    for (unsigned e : exiting) everywhere &= nest.dominates(b, e);
+                    if (!everywhere) {
+                        bool read = false;
+                        for (unsigned t : targets) read |= live_in(t, v);
+                        if (read) continue;
+                    }
+
+                    moved[i] = changed = true;
+                    stamp[v] = loop_id;
+                    hoisted[loop.entry].push_back(insn);
+                }
+            }
+        }
+    }
+
+public:
+    LoopMotion(IrProgram &_ir)
+        : ir(_ir),
+        nest(find_loops(_ir))
+    {}
+
+    void run()
+    {
+        if (nest.loops.empty()) return;
+
+        live = compute_liveness(ir);
+        global.assign(ir.values(), -1);
+        for (unsigned g = 0; g < live.globals.size(); g++) global[live.globals[g]] = g;
+        moved.assign(ir.code.size(), false);
+        hoisted.resize(ir.blocks.size());
+        defs.assign(ir.values(), 0);
+        stamp.assign(ir.values(), 0);
+        in_loop.assign(ir.blocks.size(), 0);
+        for (const LoopNest::Loop &loop : nest.loops) hoist(loop);
+
+        //each block without what left it, then what joined it, then its terminator
+        std::vector<Instruction> code;
+        code.reserve(ir.code.size());
+        for (unsigned b = 0; b < ir.blocks.size(); b++) {
+            BasicBlock &block = ir.blocks[b];
+            unsigned first = code.size();
+            for (unsigned i = block.first; i + 1 < block.end(); i++) {
+                if (!moved[i]) code.push_back(ir.code[i]);
+            }
+            code.insert(code.end(), hoisted[b].begin(), hoisted[b].end());
+            code.push_back(ir.code[block.end() - 1]);
+            block.first = first;
+            block.count = code.size() - first;
+        }
+        ir.code.swap(code);
+    }
+};
+
+
+void hoist_loop_invariants(IrProgram &ir)
+{
+    LoopMotion(ir).run();
+}
@@ -0,0 +1,1023 @@
+#include "object.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+//from the System V ABI and its MIPS supplement
+static const uint32_t
+    SHT_PROGBITS = 1, SHT_SYMTAB = 2, SHT_STRTAB = 3, SHT_NOBITS = 8, SHT_REL = 9,
+    SHT_MIPS_REGINFO = 0x70000006, SHT_MIPS_ABIFLAGS = 0x7000002a,
+    SHF_WRITE = 0x1, SHF_ALLOC = 0x2, SHF_EXECINSTR = 0x4, SHF_INFO_LINK = 0x40,
+    EF_MIPS_NOREORDER = 0x1, EF_MIPS_PIC = 0x2, EF_MIPS_CPIC = 0x4, EF_MIPS_NAN2008 = 0x400,
+    EF_MIPS_ABI_O32 = 0x1000, EF_MIPS_ARCH_32 = 0x50000000;
+
+static const uint8_t
+    STB_LOCAL = 0, STB_GLOBAL = 1,
+    STT_NOTYPE = 0, STT_OBJECT = 1, STT_FUNC = 2, STT_SECTION = 3,
+    R_MIPS_NONE = 0, R_MIPS_32 = 2, R_MIPS_HI16 = 5, R_MIPS_LO16 = 6, R_MIPS_GPREL16 = 7,
+    R_MIPS_GOT16 = 9, R_MIPS_CALL16 = 11, R_MIPS_JALR = 37;
+
+
+//! How the operands of an instruction go into its word
+enum class Format : uint8_t
+{
+    None,       //nop
+    Rd_Rs_Rt,   //addu d,s,t
+    Rd_Rt_Sa,   //sll d,t,sa
+    Rt_Rs_Imm,  //addiu t,s,imm
+    Rt_Imm,     //lui t,imm
+    Rt_Mem,     //lw t,off(base)
+    Rs_Rt,      //mult s,t and div [$0,]s,t
+    Rd,         //mflo d
+    Rs,         //jr s, and j s
+    Jalr,       //jalr [d,]s
+    Trap,       //teq s,t[,code]
+    Branch2,    //beq s,t,label
+    Branch1,    //bgez s,label
+    Branch0,    //b label
+    Li,         //li t,imm: one or two instructions
+    Move        //move d,s: or d,s,$0
+};
+
+struct Encoding
+{
+    Format format;
+    uint32_t bits;
+    bool is_signed = true; //immediate range
+};
+
+//! Every instruction the code generators emit, and the few macros among
+//! them expanded the way the GNU assembler expands them
+static const std::unordered_map<std::string, Encoding> &encodings()
+{
+    static const std::unordered_map<std::string, Encoding> table = {
+        {"nop", {Format::None, 0x00000000}},
+        {"syscall", {Format::None, 0x0000000c}},
+        {"add", {Format::Rd_Rs_Rt, 0x00000020}},
+        {"addu", {Format::Rd_Rs_Rt, 0x00000021}},
+        {"sub", {Format::Rd_Rs_Rt, 0x00000022}},
+        {"subu", {Format::Rd_Rs_Rt, 0x00000023}},
+        {"and", {Format::Rd_Rs_Rt, 0x00000024}},
+        {"or", {Format::Rd_Rs_Rt, 0x00000025}},
+        {"xor", {Format::Rd_Rs_Rt, 0x00000026}},
+        {"nor", {Format::Rd_Rs_Rt, 0x00000027}},
+        {"slt", {Format::Rd_Rs_Rt, 0x0000002a}},
+        {"sltu", {Format::Rd_Rs_Rt, 0x0000002b}},
+        {"mul", {Format::Rd_Rs_Rt, 0x70000002}},
+        {"sll", {Format::Rd_Rt_Sa, 0x00000000}},
+        {"srl", {Format::Rd_Rt_Sa, 0x00000002}},
+        {"sra", {Format::Rd_Rt_Sa, 0x00000003}},
+        {"addiu", {Format::Rt_Rs_Imm, 0x24000000}},
+        {"slti", {Format::Rt_Rs_Imm, 0x28000000}},
+        {"sltiu", {Format::Rt_Rs_Imm, 0x2c000000}},
+        {"andi", {Format::Rt_Rs_Imm, 0x30000000, false}},
+        {"ori", {Format::Rt_Rs_Imm, 0x34000000, false}},
+        {"xori", {Format::Rt_Rs_Imm, 0x38000000, false}},
+        {"lui", {Format::Rt_Imm, 0x3c000000, false}},
+        {"lb", {Format::Rt_Mem, 0x80000000}},
+        {"lh", {Format::Rt_Mem, 0x84000000}},
+        {"lw", {Format::Rt_Mem, 0x8c000000}},
+        {"lbu", {Format::Rt_Mem, 0x90000000}},
+        {"lhu", {Format::Rt_Mem, 0x94000000}},
+        {"sb", {Format::Rt_Mem, 0xa0000000}},
+        {"sh", {Format::Rt_Mem, 0xa4000000}},
+        {"sw", {Format::Rt_Mem, 0xac000000}},
+        {"mult", {Format::Rs_Rt, 0x00000018}},
+        {"multu", {Format::Rs_Rt, 0x00000019}},
+        {"div", {Format::Rs_Rt, 0x0000001a}},
+        {"divu", {Format::Rs_Rt, 0x0000001b}},
+        {"mfhi", {Format::Rd, 0x00000010}},
+        {"mflo", {Format::Rd, 0x00000012}},
+        {"jr", {Format::Rs, 0x00000008}},
+        {"j", {Format::Rs, 0x00000008}},
+        {"jalr", {Format::Jalr, 0x00000009}},
+        {"teq", {Format::Trap, 0x00000034}},
+        {"beq", {Format::Branch2, 0x10000000}},
+        {"bne", {Format::Branch2, 0x14000000}},
+        {"beqz", {Format::Branch1, 0x10000000}},
+        {"bnez", {Format::Branch1, 0x14000000}},
+        {"bltz", {Format::Branch1, 0x04000000}},
+        {"bgez", {Format::Branch1, 0x04010000}},
+        {"bgezal", {Format::Branch1, 0x04110000}},
+        {"blez", {Format::Branch1, 0x18000000}},
+        {"bgtz", {Format::Branch1, 0x1c000000}},
+        {"b", {Format::Branch0, 0x10000000}},
+        {"bal", {Format::Branch0, 0x04110000}},
+        {"li", {Format::Li, 0}},
+        {"move", {Format::Move, 0x00000025}}
+    };
+    return table;
+}
+
+//! The immediate form the assembler turns an R-type instruction into when
+//! its last operand is a constant, as in sltu $8,$9,1
+static const char *immediate_form(const std::string &op)
+{
+    static const char *const forms[][2] = {
+        {"addu", "addiu"}, {"slt", "slti"}, {"sltu", "sltiu"}, {"and", "andi"}, {"or", "ori"}, {"xor", "xori"}
+    };
+    for (const auto &form : forms) {
+        if (op == form[0]) return form[1];
+    }
+    return nullptr;
+}
+
+static bool parse_number(const std::string &text, long &value)
+{
+    if (text.empty()) return false;
+    char *end;
+    value = strtol(text.c_str(), &end, 0);
+    return *end == '\0';
+}
+
+static bool is_numeric(const std::string &name)
+{ return !name.empty() && std::all_of(name.begin(), name.end(), [](char c) { return c >= '0' && c <= '9'; }); }
+
+//! Words li takes: one if the value fits addiu, ori or lui, two otherwise
+static unsigned li_words(long value)
+{
+    uint32_t bits = value;
+    return (value >= -32768 && value <= 65535) || (bits & 0xffff) == 0 ? 1 : 2;
+}
+
+
+class Assembler
+{
+private:
+    struct Relocation
+    {
+        uint32_t offset;
+        unsigned symbol;
+        uint8_t type;
+    };
+
+    struct Section
+    {
+        std::string name;
+        uint32_t type, flags;
+        uint32_t align = 1;
+        uint32_t size = 0;          //from the layout pass
+        std::string bytes;          //from the encoding pass, empty when nobits
+        std::vector<Relocation> relocations;
+        unsigned symbol = 0;        //its STT_SECTION symbol
+        unsigned index = 0;         //in the section header table
+    };
+
+    struct Symbol
+    {
+        std::string name;
+        int section = -1;           //-1 while undefined
+        int line = -1;              //defining line
+        uint32_t size = 0;
+        uint8_t type = STT_NOTYPE;
+        bool global = false;
+        unsigned index = 0;         //in .symtab, 0 if left out
+    };
+
+    //! Trampolines for branches whose target is further than 128KB away,
+    //! placed in front of line: a branch over them, then per target a jump
+    //! through $1, which the code generators never use
+    struct Island
+    {
+        unsigned line;
+        std::vector<unsigned> targets; //target lines
+        uint32_t before = 0;           //bytes of the islands in front of it
+
+        uint32_t size() const
+        { return targets.empty() ? 0 : 8 + 16 * targets.size(); }
+    };
+
+    static const unsigned text = 0;
+    static const uint32_t island_spacing = 64 << 10;
+
+    const std::vector<AsmLine> &lines;
+    bool little_endian;
+
+    std::vector<Section> sections;
+    std::vector<Symbol> symbols;
+    std::unordered_map<std::string, unsigned> symbol_index;
+    std::unordered_map<std::string, std::vector<unsigned> > numbered; //lines defining 1: and so on
+
+    //per line, from the layout pass
+    std::vector<uint32_t> at;
+    std::vector<uint8_t> section_of;
+    std::vector<unsigned> branches;
+
+    std::vector<Island> islands;
+    //%got and %hi relocations waiting for their %lo
+    struct PendingHigh
+    {
+        unsigned section, relocation, symbol;
+    };
+    std::vector<PendingHigh> pending_high;
+
+    unsigned current = text, previous = text;
+    bool noreorder = false, any_noreorder = false, abicalls = false, nan2008 = false;
+    uint32_t gprmask = 0;
+
+    [[noreturn]] void fail(unsigned i, const std::string &message) const
+    {
+        const AsmLine &line = lines[i];
+        std::string text = line.kind == AsmLine::Label ? line.op + ":" : line.label.empty() ? "" : line.label + ":";
+        if (line.kind == AsmLine::Instruction) {
+            text += "\t" + line.op;
+            for (unsigned a = 0; a < line.count; a++) text += (a == 0 ? "\t" : ",") + line.args[a];
+        }
+        else if (line.kind == AsmLine::Other) text += line.op;
+        throw std::runtime_error("line " + std::to_string(i + 1) + ": " + message + ": " + text);
+    }
+
+    unsigned section(const std::string &name, uint32_t type, uint32_t flags)
+    {
+        for (unsigned s = 0; s < sections.size(); s++) {
+            if (sections[s].name == name) return s;
+        }
+        Section section;
+        section.name = name;
+        section.type = type;
+        section.flags = flags;
+        if (name == ".text" || name == ".data" || name == ".bss") section.align = 16;   //as the GNU assembler has them
+        sections.push_back(section);
+        return sections.size() - 1;
+    }
+
+    unsigned symbol(const std::string &name)
+    {
+        auto it = symbol_index.find(name);
+        if (it != symbol_index.end()) return it->second;
+        symbols.emplace_back();
+        symbols.back().name = name;
+        symbol_index.emplace(name, symbols.size() - 1);
+        return symbols.size() - 1;
+    }
+
+    void define(unsigned i, const std::string &name)
+    {
+        if (is_numeric(name)) {
+            numbered[name].push_back(i);
+            return;
+        }
+        Symbol &defined = symbols[symbol(name)];
+        if (defined.line >= 0) fail(i, "symbol defined twice");
+        defined.section = current;
+        defined.line = i;
+    }
+
+    //! Bytes of islands in front of line i, which must be in .text
+    uint32_t island_bytes(unsigned i) const
+    {
+        auto next = std::upper_bound(islands.begin(), islands.end(), i, [](unsigned line, const Island &island) {
+            return line < island.line;
+        });
+        return next == islands.begin() ? 0 : next[-1].before + next[-1].size();
+    }
+
+    uint32_t address(unsigned i) const
+    { return at[i] + (section_of[i] == text && !islands.empty() ? island_bytes(i) : 0); }
+
+    uint32_t value(const Symbol &defined) const
+    { return address(defined.line); }
+
+    //! Line a branch or .reloc operand names: a symbol, or 1f or 1b
+    unsigned target_line(unsigned i, const std::string &name) const
+    {
+        std::string number = name.substr(0, name.size() - 1);
+        if (name.size() > 1 && (name.back() == 'f' || name.back() == 'b') && is_numeric(number)) {
+            auto it = numbered.find(number);
+            if (it != numbered.end()) {
+                const std::vector<unsigned> &defined = it->second;
+                auto after = std::upper_bound(defined.begin(), defined.end(), i);
+                if (name.back() == 'f' && after != defined.end()) return *after;
+                if (name.back() == 'b' && after != defined.begin()) return after[-1];
+            }
+            fail(i, "undefined label " + name);
+        }
+        auto it = symbol_index.find(name);
+        if (it == symbol_index.end() || symbols[it->second].line < 0) fail(i, "undefined label " + name);
+        return symbols[it->second].line;
+    }
+
+    int reg(unsigned i, const std::string &name)
+    {
+        int r = register_number(name);
+        if (r < 0 || r > 31) fail(i, "not a register: " + name);
+        if (r != 0) gprmask |= 1u << r;
+        return r;
+    }
+
+    void expect(unsigned i, unsigned count) const
+    { if (lines[i].count != count) fail(i, "wrong number of operands"); }
+
+    static void split_directive(const std::string &text, std::string &name, std::vector<std::string> &args)
+    {
+        size_t start = text.find_first_not_of(" \t");
+        size_t end = start == std::string::npos ? start : text.find_first_of(" \t", start);
+        name = start == std::string::npos ? "" : text.substr(start, end - start);
+        args.clear();
+        if (end == std::string::npos) return;
+        std::string arg;
+        bool quoted = false;
+        for (size_t p = end; p < text.size(); p++) {
+            char c = text[p];
+            if (c == '"' && (p == 0 || text[p - 1] != '\\')) quoted = !quoted;
+            if (c == ',' && !quoted) {
+                args.push_back(arg);
+                arg.clear();
+            }
+            else if (quoted || (c != ' ' && c != '\t')) arg += c;
+        }
+        if (!arg.empty() || !args.empty()) args.push_back(arg);
+    }
+
+    //! Bytes of a .ascii string, escapes decoded
+    std::string ascii(unsigned i, const std::string &quoted) const
+    {
+        if (quoted.size() < 2 || quoted.front() != '"' || quoted.back() != '"') fail(i, "expected a string");
+        std::string bytes;
+        for (size_t p = 1; p + 1 < quoted.size(); p++) {
+            if (quoted[p] != '\\') {
+                bytes += quoted[p];
+                continue;
+            }
+            char c = quoted[++p];
+            if (c >= '0' && c <= '7') {
+                int code = 0;
+                for (int digits = 0; digits < 3 && quoted[p] >= '0' && quoted[p] <= '7'; digits++) code = code * 8 + quoted[p++] - '0';
+                p--;
+                bytes += (char)code;
+            }
+            else if (c == 'n') bytes += '\n';
+            else if (c == 't') bytes += '\t';
+            else bytes += c;
+        }
+        return bytes;
+    }
+
+    //! Pad the current section to a multiple of bytes
+    void align_to(uint32_t bytes, bool encode)
+    {
+        Section &s = sections[current];
+        s.align = std::max(s.align, bytes);
+        uint32_t padding = (bytes - s.size % bytes) % bytes;
+        s.size += padding;
+        if (encode && s.type != SHT_NOBITS) s.bytes.append(padding, '\0');
+    }
+
+    void reserve(unsigned i, const std::string &bytes, bool encode)
+    {
+        Section &s = sections[current];
+        if (s.type == SHT_NOBITS) fail(i, "data in a nobits section");
+        s.size += bytes.size();
+        if (encode) s.bytes += bytes;
+    }
+
+    std::string word_bytes(uint32_t word) const
+    {
+        char bytes[4];
+        for (int b = 0; b < 4; b++) bytes[little_endian ? b : 3 - b] = (char)(word >> (8 * b));
+        return std::string(bytes, 4);
+    }
+
+    //! Run directive line i, in the layout pass or the encoding pass. The
+    //! passes see the same sizes, so offsets agree.
+    void directive(unsigned i, bool encode)
+    {
+        std::string name;
+        std::vector<std::string> args;
+        split_directive(lines[i].op, name, args);
+        if (name.empty()) return;
+        long n;
+
+        if (name == ".text" || name == ".data" || name == ".rdata" || name == ".bss" || name == ".section") {
+            std::string section_name = name == ".section" ? (args.empty() ? "" : args[0]) : name;
+            uint32_t type = SHT_PROGBITS, flags = 0;
+            if (section_name == ".text") flags = SHF_ALLOC | SHF_EXECINSTR;
+            else if (section_name == ".data") flags = SHF_ALLOC | SHF_WRITE;
+            else if (section_name == ".rdata") flags = SHF_ALLOC;
+            else if (section_name == ".bss" || section_name == ".sbss") {
+                type = SHT_NOBITS;
+                flags = SHF_ALLOC | SHF_WRITE;
+            }
+            else if (section_name.empty() || section_name[0] != '.') fail(i, "unknown section");
+            else if (args.size() > 1) {
+                for (char c : args[1]) flags |= c == 'a' ? SHF_ALLOC : c == 'w' ? SHF_WRITE : c == 'x' ? SHF_EXECINSTR : 0;
+                if (args.size() > 2 && args[2] == "@nobits") type = SHT_NOBITS;
+            }
+            previous = current;
+            current = section(section_name, type, flags);
+        }
+        else if (name == ".previous") std::swap(current, previous);
+        else if (name == ".align") {
+            if (args.size() != 1 || !parse_number(args[0], n) || n < 0 || n > 16) fail(i, "bad alignment");
+            align_to(1u << n, encode);
+        }
+        else if (name == ".space") {
+            if (args.size() != 1 || !parse_number(args[0], n) || n < 0) fail(i, "bad size");
+            Section &s = sections[current];
+            s.size += n;
+            if (encode && s.type != SHT_NOBITS) s.bytes.append(n, '\0');
+        }
+        else if (name == ".word") {
+            align_to(4, encode);
+            for (const std::string &arg : args) {
+                if (!parse_number(arg, n)) fail(i, "only constant words are supported");
+                reserve(i, word_bytes(n), encode);
+            }
+        }
+        else if (name == ".ascii") {
+            for (const std::string &arg : args) reserve(i, ascii(i, arg), encode);
+        }
+        else if (name == ".cpload") {
+            //lui $gp,%hi(_gp_disp); addiu $gp,$gp,%lo(_gp_disp); addu $gp,$gp,reg
+            if (args.size() != 1) fail(i, "wrong number of operands");
+            if (!encode) {
+                sections[current].size += 12;
+                return;
+            }
+            int r = reg(i, args[0]);
+            gprmask |= 1u << 28;
+            unsigned gp_disp = symbol("_gp_disp");
+            symbols[gp_disp].global = true;
+            emit(i, 0x3c1c0000 | relocate(i, R_MIPS_HI16, gp_disp));
+            emit(i, 0x279c0000 | relocate(i, R_MIPS_LO16, gp_disp));
+            emit(i, 0x0380e021 | r << 16);
+        }
+        else if (name == ".cprestore") {
+            //sw $gp,offset($sp)
+            if (args.size() != 1 || !parse_number(args[0], n) || n < -32768 || n > 32767) fail(i, "bad offset");
+            if (!encode) {
+                sections[current].size += 4;
+                return;
+            }
+            gprmask |= 1u << 28 | 1u << 29;
+            emit(i, 0xafbc0000 | (n & 0xffff));
+        }
+        else if (name == ".reloc") {
+            static const std::pair<const char *,uint8_t> types[] = {
+                {"R_MIPS_NONE", R_MIPS_NONE}, {"R_MIPS_32", R_MIPS_32}, {"R_MIPS_JALR", R_MIPS_JALR}
+            };
+            if (args.size() != 3) fail(i, "wrong number of operands");
+            if (!encode) return;
+            unsigned where = target_line(i, args[0]);
+            if (section_of[where] != current) fail(i, "relocation outside the section");
+            const auto *type = std::find_if(std::begin(types), std::end(types), [&](const std::pair<const char *,uint8_t> &t) {
+                return args[1] == t.first;
+            });
+            if (type == std::end(types)) fail(i, "unknown relocation");
+            unsigned target = symbol(args[2]);
+            if (symbols[target].line >= 0 && !symbols[target].global) target = sections[symbols[target].section].symbol;
+            sections[current].relocations.push_back(Relocation{address(where), target, type->second});
+        }
+        else if (name == ".globl") {
+            for (const std::string &arg : args) symbols[symbol(arg)].global = true;
+        }
+        else if (name == ".type") {
+            if (args.size() != 2) fail(i, "wrong number of operands");
+            Symbol &typed = symbols[symbol(args[0])];
+            if (args[1] == "@function") typed.type = STT_FUNC;
+            else if (args[1] == "@object") typed.type = STT_OBJECT;
+            else fail(i, "unknown symbol type");
+        }
+        else if (name == ".size") {
+            if (args.size() != 2) fail(i, "wrong number of operands");
+            if (!encode) return;
+            Symbol &sized = symbols[symbol(args[0])];
+            if (args[1] == ".-" + args[0] && sized.section == (int)current) n = sections[current].size - value(sized);
+            else if (!parse_number(args[1], n)) fail(i, "bad size");
+            sized.size = n;
+        }
+        else if (name == ".set") {
+            if (args.size() != 1) fail(i, "wrong number of operands");
+            if (args[0] == "noreorder") noreorder = any_noreorder = true;
+            else if (args[0] == "reorder") noreorder = false;
+            else if (args[0] != "nomips16" && args[0] != "nomicromips" && args[0] != "noat" && args[0] != "at"
+                     && args[0] != "nomacro" && args[0] != "macro") fail(i, "unsupported .set");
+        }
+        else if (name == ".abicalls") abicalls = true;
+        else if (name == ".nan") {
+            if (args.size() != 1 || (args[0] != "legacy" && args[0] != "2008")) fail(i, "unknown .nan");
+            nan2008 = args[0] == "2008";
+        }
+        else if (name == ".module") {
+            if (args.size() != 1 || (args[0] != "fp=xx" && args[0] != "nooddspreg")) fail(i, "unsupported .module");
+        }
+        //only for debuggers, which .mdebug.abi32 and the symbols serve
+        else if (name != ".file" && name != ".ent" && name != ".end" && name != ".frame"
+                 && name != ".mask" && name != ".fmask") fail(i, "unsupported directive");
+    }
+
+    void emit(unsigned i, uint32_t word)
+    {
+        Section &s = sections[current];
+        if (!(s.flags & SHF_EXECINSTR)) fail(i, "instruction outside a code section");
+        s.bytes += word_bytes(word);
+        s.size += 4;
+    }
+
+    //! Record a relocation of the next word against symbol s and return the
+    //! addend it keeps in place. Local symbols are replaced by their
+    //! section, the offset going in the instruction, and a %got or %hi is
+    //! moved right in front of the %lo it pairs with, as ld expects.
+    uint32_t relocate(unsigned i, uint8_t type, unsigned s)
+    {
+        Section &in = sections[current];
+        Symbol &target = symbols[s];
+        unsigned against = s;
+        uint32_t addend = 0;
+        if (target.line >= 0 && !target.global) {
+            against = sections[target.section].symbol;
+            addend = value(target);
+        }
+        if (type == R_MIPS_CALL16 && against != s) fail(i, "%call16 of a local symbol");
+
+        uint32_t field = addend;
+        if (type == R_MIPS_GOT16 || type == R_MIPS_HI16) field = (addend + 0x8000) >> 16;
+        else if (type == R_MIPS_GPREL16 && (int32_t)addend > 32767) fail(i, "small data too large for %gp_rel");
+        in.relocations.push_back(Relocation{in.size, against, type});
+
+        if (type == R_MIPS_HI16 || (type == R_MIPS_GOT16 && against != s)) {
+            pending_high.push_back(PendingHigh{current, (unsigned)in.relocations.size() - 1, against});
+        }
+        else if (type == R_MIPS_LO16) {
+            for (size_t p = pending_high.size(); p-- > 0; ) {
+                if (pending_high[p].section != current || pending_high[p].symbol != against) continue;
+                size_t high = pending_high[p].relocation, lo = in.relocations.size() - 1;
+                std::rotate(in.relocations.begin() + high, in.relocations.begin() + high + 1, in.relocations.begin() + lo);
+                pending_high.erase(pending_high.begin() + p);
+                for (PendingHigh &other : pending_high) {
+                    if (other.section == current && other.relocation > high) other.relocation--;
+                }
+                break;
+            }
+        }
+        return field & 0xffff;
+    }
+
+    //! A 16-bit immediate operand: a constant or a %gp_rel, %got, %call16,
+    //! %lo or %hi of a symbol
+    uint32_t immediate(unsigned i, const std::string &operand, bool is_signed)
+    {
+        long n;
+        if (parse_number(operand, n)) {
+            if (is_signed ? n < -32768 || n > 32767 : n < 0 || n > 65535) fail(i, "immediate out of range");
+            return n & 0xffff;
+        }
+        static const std::pair<const char *,uint8_t> operators[] = {
+            {"%gp_rel(", R_MIPS_GPREL16}, {"%got(", R_MIPS_GOT16}, {"%call16(", R_MIPS_CALL16},
+            {"%lo(", R_MIPS_LO16}, {"%hi(", R_MIPS_HI16}
+        };
+        for (const auto &op : operators) {
+            size_t length = strlen(op.first);
+            if (operand.compare(0, length, op.first) != 0 || operand.back() != ')') continue;
+            return relocate(i, op.second, symbol(operand.substr(length, operand.size() - length - 1)));
+        }
+        fail(i, "bad immediate " + operand);
+    }
+
+    //! Word of a PC-relative branch to target, through an island if it is
+    //! out of reach
+    uint32_t displacement(unsigned i, const std::string &label)
+    {
+        unsigned target = target_line(i, label);
+        if (section_of[target] != current) fail(i, "branch to another section");
+        int64_t from = address(i) + 4, to = address(target);
+        if (to - from < -131072 || to - from > 131068) {
+            int k = island_for(address(i));
+            auto found = k < 0 ? islands[0].targets.end() : std::find(islands[k].targets.begin(), islands[k].targets.end(), target);
+            if (k < 0 || found == islands[k].targets.end()) fail(i, "branch out of range");
+            to = island_start(k) + 8 + 16 * (found - islands[k].targets.begin());
+            if (to - from < -131072 || to - from > 131068) fail(i, "branch out of range");
+        }
+        return ((to - from) >> 2) & 0xffff;
+    }
+
+    uint32_t island_start(unsigned k) const
+    { return at[islands[k].line] + islands[k].before; }
+
+    //! The island nearest address, -1 if there are none
+    int island_for(uint32_t address) const
+    {
+        if (islands.empty()) return -1;
+        unsigned low = 0, high = islands.size();
+        while (high - low > 1) {
+            unsigned middle = (low + high) / 2;
+            if (island_start(middle) <= address) low = middle;
+            else high = middle;
+        }
+        if (high < islands.size() && island_start(high) - address < address - island_start(low)) return high;
+        return low;
+    }
+
+    void instruction(unsigned i)
+    {
+        const AsmLine &line = lines[i];
+        if (!noreorder) fail(i, "only .set noreorder code is supported");
+        auto it = encodings().find(line.op);
+        if (it == encodings().end()) fail(i, "unknown instruction");
+        const Encoding &e = it->second;
+        const std::string *args = line.args;
+        long n;
+
+        switch (e.format) {
+        case Format::None:
+            expect(i, 0);
+            emit(i, e.bits);
+            break;
+        case Format::Rd_Rs_Rt:
+            expect(i, 3);
+            if (register_number(args[2]) < 0 && immediate_form(line.op) != nullptr) {
+                const Encoding &form = encodings().at(immediate_form(line.op));
+                uint32_t t = reg(i, args[0]), s = reg(i, args[1]);
+                emit(i, form.bits | s << 21 | t << 16 | immediate(i, args[2], form.is_signed));
+                break;
+            }
+            emit(i, e.bits | reg(i, args[1]) << 21 | reg(i, args[2]) << 16 | reg(i, args[0]) << 11);
+            break;
+        case Format::Rd_Rt_Sa:
+            expect(i, 3);
+            if (!parse_number(args[2], n) || n < 0 || n > 31) fail(i, "bad shift amount");
+            emit(i, e.bits | reg(i, args[1]) << 16 | reg(i, args[0]) << 11 | n << 6);
+            break;
+        case Format::Rt_Rs_Imm: {
+            expect(i, 3);
+            uint32_t t = reg(i, args[0]), s = reg(i, args[1]);
+            emit(i, e.bits | s << 21 | t << 16 | immediate(i, args[2], e.is_signed));
+            break;
+        }
+        case Format::Rt_Imm: {
+            expect(i, 2);
+            uint32_t t = reg(i, args[0]);
+            emit(i, e.bits | t << 16 | immediate(i, args[1], e.is_signed));
+            break;
+        }
+        case Format::Rt_Mem: {
+            expect(i, 2);
+            const std::string &operand = args[1];
+            size_t open = operand.rfind('(');
+            if (open == std::string::npos || operand.back() != ')') fail(i, "bad memory operand");
+            uint32_t t = reg(i, args[0]), base = reg(i, operand.substr(open + 1, operand.size() - open - 2));
+            uint32_t offset = open == 0 ? 0 : immediate(i, operand.substr(0, open), true);
+            emit(i, e.bits | base << 21 | t << 16 | offset);
+            break;
+        }
+        case Format::Rs_Rt:
+            //div $0,s,t is the real instruction written out in full
+            if (line.count == 3 && register_number(args[0]) == 0) args++;
+            else expect(i, 2);
+            emit(i, e.bits | reg(i, args[0]) << 21 | reg(i, args[1]) << 16);
+            break;
+        case Format::Rd:
+            expect(i, 1);
+            emit(i, e.bits | reg(i, args[0]) << 11);
+            break;
+        case Format::Rs:
+            expect(i, 1);
+            if (register_number(args[0]) < 0) fail(i, "only jumps through registers are supported");
+            emit(i, e.bits | reg(i, args[0]) << 21);
+            break;
+        case Format::Jalr:
+            if (line.count == 1) {
+                gprmask |= 1u << 31;
+                emit(i, e.bits | reg(i, args[0]) << 21 | 31 << 11);
+                break;
+            }
+            expect(i, 2);
+            emit(i, e.bits | reg(i, args[1]) << 21 | reg(i, args[0]) << 11);
+            break;
+        case Format::Trap: {
+            if (line.count != 2) expect(i, 3);
+            if (line.count == 3 && (!parse_number(args[2], n) || n < 0 || n > 1023)) fail(i, "bad trap code");
+            uint32_t code = line.count == 3 ? n : 0;
+            emit(i, e.bits | reg(i, args[0]) << 21 | reg(i, args[1]) << 16 | code << 6);
+            break;
+        }
+        case Format::Branch2: {
+            expect(i, 3);
+            uint32_t s = reg(i, args[0]), t = reg(i, args[1]);
+            emit(i, e.bits | s << 21 | t << 16 | displacement(i, args[2]));
+            break;
+        }
+        case Format::Branch1: {
+            expect(i, 2);
+            uint32_t s = reg(i, args[0]);
+            if (e.bits == 0x04110000) gprmask |= 1u << 31;
+            emit(i, e.bits | s << 21 | displacement(i, args[1]));
+            break;
+        }
+        case Format::Branch0:
+            expect(i, 1);
+            if (e.bits == 0x04110000) gprmask |= 1u << 31;
+            emit(i, e.bits | displacement(i, args[0]));
+            break;
+        case Format::Li: {
+            expect(i, 2);
+            uint32_t t = reg(i, args[0]);
+            if (!parse_number(args[1], n) || n < INT32_MIN || n > UINT32_MAX) fail(i, "bad constant");
+            uint32_t bits = n;
+            if (n >= -32768 && n <= 32767) emit(i, 0x24000000 | t << 16 | (bits & 0xffff));     //addiu t,$0,n
+            else if (n >= 0 && n <= 65535) emit(i, 0x34000000 | t << 16 | bits);               //ori t,$0,n
+            else {
+                emit(i, 0x3c000000 | t << 16 | bits >> 16);                                       //lui t,high
+                if ((bits & 0xffff) != 0) emit(i, 0x34000000 | t << 21 | t << 16 | (bits & 0xffff)); //ori t,t,low
+            }
+            break;
+        }
+        case Format::Move:
+            expect(i, 2);
+            emit(i, e.bits | reg(i, args[1]) << 21 | reg(i, args[0]) << 11);
+            break;
+        }
+    }
+
+    bool is_branch(const AsmLine &line) const
+    {
+        if (line.kind != AsmLine::Instruction) return false;
+        auto it = encodings().find(line.op);
+        if (it == encodings().end()) return line.op[0] == 'b' || line.op[0] == 'j';
+        Format f = it->second.format;
+        return f == Format::Branch0 || f == Format::Branch1 || f == Format::Branch2 || f == Format::Rs || f == Format::Jalr;
+    }
+
+    void layout()
+    {
+        at.resize(lines.size());
+        section_of.resize(lines.size());
+        for (unsigned i = 0; i < lines.size(); i++) {
+            const AsmLine &line = lines[i];
+            at[i] = sections[current].size;
+            section_of[i] = current;
+            if (!line.label.empty()) define(i, line.label);
+            switch (line.kind) {
+            case AsmLine::Label:
+                define(i, line.op);
+                break;
+            case AsmLine::Instruction: {
+                long n;
+                unsigned words = line.op == "li" && line.count == 2 && parse_number(line.args[1], n) ? li_words(n) : 1;
+                sections[current].size += 4 * words;
+                if (current == text && line.op[0] == 'b' && is_branch(line)) branches.push_back(i);
+                break;
+            }
+            case AsmLine::Other:
+                directive(i, false);
+                break;
+            case AsmLine::Removed:
+                break;
+            }
+        }
+    }
+
+    //! Give every branch that cannot reach its target a trampoline in the
+    //! nearest island. Islands only grow, so this settles.
+    void relax()
+    {
+        auto reaches = [&](unsigned i) {
+            int64_t distance = (int64_t)address(target_line(i, lines[i].args[lines[i].count - 1])) - (address(i) + 4);
+            return distance >= -131072 && distance <= 131068;
+        };
+        if (std::all_of(branches.begin(), branches.end(), reaches)) return;
+
+        //candidates every island_spacing bytes, where falling into the
+        //island cannot turn its first word into a delay slot
+        bool after_branch = false;
+        uint32_t next = island_spacing / 2;
+        for (unsigned i = 0; i < lines.size(); i++) {
+            if (section_of[i] != text) continue;
+            if (at[i] >= next && !after_branch) {
+                islands.push_back(Island{i, {}});
+                next = at[i] + island_spacing;
+            }
+            if (lines[i].kind == AsmLine::Instruction) after_branch = is_branch(lines[i]);
+            else if (lines[i].kind == AsmLine::Other) after_branch = false;
+        }
+
+        for (bool changed = true; changed; ) {
+            changed = false;
+            for (unsigned k = 1; k < islands.size(); k++) islands[k].before = islands[k - 1].before + islands[k - 1].size();
+            for (unsigned i : branches) {
+                if (reaches(i)) continue;
+                int k = island_for(address(i));
+                unsigned target = target_line(i, lines[i].args[lines[i].count - 1]);
+                std::vector<unsigned> &targets = islands[k].targets;
+                if (std::find(targets.begin(), targets.end(), target) != targets.end()) continue;
+                targets.push_back(target);
+                changed = true;
+            }
+        }
+    }
+
+    void emit_island(const Island &island)
+    {
+        if (island.targets.empty()) return;
+        unsigned i = island.line;
+        emit(i, 0x10000000 | (island.size() / 4 - 1));   //b past the island
+        emit(i, 0);
+        gprmask |= 1u << 1 | 1u << 28;
+        for (unsigned target : island.targets) {
+            unsigned against = sections[text].symbol;
+            uint32_t offset = address(target);
+            Section &s = sections[current];
+            s.relocations.push_back(Relocation{s.size, against, R_MIPS_GOT16});
+            emit(i, 0x8f810000 | ((offset + 0x8000) >> 16 & 0xffff));   //lw $1,%got(target)($28)
+            s.relocations.push_back(Relocation{s.size, against, R_MIPS_LO16});
+            emit(i, 0x24210000 | (offset & 0xffff));                     //addiu $1,$1,%lo(target)
+            emit(i, 0x00200008);                                         //jr $1
+            emit(i, 0);
+        }
+    }
+
+    void encode()
+    {
+        for (Section &s : sections) {
+            if (s.type != SHT_NOBITS) s.bytes.reserve(s.size + (&s == &sections[text] ? island_bytes(lines.size()) : 0));
+            s.size = 0;
+        }
+        current = previous = text;
+        unsigned next_island = 0;
+        for (unsigned i = 0; i < lines.size(); i++) {
+            const AsmLine &line = lines[i];
+            if (next_island < islands.size() && islands[next_island].line == i) emit_island(islands[next_island++]);
+            if (sections[current].size != address(i)) fail(i, "internal error: layout and encoding disagree");
+            if (line.kind == AsmLine::Instruction) instruction(i);
+            else if (line.kind == AsmLine::Other) directive(i, true);
+        }
+    }
+
+    void put16(std::string &out, uint16_t v) const
+    {
+        char bytes[2] = { (char)(little_endian ? v : v >> 8), (char)(little_endian ? v >> 8 : v) };
+        out.append(bytes, 2);
+    }
+
+    void put32(std::string &out, uint32_t v) const
+    { out += word_bytes(v); }
+
+    static uint32_t add_string(std::string &table, const std::string &name)
+    {
+        uint32_t offset = table.size();
+        table += name;
+        table += '\0';
+        return offset;
+    }
+
+public:
+    Assembler(const std::vector<AsmLine> &_lines, bool _little_endian)
+        : lines(_lines),
+        little_endian(_little_endian)
+    {
+        section(".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR);
+    }
+
+    void run()
+    {
+        layout();
+        for (Section &s : sections) {
+            symbols.emplace_back();
+            symbols.back().name = s.name;
+            symbols.back().section = &s - sections.data();
+            symbols.back().type = STT_SECTION;
+            s.symbol = symbols.size() - 1;
+        }
+        relax();
+        encode();
+    }
+
+    void write(std::ostream &dst)
+    {
+        //section headers: null, the sections and their relocations in order
+        //of first use, .reginfo and .MIPS.abiflags, then the symbol table
+        struct Header
+        {
+            uint32_t name, type, flags, offset, size, link, info, align, entsize;
+            const std::string *contents;
+        };
+        std::string names(1, '\0'), strings(1, '\0'), symtab, reginfo, abiflags;
+        std::vector<std::string> rels(sections.size());
+        std::vector<Header> headers(1, Header{0, 0, 0, 0, 0, 0, 0, 0, 0, nullptr});
+        std::vector<unsigned> rel_header(sections.size(), 0);
+        for (Section &s : sections) {
+            s.index = headers.size();
+            headers.push_back(Header{add_string(names, s.name), s.type, s.flags, 0, s.size, 0, 0, s.align, 0, &s.bytes});
+            if (s.relocations.empty()) continue;
+            rel_header[&s - sections.data()] = headers.size();
+            headers.push_back(Header{add_string(names, ".rel" + s.name), SHT_REL, SHF_INFO_LINK, 0, 0, 0, s.index, 4, 8,
+                                     &rels[&s - sections.data()]});
+        }
+
+        put32(reginfo, gprmask);
+        for (int w = 0; w < 5; w++) put32(reginfo, 0);   //coprocessor masks, gp value
+        headers.push_back(Header{add_string(names, ".reginfo"), SHT_MIPS_REGINFO, SHF_ALLOC, 0, 24, 0, 0, 4, 24, &reginfo});
+        put16(abiflags, 0);                              //version
+        abiflags += (char)32;                            //MIPS32
+        abiflags += (char)1;                             //release 1
+        abiflags += (char)1;                             //32-bit GPRs
+        abiflags += (char)1;                             //32-bit FPRs
+        abiflags += (char)0;
+        abiflags += (char)5;                             //fp=xx
+        for (int w = 0; w < 4; w++) put32(abiflags, 0);  //extensions, ASEs, flags
+        headers.push_back(Header{add_string(names, ".MIPS.abiflags"), SHT_MIPS_ABIFLAGS, SHF_ALLOC, 0, 24, 0, 0, 8, 24, &abiflags});
+
+        //symbols: the null one, sections, other locals, then globals; labels
+        //starting with $ stay out, as with the GNU assembler for MIPS
+        auto add_symbol = [&](uint32_t name, uint32_t value, uint32_t size, uint8_t info, uint16_t shndx) {
+            put32(symtab, name);
+            put32(symtab, value);
+            put32(symtab, size);
+            symtab += (char)info;
+            symtab += '\0';
+            put16(symtab, shndx);
+            return symtab.size() / 16 - 1;
+        };
+        add_symbol(0, 0, 0, 0, 0);
+        for (Symbol &s : symbols) {
+            if (s.line < 0 && s.type != STT_SECTION) s.global = true;   //defined elsewhere
+        }
+        for (int global = 0; global < 2; global++) {
+            for (Symbol &s : symbols) {
+                if (s.global != (global == 1)) continue;
+                if (s.type == STT_SECTION) s.index = add_symbol(0, 0, 0, STB_LOCAL << 4 | STT_SECTION, sections[s.section].index);
+                else if (!global && (s.line < 0 || s.name[0] == '$')) continue;
+                else {
+                    uint16_t shndx = s.line < 0 ? 0 : sections[s.section].index;
+                    s.index = add_symbol(add_string(strings, s.name), s.line < 0 ? 0 : value(s), s.size, (global ? STB_GLOBAL : STB_LOCAL) << 4 | s.type, shndx);
+                }
+            }
+            if (global == 0) headers.push_back(Header{0, 0, 0, 0, 0, 0, (uint32_t)(symtab.size() / 16), 4, 16, nullptr});
+        }
+        unsigned symtab_header = headers.size() - 1;
+        headers[symtab_header].name = add_string(names, ".symtab");
+        headers[symtab_header].type = SHT_SYMTAB;
+        headers[symtab_header].size = symtab.size();
+        headers[symtab_header].contents = &symtab;
+        headers[symtab_header].link = headers.size();
+        headers.push_back(Header{add_string(names, ".strtab"), SHT_STRTAB, 0, 0, (uint32_t)strings.size(), 0, 0, 1, 0, &strings});
+        unsigned shstrtab = headers.size();
+        headers.push_back(Header{add_string(names, ".shstrtab"), SHT_STRTAB, 0, 0, 0, 0, 0, 1, 0, &names});
+        headers[shstrtab].size = names.size();
+
+        for (Section &s : sections) {
+            std::string &rel = rels[&s - sections.data()];
+            for (const Relocation &r : s.relocations) {
+                put32(rel, r.offset);
+                put32(rel, symbols[r.symbol].index << 8 | r.type);
+            }
+            if (!s.relocations.empty()) {
+                Header &h = headers[rel_header[&s - sections.data()]];
+                h.size = rel.size();
+                h.link = symtab_header;
+            }
+        }
+
+        std::string out;
+        out.reserve(52 + headers.size() * 40 + sections[text].bytes.size() + symtab.size() + strings.size());
+        out.append(52, '\0');
+        for (Header &h : headers) {
+            if (h.type == 0) continue;
+            out.append((h.align - out.size() % h.align) % h.align, '\0');
+            h.offset = out.size();
+            if (h.type != SHT_NOBITS) out += *h.contents;
+        }
+        out.append((4 - out.size() % 4) % 4, '\0');
+        uint32_t header_table = out.size();
+        for (const Header &h : headers) {
+            for (uint32_t field : { h.name, h.type, h.flags, 0u, h.offset, h.size, h.link, h.info, h.align, h.entsize }) put32(out, field);
+        }
+
+        std::string ident("\x7f" "ELF\x01", 5);
+        ident += (char)(little_endian ? 1 : 2);
+        ident += (char)1;
+        ident.append(9, '\0');
+        std::string header = ident;
+        put16(header, 1);                       //relocatable
+        put16(header, 8);                       //MIPS
+        put32(header, 1);
+        put32(header, 0);                       //entry
+        put32(header, 0);                       //program headers
+        put32(header, header_table);
+        put32(header, EF_MIPS_ARCH_32 | EF_MIPS_ABI_O32 | (any_noreorder ? EF_MIPS_NOREORDER : 0)
+                      | (abicalls ? EF_MIPS_PIC | EF_MIPS_CPIC : 0) | (nan2008 ? EF_MIPS_NAN2008 : 0));
+        put16(header, 52);
+        put16(header, 0);
+        put16(header, 0);
+        put16(header, 40);
+        put16(header, headers.size());
+        put16(header, shstrtab);
+        out.replace(0, 52, header);
+        dst.write(out.data(), out.size());
+    }
+};
+
+
+void write_object(std::ostream &dst, const std::vector<AsmLine> &lines, bool little_endian)
+{
+    Assembler assembler(lines, little_endian);
+    assembler.run();
+    assembler.write(dst);
+}
@@ -1,148 +1,208 @@
-%code requires{
-  #include "ast.hpp"
-  #include <vector>
-  #include <cassert>
-
-  extern const Node *g_root; // A way of getting the AST out
-
-  int yylex(void);
-  void yyerror(const char *);
-}
-
-// Represents the value associated with any kind of
-// AST node.
-%union{
-  const Node *expr;
-  int integer;
-  std::string *string;
-}
-
-
-/////////////////////////////////////////////////
-
-%token MULT DIV PLUS SUB LT EQ
-%token T_IF T_ELSE T_WHILE  T_END T_PRINT T_BEGIN
-%token T_INT T_STRING ASSIGN
-
-%type <expr> FACTOR STATEMENT DECLARATION GLOBAL_DECLARATION_LIST  COMPOUND_STATEMENT SEQ SEQ_PROG
-%type <expr> CONDITIONAL_STATEMENT PARAMETER_LIST PARAMETER EXPR_LIST GLOBAL_DECLARATION GLOBAL_VARIABLE_DECLARATION
-%type <expr> INPUT_PARAMS  GBL_INIT_PARAMS
-%type <expr> ASSIGN_EXPR    EQUALITY_EXPR RELATIONAL_EXPR ADDITIVE_EXPR MULTIPLICATIVE_EXPR DECLARATION_LIST
-%type <integer> T_INT
-
-
-%type <string> T_STRING  T_IF T_ELSE T_WHILE  T_END T_BEGIN T_PRINT
-%type <string> EQ SUB PLUS DIV MULT LT ASSIGN
-
-
-
-%start ROOT
-
-%%
-
-
-ROOT : SEQ_PROG { g_root = $1;}
-
-SEQ_PROG
-        :  GLOBAL_DECLARATION { $$ = new Sequence(nullptr,$1);}
-        | SEQ_PROG GLOBAL_DECLARATION { $$ = new Sequence($1,$2);}
-
-GLOBAL_DECLARATION
-        : GLOBAL_VARIABLE_DECLARATION
-        | PARAMETER_LIST
-
-PARAMETER_LIST
-        :  PARAMETER { $$ = new ParameterList( nullptr,$1);}
-        | PARAMETER_LIST PARAMETER { $$ = new ParameterList($1,$2);}
-
-
-PARAMETER
-        :  T_STRING { $$ = new Parameter( nullptr, *$1);}
-
-COMPOUND_STATEMENT
-        :  SEQ  { $$ = new CompoundStat($1);}
-
-SEQ
-        : SEQ STATEMENT { $$ = new Sequence($1,$2);}
-        | STATEMENT { $$ = new Sequence(nullptr,$1);}
-
-STATEMENT
-        : EXPR_LIST  { $$ = new Stat($1);}
-        | CONDITIONAL_STATEMENT
-        | T_PRINT ASSIGN_EXPR  { $$ = new PrintStat($2);}
-        | DECLARATION
-        | COMPOUND_STATEMENT
-
-
-CONDITIONAL_STATEMENT
-        : T_WHILE  ASSIGN_EXPR T_BEGIN COMPOUND_STATEMENT T_END { $$ = new whileStat( $2, $4 ); }
-        | T_IF  ASSIGN_EXPR T_BEGIN STATEMENT T_END { $$ = new ifStat( $2, new CompoundStat( new Sequence( nullptr, $4 )) ); }
-        | T_IF  ASSIGN_EXPR  T_BEGIN STATEMENT T_ELSE STATEMENT T_END { $$ = new ifElseStat( $2, $4, $6 ); }
-
-
-EXPR_LIST
-        : ASSIGN_EXPR
-        | EXPR_LIST ASSIGN_EXPR { $$ = new ExprList($1,$2);}
-
-ASSIGN_EXPR
-        : EQUALITY_EXPR
-        | DECLARATION
-        | T_STRING ASSIGN EQUALITY_EXPR { $$ = new AssignOp(*$1,nullptr,$3);}
-
-EQUALITY_EXPR
-        : RELATIONAL_EXPR
-        | EQUALITY_EXPR '=' RELATIONAL_EXPR { $$ = new EqualsOp($1, $3); }
-
-RELATIONAL_EXPR
-        : ADDITIVE_EXPR
-        | RELATIONAL_EXPR '<' ADDITIVE_EXPR { $$ = new LessOp($1, $3); }
-
-
-ADDITIVE_EXPR
-        : MULTIPLICATIVE_EXPR
-        | ADDITIVE_EXPR '+' MULTIPLICATIVE_EXPR {$$= new AddOp($1,$3);}
-        | ADDITIVE_EXPR '-' MULTIPLICATIVE_EXPR {$$= new SubOp($1,$3);}
-
-MULTIPLICATIVE_EXPR
-        : FACTOR
-        | MULTIPLICATIVE_EXPR '*' FACTOR { $$ = new MulOp($1, $3); }
-        | MULTIPLICATIVE_EXPR '/' FACTOR { $$ = new DivOp($1, $3); }
-
-FACTOR
-        : T_INT          {$$ = new Number( $1 );}
-        | T_STRING          {$$ = new Variable(*$1);}
-
-
-
-/////////////////////////////////////////////////////////////////////////////////
-
-GLOBAL_VARIABLE_DECLARATION
-        :  GLOBAL_DECLARATION_LIST { $$ = new VariableDecl( nullptr, $1);}
-
-GLOBAL_DECLARATION_LIST
-        : T_STRING  { $$ = new GlobalDeclList(nullptr, *$1 );}
-        | T_STRING  DECLARATION_LIST { $$ = new GlobalDeclList($2, *$1);}
-        | T_STRING ASSIGN T_INT { $$ = new GlobalDeclList2(nullptr, *$1, $3 );}
-        | T_STRING ASSIGN T_INT  DECLARATION_LIST { $$ = new GlobalDeclList2($4, *$1, $3);}
-
-
-DECLARATION
-        :  DECLARATION_LIST    { $$ = new VariableDecl( nullptr, $1 );}
-
-DECLARATION_LIST
-        : T_STRING  { $$ = new DeclList(nullptr, *$1, nullptr);}
-        | T_STRING  DECLARATION_LIST { $$ = new DeclList($2, *$1, nullptr);}
-        | T_STRING ASSIGN EXPR_LIST  { $$ = new DeclList(nullptr, *$1, $3);}
-        | T_STRING ASSIGN EXPR_LIST  DECLARATION_LIST { $$ = new DeclList($4, *$1, $3);}
-
-
-%%
-
-
-const Node *g_root;
-const Node *parseAST()
-{
-  g_root=0;
-  yyparse();
-  return g_root;
-}
+%code requires{
+  #include "ast.hpp"
+  #include "session.hpp"
+  #include <vector>
+  #include <cassert>
+}
+
+%code provides{
+  int yylex(YYSTYPE *lvalp, yyscan_t scanner);
+  void yyerror(yyscan_t scanner, Session &session, const char *message);
+}
+
+%code{
+  // nesting depth is only bounded by the parser stack, which grows on the heap
+  #define YYMAXDEPTH (1 << 24)
+
+  // every node is placed in the session's arena and released in one go
+  // after codegen
+  static NodePtr make_sequence(Session &session, std::vector<NodePtr> *list)
+  {
+    NodePtr *statements = session.arena.allocate_array<NodePtr>(list->size());
+    std::copy(list->begin(), list->end(), statements);
+    NodePtr seq = new (session.arena) Sequence(statements, list->size());
+    session.free_list(list);
+    return seq;
+  }
+}
+
+// Represents the value associated with any kind of
+// AST node.
+%union{
+  const Node *expr;
+  int integer;
+  Symbol symbol;
+  std::vector<NodePtr> *list;
+}
+
+
+/////////////////////////////////////////////////
+
+%token MULT DIV PLUS SUB LT EQ
+%token T_IF T_ELSE T_WHILE  T_END T_PRINT T_BEGIN
+%token T_INT T_STRING ASSIGN
+
+%type <expr> FACTOR STATEMENT COMPOUND_STATEMENT CONDITIONAL_STATEMENT
+%type <expr> ASSIGN_EXPR    EQUALITY_EXPR RELATIONAL_EXPR ADDITIVE_EXPR MULTIPLICATIVE_EXPR
+%type <list> SEQ PROGRAM
+%type <integer> T_INT
+
+
+%type <symbol> T_STRING
+
+// a syntax error leaves half-built lists on the stack; hand them back so a
+// long-running server does not gain one per bad request
+%destructor { session.free_list($$); } <list>
+
+
+%define api.pure full
+%define api.push-pull both
+%param {yyscan_t scanner}
+%parse-param {Session &session}
+
+%start ROOT
+
+%%
+
+
+ROOT : PROGRAM { session.root = new (session.arena) Program(make_sequence(session, $1));}
+
+PROGRAM
+        : PROGRAM STATEMENT { $$ = $1; if (session.sink != nullptr) session.sink->statement($2); else $$->push_back($2);}
+        | %empty { $$ = session.new_list();}
+
+COMPOUND_STATEMENT
+        :  SEQ  { $$ = new (session.arena) CompoundStat(make_sequence(session, $1));}
+
+SEQ
+        : SEQ STATEMENT { $$ = $1; $$->push_back($2);}
+        | %empty { $$ = session.new_list();}
+
+STATEMENT
+        : ASSIGN_EXPR  { $$ = new (session.arena) Stat($1);}
+        | CONDITIONAL_STATEMENT
+        | T_PRINT ASSIGN_EXPR  { $$ = new (session.arena) PrintStat($2);}
+
+
+CONDITIONAL_STATEMENT
+        : T_WHILE  ASSIGN_EXPR T_BEGIN COMPOUND_STATEMENT T_END { $$ = new (session.arena) whileStat( $2, $4 ); }
+        | T_IF  ASSIGN_EXPR T_BEGIN COMPOUND_STATEMENT T_END { $$ = new (session.arena) ifStat( $2, $4 ); }
+        | T_IF  ASSIGN_EXPR  T_BEGIN COMPOUND_STATEMENT T_ELSE COMPOUND_STATEMENT T_END { $$ = new (session.arena) ifElseStat( $2, $4, $6 ); }
+
+
+ASSIGN_EXPR
+        : EQUALITY_EXPR
+        | T_STRING ASSIGN EQUALITY_EXPR { $$ = new (session.arena) AssignOp($1,nullptr,$3);}
+
+EQUALITY_EXPR
+        : RELATIONAL_EXPR
+        | EQUALITY_EXPR EQ RELATIONAL_EXPR { $$ = new (session.arena) EqualsOp($1, $3); }
+
+RELATIONAL_EXPR
+        : ADDITIVE_EXPR
+        | RELATIONAL_EXPR LT ADDITIVE_EXPR { $$ = new (session.arena) LessOp($1, $3); }
+
+
+ADDITIVE_EXPR
+        : MULTIPLICATIVE_EXPR
+        | ADDITIVE_EXPR PLUS MULTIPLICATIVE_EXPR {$$= new (session.arena) AddOp($1,$3);}
+        | ADDITIVE_EXPR SUB MULTIPLICATIVE_EXPR {$$= new (session.arena) SubOp($1,$3);}
+
+MULTIPLICATIVE_EXPR
+        : FACTOR
+        | MULTIPLICATIVE_EXPR MULT FACTOR { $$ = new (session.arena) MulOp($1, $3); }
+        | MULTIPLICATIVE_EXPR DIV FACTOR { $$ = new (session.arena) DivOp($1, $3); }
+
+FACTOR
+        : T_INT          {$$ = new (session.arena) Number( $1 );}
+        | T_STRING          {$$ = new (session.arena) Variable($1);}
+
+
+%%
+
+
+void yyerror(yyscan_t, Session &session, const char *message)
+{
+  session.error = message;
+}
+
+const Node *Session::parse()
+{
+  root = nullptr;
+  if (yyparse(scanner, *this) != 0) throw std::runtime_error(error);
+  return root;
+}
+
+// feeds the push parser one token at a time from next(token, lval), which
+// returns the token kind and 0 at the end of the input
+template<class Next>
+static int push_parse(Session &session, yyscan_t scanner, Next next)
+{
+  // the sink may throw, so the parser state is owned by a unique_ptr
+  std::unique_ptr<yypstate, void (*)(yypstate *)> parser(yypstate_new(), yypstate_delete);
+  int status;
+  do {
+    YYSTYPE lval;
+    int token = next(lval);
+    status = yypush_parse(parser.get(), token, &lval, scanner, session);
+  } while (status == YYPUSH_MORE);
+  return status;
+}
+
+void Session::parse_statements(StatementSink &statements)
+{
+  sink = &statements;
+  int status;
+  try {
+    status = push_parse(*this, scanner, [this](YYSTYPE &lval) { return yylex(&lval, scanner); });
+  } catch (...) {
+    sink = nullptr;
+    throw;
+  }
+  sink = nullptr;
+  if (status != 0) throw std::runtime_error(error);
+}
+
+void Session::tokenize(std::vector<Token> &tokens)
+{
+  YYSTYPE lval;
+  int kind;
+  while ((kind = yylex(&lval, scanner)) != 0) {
+    int value = kind == T_INT ? lval.integer : kind == T_STRING ? (int)lval.symbol : 0;
+    tokens.push_back(Token{kind, value});
+  }
+}
+
+// replays recorded tokens, ending with the 0 the lexer would have returned
+static int push_tokens(Session &session, yyscan_t scanner, const std::vector<Token> &tokens)
+{
+  size_t next = 0;
+  return push_parse(session, scanner, [&](YYSTYPE &lval) {
+    if (next == tokens.size()) return 0;
+    const Token &token = tokens[next++];
+    if (token.kind == T_INT) lval.integer = token.value;
+    else if (token.kind == T_STRING) lval.symbol = token.value;
+    return token.kind;
+  });
+}
+
+const Node *Session::parse(const std::vector<Token> &tokens)
+{
+  root = nullptr;
+  if (push_tokens(*this, scanner, tokens) != 0) throw std::runtime_error(error);
+  return root;
+}
+
+void Session::parse_statements(StatementSink &statements, const std::vector<Token> &tokens)
+{
+  sink = &statements;
+  int status;
+  try {
+    status = push_tokens(*this, scanner, tokens);
+  } catch (...) {
+    sink = nullptr;
+    throw;
+  }
+  sink = nullptr;
+  if (status != 0) throw std::runtime_error(error);
+}
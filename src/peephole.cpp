@@ -0,0 +1,621 @@
+#include "peephole.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+
+
+std::vector<AsmLine> decode_assembly(std::string_view text)
+{
+    std::vector<AsmLine> lines;
+    lines.reserve(std::count(text.begin(), text.end(), '\n') + 1);
+    for (size_t start = 0; start < text.size(); ) {
+        size_t end = text.find('\n', start);
+        if (end == std::string::npos) end = text.size();
+        std::string line(text.substr(start, end - start));
+        start = end + 1;
+
+        //"1:\tjalr\t$25" is an instruction with a label in front, as is
+        //"$DS0:\tli\t$s0,67" once the delay slots are filled
+        size_t tab = line.find('\t');
+        std::string label;
+        if (tab != std::string::npos && tab > 1 && line[tab - 1] == ':' && line[0] != ' ' && line.find_first_of(" \"") > tab) {
+            label = line.substr(0, tab - 1);
+            line.erase(0, tab);
+            tab = 0;
+        }
+        if (tab != 0 || line.size() < 2 || line[1] == '.') {
+            if (label.empty() && !line.empty() && line.back() == ':' && line.find_first_of("\t ") == std::string::npos) {
+                lines.emplace_back(AsmLine::Label, line.substr(0, line.size() - 1));
+            }
+            else lines.emplace_back(AsmLine::Other, label.empty() ? line : label + ":" + line);
+            continue;
+        }
+
+        size_t operands = line.find('\t', 1);
+        AsmLine insn(AsmLine::Instruction, line.substr(1, operands == std::string::npos ? std::string::npos : operands - 1));
+        insn.label = label;
+        for (size_t from = operands; from != std::string::npos && insn.count < 3; ) {
+            size_t comma = line.find(',', from + 1);
+            insn.args[insn.count++] = line.substr(from + 1, comma == std::string::npos ? std::string::npos : comma - from - 1);
+            from = comma;
+            if (from != std::string::npos && insn.count == 3) insn.kind = AsmLine::Other; //not ours, keep it whole
+        }
+        if (insn.kind == AsmLine::Other) insn = AsmLine(AsmLine::Other, label.empty() ? line : label + ":" + line);
+        lines.push_back(std::move(insn));
+    }
+    return lines;
+}
+
+void encode_assembly(std::ostream &dst, const std::vector<AsmLine> &lines)
+{
+    for (const AsmLine &line : lines) {
+        switch (line.kind) {
+        case AsmLine::Instruction:
+            if (!line.label.empty()) dst<<line.label<<":";
+            dst<<"\t"<<line.op;
+            for (unsigned i = 0; i < line.count; i++) dst<<(i == 0 ? "\t" : ",")<<line.args[i];
+            dst<<"\n";
+            break;
+        case AsmLine::Label:
+            dst<<line.op<<":\n";
+            break;
+        case AsmLine::Other:
+            dst<<line.op<<"\n";
+            break;
+        case AsmLine::Removed:
+            break;
+        }
+    }
+}
+
+
+int register_number(const std::string &name)
+{
+    static const char *const names[32] = {
+        "zero", "at", "v0", "v1", "a0", "a1", "a2", "a3",
+        "t0", "t1", "t2", "t3", "t4", "t5", "t6", "t7",
+        "s0", "s1", "s2", "s3", "s4", "s5", "s6", "s7",
+        "t8", "t9", "k0", "k1", "gp", "sp", "fp", "ra"
+    };
+    if (name.size() < 2 || name[0] != '$') return -1;
+    if (isdigit((unsigned char)name[1])) return atoi(name.c_str() + 1);
+    for (int r = 0; r < 32; r++) {
+        if (strcmp(name.c_str() + 1, names[r]) == 0) return r;
+    }
+    return -1;
+}
+
+//! Base register of a memory operand such as 8($fp) or %got($LC0)($28)
+static int base_register(const std::string &operand)
+{
+    size_t open = operand.rfind('(');
+    if (open == std::string::npos || operand.back() != ')') return -1;
+    return register_number(operand.substr(open + 1, operand.size() - open - 2));
+}
+
+//! Offset of a plain N($fp) or N($sp) operand, N >= 0; $fp is a copy of $sp
+static bool frame_offset(const std::string &operand, long &offset)
+{
+    int base = base_register(operand);
+    if (base != 29 && base != 30) return false;
+    const char *text = operand.c_str();
+    char *end;
+    offset = strtol(text, &end, 10);
+    return *end == '(' && offset >= 0;
+}
+
+static bool is_branch(const AsmLine &line)
+{ return line.kind == AsmLine::Instruction && (line.op[0] == 'b' || line.op[0] == 'j'); }
+
+static bool is(const AsmLine &line, const char *op)
+{ return line.kind == AsmLine::Instruction && line.op == op; }
+
+//! Register the instruction writes, -1 if none
+static int written(const AsmLine &line)
+{
+    static const char *const no_result[] = { "sw", "sh", "sb", "teq", "div", "divu", "mult", "multu", "mthi", "mtlo", "nop" };
+    if (line.kind != AsmLine::Instruction || line.count == 0) return -1;
+    if (is_branch(line)) return line.op == "jal" || line.op == "jalr" || line.op == "bal" ? 31 : -1;
+    for (const char *op : no_result) {
+        if (line.op == op) return -1;
+    }
+    return register_number(line.args[0]);
+}
+
+static bool reads(const AsmLine &line, int r)
+{
+    for (unsigned i = written(line) >= 0 ? 1 : 0; i < line.count; i++) {
+        if (register_number(line.args[i]) == r || base_register(line.args[i]) == r) return true;
+    }
+    return false;
+}
+
+//! What an instruction touches, for telling whether two can trade places.
+//! Registers are bits of the masks; $0 never changes, so bit 0 stands for
+//! HI and LO instead.
+struct Effects
+{
+    uint32_t reads = 0, writes = 0;
+    bool load = false, store = false;
+
+    void add(const Effects &other)
+    {
+        reads |= other.reads;
+        writes |= other.writes;
+        load |= other.load;
+        store |= other.store;
+    }
+
+    bool independent(const Effects &other) const
+    {
+        return (writes & (other.reads | other.writes)) == 0 && (reads & other.writes) == 0
+            && !(store && (other.load || other.store)) && !(load && other.store);
+    }
+};
+
+static Effects effects(const AsmLine &line)
+{
+    Effects e;
+    int w = written(line);
+    if (w > 0) e.writes = 1u << w;
+    for (unsigned i = w >= 0 && !is_branch(line) ? 1 : 0; i < line.count; i++) {
+        int r = register_number(line.args[i]);
+        if (r < 0) r = base_register(line.args[i]);
+        if (r > 0) e.reads |= 1u << r;
+    }
+    const std::string &op = line.op;
+    e.store = op == "sw" || op == "sh" || op == "sb";
+    //nothing stores to the GOT
+    e.load = (op == "lw" || op == "lh" || op == "lhu" || op == "lb" || op == "lbu")
+        && line.args[1].compare(0, 5, "%got(") != 0 && line.args[1].compare(0, 8, "%call16(") != 0;
+    if (op == "mult" || op == "multu" || op == "div" || op == "divu" || op == "mul") e.writes |= 1;
+    else if (op == "mfhi" || op == "mflo") e.reads |= 1;
+    else if (op == "la") e.reads |= 1u << 28;
+    else if (op == "syscall") {
+        //takes $2 and $4-$7, and may change $2, $3, $7, the temporaries,
+        //HI and LO
+        e.reads = 0xf4;
+        e.writes = 0x0300ff8f;
+        e.load = e.store = true;
+    }
+    return e;
+}
+
+//! A single machine instruction that can be moved around: la and a li
+//! too wide for one instruction are assembler macros, which must not end
+//! up half in a delay slot, and teq stays where it traps
+static bool movable(const AsmLine &line)
+{
+    if (line.kind != AsmLine::Instruction || !line.label.empty() || line.count == 0 || is_branch(line)) return false;
+    if (line.op == "la" || line.op == "teq") return false;
+    if (line.op == "li") {
+        long value = strtol(line.args[1].c_str(), nullptr, 0);
+        return value >= -32768 && value <= 65535;
+    }
+    return true;
+}
+
+static bool is_reloc(const AsmLine &line)
+{ return line.kind == AsmLine::Other && line.op.compare(0, 7, "\t.reloc") == 0; }
+
+
+//! Walking the lines of a function, over the ones already removed
+class AsmPass
+{
+protected:
+    std::vector<AsmLine> &lines;
+
+    AsmPass(std::vector<AsmLine> &_lines)
+        : lines(_lines)
+    {}
+
+    size_t previous(size_t i) const
+    {
+        while (i-- > 0) {
+            if (lines[i].kind != AsmLine::Removed) return i;
+        }
+        return SIZE_MAX;
+    }
+
+    size_t next(size_t i) const
+    {
+        while (++i < lines.size()) {
+            if (lines[i].kind != AsmLine::Removed) return i;
+        }
+        return SIZE_MAX;
+    }
+
+    //the instruction after a branch runs whether or not it is taken, even
+    //with a label in between; removing it would pull the next one in
+    bool in_delay_slot(size_t i) const
+    {
+        for (size_t p = previous(i); p != SIZE_MAX; p = previous(p)) {
+            if (lines[p].kind == AsmLine::Label) continue;
+            return is_branch(lines[p]);
+        }
+        return false;
+    }
+};
+
+
+//! Matches the rules of the table at each instruction in turn, stepping
+//! back after a hit so rewrites that enable each other all happen in one
+//! pass. Lines are only ever marked removed, so indexes stay put.
+class Peephole : AsmPass
+{
+private:
+    std::vector<unsigned> frame_loads; //by offset
+    std::map<std::string,size_t> labels;
+
+    struct Rule
+    {
+        const char *name;
+        bool (Peephole::*apply)(size_t i);
+    };
+    static const Rule rules[];
+
+    bool remove(size_t i)
+    {
+        if (in_delay_slot(i)) return false;
+        lines[i].kind = AsmLine::Removed;
+        return true;
+    }
+
+    //sw r,N(b) then lw r',N(b): r' gets r without going through memory,
+    //unless the store is in a delay slot and a call or jump comes between
+    bool forward_store(size_t i)
+    {
+        AsmLine &load = lines[i];
+        size_t p = previous(i);
+        if (!is(load, "lw") || p == SIZE_MAX || !is(lines[p], "sw") || lines[p].args[1] != load.args[1]) return false;
+        if (in_delay_slot(p)) return false;
+        if (register_number(lines[p].args[0]) == register_number(load.args[0])) {
+            if (!remove(i)) return false;
+        } else {
+            load.op = "move";
+            load.args[1] = lines[p].args[0];
+        }
+        long offset;
+        if (frame_offset(lines[p].args[1], offset)) frame_loads[offset]--;
+        return true;
+    }
+
+    //the frame slot at offset is stored to again before it can be loaded,
+    //on every path on from line n. Calls leave the frame alone and
+    //returning drops it; anything else unusual gives up.
+    bool overwritten_from(size_t n, long offset, unsigned &budget) const
+    {
+        for (; n != SIZE_MAX; n = next(n)) {
+            const AsmLine &line = lines[n];
+            if (line.kind == AsmLine::Label || is_reloc(line)) continue;
+            if (line.kind != AsmLine::Instruction || budget-- == 0) return false;
+            if (!is_branch(line)) {
+                int overwritten = slot_access(line, offset);
+                if (overwritten >= 0) return overwritten;
+                continue;
+            }
+
+            //the delay slot runs first, and on return only matters if it
+            //loads the slot
+            size_t slot = next(n);
+            if (slot == SIZE_MAX || lines[slot].kind != AsmLine::Instruction) return false;
+            int overwritten = slot_access(lines[slot], offset);
+            if (is(line, "j") && line.args[0] == "$31") return overwritten != 0 || !effects(lines[slot]).load;
+            if (overwritten >= 0) return overwritten;
+            if (written(line) == 31) {
+                n = slot;
+                continue;
+            }
+            auto target = labels.find(line.args[line.count - 1]);
+            if (line.op[0] != 'b' || target == labels.end()) return false;
+            bool always = is(line, "b") || (is(line, "beq") && line.args[0] == "$0" && line.args[1] == "$0");
+            if (!always && !overwritten_from(next(slot), offset, budget)) return false;
+            return overwritten_from(target->second, offset, budget);
+        }
+        return false;
+    }
+
+    //1 if line stores to the frame slot at offset, 0 if it may load it or
+    //moves $fp, -1 if it does neither. $sp only moves on the way in and
+    //out of the function.
+    static int slot_access(const AsmLine &line, long offset)
+    {
+        //la, li and lui have no base register; %gp_rel, %got and %lo
+        //operands are globals
+        long at;
+        int base = line.count == 2 ? base_register(line.args[1]) : -1;
+        if (line.op[0] == 'l' && base >= 0) return base == 28 || line.args[1][0] == '%' || (frame_offset(line.args[1], at) && at != offset) ? -1 : 0;
+        if (is(line, "sw") && base == 30 && frame_offset(line.args[1], at) && at == offset) return 1;
+        return written(line) == 30 ? 0 : -1;
+    }
+
+    //stores to frame slots nothing ever loads, or that are stored to again
+    //before anything can load them
+    bool remove_dead_store(size_t i)
+    {
+        long offset;
+        if (!is(lines[i], "sw") || base_register(lines[i].args[1]) != 30 || !frame_offset(lines[i].args[1], offset)) return false;
+        unsigned budget = 32;
+        bool dead = (size_t)offset >= frame_loads.size() || frame_loads[offset] == 0 || overwritten_from(next(i), offset, budget);
+        return dead && remove(i);
+    }
+
+    //la r,x again with r unchanged since the last one in straight-line code
+    bool remove_repeated_address(size_t i)
+    {
+        const AsmLine &la = lines[i];
+        if (!is(la, "la")) return false;
+        int r = register_number(la.args[0]);
+        size_t p = i;
+        for (unsigned window = 0; window < 16; window++) {
+            p = previous(p);
+            if (p == SIZE_MAX || lines[p].kind != AsmLine::Instruction || is_branch(lines[p])) return false;
+            if (written(lines[p]) == r) return is(lines[p], "la") && lines[p].args[1] == la.args[1] && remove(i);
+        }
+        return false;
+    }
+
+    //a move to itself, or to a register the next instruction overwrites
+    //without reading
+    bool remove_dead_move(size_t i)
+    {
+        const AsmLine &move = lines[i];
+        if (!is(move, "move")) return false;
+        int r = register_number(move.args[0]);
+        if (r == 0 || r == register_number(move.args[1])) return remove(i);
+        size_t n = next(i);
+        if (n == SIZE_MAX || lines[n].kind != AsmLine::Instruction || is_branch(lines[n])) return false;
+        return written(lines[n]) == r && !reads(lines[n], r) && remove(i);
+    }
+
+    //slt and friends already give 0 or 1, which any mask keeping bit 0
+    //leaves alone
+    bool remove_set_mask(size_t i)
+    {
+        const AsmLine &andi = lines[i];
+        if (!is(andi, "andi") || register_number(andi.args[0]) != register_number(andi.args[1])) return false;
+        if ((strtol(andi.args[2].c_str(), nullptr, 0) & 1) == 0) return false;
+        size_t p = previous(i);
+        if (p == SIZE_MAX || written(lines[p]) != register_number(andi.args[0]) || in_delay_slot(p)) return false;
+        const std::string &op = lines[p].op;
+        return (op == "slt" || op == "sltu" || op == "slti" || op == "sltiu") && remove(i);
+    }
+
+    //MIPS32 interlocks loads, so only delay slots need a nop
+    bool remove_hazard_nop(size_t i)
+    { return is(lines[i], "nop") && remove(i); }
+
+    //b to the label right after its delay slot
+    bool remove_branch_to_next(size_t i)
+    {
+        const AsmLine &branch = lines[i];
+        if (!is(branch, "b") || in_delay_slot(i)) return false;
+        size_t slot = next(i);
+        if (slot == SIZE_MAX || !is(lines[slot], "nop")) return false;
+        for (size_t n = next(slot); n != SIZE_MAX && lines[n].kind == AsmLine::Label; n = next(n)) {
+            if (lines[n].op == branch.args[0]) {
+                lines[i].kind = lines[slot].kind = AsmLine::Removed;
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    Peephole(std::vector<AsmLine> &_lines)
+        : AsmPass(_lines)
+    {}
+
+    void run(PeepholeReport *report);
+};
+
+//tried in this order at each instruction
+const Peephole::Rule Peephole::rules[] = {
+    {"store-load", &Peephole::forward_store},
+    {"dead-store", &Peephole::remove_dead_store},
+    {"repeated-la", &Peephole::remove_repeated_address},
+    {"dead-move", &Peephole::remove_dead_move},
+    {"set-mask", &Peephole::remove_set_mask},
+    {"hazard-nop", &Peephole::remove_hazard_nop},
+    {"branch-next", &Peephole::remove_branch_to_next},
+};
+
+void Peephole::run(PeepholeReport *report)
+{
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (lines[i].kind == AsmLine::Label) labels[lines[i].op] = i;
+    }
+    for (const AsmLine &line : lines) {
+        long offset;
+        if (!is(line, "lw") || !frame_offset(line.args[1], offset)) continue;
+        if ((size_t)offset >= frame_loads.size()) frame_loads.resize(offset + 1, 0);
+        frame_loads[offset]++;
+    }
+
+    const size_t count = sizeof rules / sizeof rules[0];
+    std::vector<size_t> hits(count, 0);
+    for (size_t i = 0; i < lines.size(); ) {
+        bool hit = false;
+        if (lines[i].kind == AsmLine::Instruction) {
+            for (size_t r = 0; r < count && !hit; r++) {
+                if ((this->*rules[r].apply)(i)) {
+                    hits[r]++;
+                    hit = true;
+                }
+            }
+        }
+        if (!hit) {
+            i++;
+            continue;
+        }
+        for (unsigned back = 0; back < 3; back++) {
+            size_t p = previous(i);
+            if (p == SIZE_MAX) break;
+            i = p;
+        }
+    }
+
+    if (report != nullptr) {
+        for (size_t r = 0; r < count; r++) report->hits.emplace_back(rules[r].name, hits[r]);
+    }
+}
+
+
+//! Puts work into the nop after each branch: first an instruction from in
+//! front of the branch that nothing after it depends on, otherwise a copy
+//! of the one the branch goes to, with the branch retargeted past it.
+//! Then loads whose result is read straight away are moved up past an
+//! instruction they do not depend on, so the pipeline does not stall.
+class Scheduler : AsmPass
+{
+private:
+    std::map<std::string,size_t> labels;
+    unsigned fresh = 0;
+
+    size_t before = 0, target = 0, empty = 0, load_use = 0;
+
+    bool fill_from_before(size_t branch, size_t slot)
+    {
+        Effects crossed = effects(lines[branch]);
+        size_t p = previous(branch);
+        for (unsigned window = 0; p != SIZE_MAX && window < 16; p = previous(p), window++) {
+            const AsmLine &line = lines[p];
+            if (is_reloc(line)) continue;
+            if (line.kind != AsmLine::Instruction || is_branch(line) || in_delay_slot(p)) return false;
+            Effects e = effects(line);
+            if (movable(line) && e.independent(crossed)) {
+                lines[slot] = line;
+                lines[p].kind = AsmLine::Removed;
+                return true;
+            }
+            crossed.add(e);
+        }
+        return false;
+    }
+
+    //r is written before it is read going on from i, so what i leaves in
+    //it is never seen
+    bool overwritten_after(size_t i, int r) const
+    {
+        if (r <= 0 || r >= 28) return false;
+        size_t n = next(i);
+        for (unsigned window = 0; n != SIZE_MAX && window < 32; n = next(n), window++) {
+            const AsmLine &line = lines[n];
+            if (line.kind == AsmLine::Label || is_reloc(line)) continue;
+            //the caller keeps nothing in temporaries across the call
+            if (is(line, "j") && line.args[0] == "$31") {
+                size_t slot = next(n);
+                if (slot != SIZE_MAX && (effects(lines[slot]).reads & (1u << r))) return false;
+                return r == 1 || (r >= 4 && r <= 15) || r == 24 || r == 25;
+            }
+            if (line.kind != AsmLine::Instruction || is_branch(line)) return false;
+            Effects e = effects(line);
+            if (e.reads & (1u << r)) return false;
+            if (e.writes & (1u << r)) return true;
+        }
+        return false;
+    }
+
+    //the slot of a conditional branch also runs when it is not taken, so
+    //what comes from the target must not store, trap or be read there
+    bool harmless(const AsmLine &line, size_t slot) const
+    {
+        Effects e = effects(line);
+        if (e.store || (e.writes & 1) || line.op == "add" || line.op == "addi" || line.op == "sub") return false;
+        if (line.op[0] == 'l' && line.op != "li" && line.op != "lui" && base_register(line.args[1]) < 28) return false;
+        return overwritten_after(slot, written(line));
+    }
+
+    bool fill_from_target(size_t branch, size_t slot)
+    {
+        AsmLine &jump = lines[branch];
+        if (jump.op[0] != 'b' || written(jump) == 31) return false;
+        auto found = labels.find(jump.args[jump.count - 1]);
+        if (found == labels.end()) return false;
+
+        //labels and directives in front of the target take no space
+        size_t t = found->second;
+        while (t != SIZE_MAX && (lines[t].kind == AsmLine::Label || (lines[t].kind == AsmLine::Other
+            && (lines[t].op.compare(0, 7, "\t.frame") == 0 || lines[t].op.compare(0, 6, "\t.mask") == 0 || lines[t].op.compare(0, 7, "\t.fmask") == 0)))) t = next(t);
+        if (t == SIZE_MAX || !movable(lines[t]) || (jump.op != "b" && !harmless(lines[t], slot))) return false;
+
+        size_t resume = next(t);
+        std::string name;
+        if (resume != SIZE_MAX && lines[resume].kind == AsmLine::Label) name = lines[resume].op;
+        else if (resume != SIZE_MAX && lines[resume].kind == AsmLine::Instruction && lines[resume].label.empty()) {
+            name = "$DS" + std::to_string(fresh++);
+            lines[resume].label = name;
+            labels[name] = resume;
+        }
+        else return false;
+        lines[slot] = lines[t];
+        jump.args[jump.count - 1] = name;
+        return true;
+    }
+
+    //lw r then an instruction reading r: swap the load with the
+    //instruction in front of it when they are independent
+    bool separate_load(size_t i)
+    {
+        const AsmLine &load = lines[i];
+        if (!is(load, "lw") || !load.label.empty() || in_delay_slot(i)) return false;
+        int r = written(load);
+        size_t n = next(i), p = previous(i);
+        if (n == SIZE_MAX || lines[n].kind != AsmLine::Instruction || !(effects(lines[n]).reads & (1u << r))) return false;
+        if (p == SIZE_MAX || !movable(lines[p]) || in_delay_slot(p) || is(lines[p], "lw")) return false;
+        if (!effects(lines[p]).independent(effects(load))) return false;
+        std::swap(lines[p], lines[i]);
+        return true;
+    }
+
+public:
+    Scheduler(std::vector<AsmLine> &_lines)
+        : AsmPass(_lines)
+    {}
+
+    void run(PeepholeReport *report)
+    {
+        for (size_t i = 0; i < lines.size(); i++) {
+            if (lines[i].kind == AsmLine::Label) labels[lines[i].op] = i;
+        }
+
+        //the second sweep copies targets, which must not be moved after
+        std::vector<size_t> open;
+        for (size_t i = 0; i < lines.size(); i++) {
+            if (!is_branch(lines[i])) continue;
+            size_t slot = next(i);
+            if (slot == SIZE_MAX || !is(lines[slot], "nop")) continue;
+            if (fill_from_before(i, slot)) before++;
+            else open.push_back(i);
+        }
+        for (size_t i : open) {
+            if (fill_from_target(i, next(i))) target++;
+            else empty++;
+        }
+
+        for (size_t i = 0; i < lines.size(); i++) {
+            if (lines[i].kind == AsmLine::Instruction && separate_load(i)) load_use++;
+        }
+
+        if (report != nullptr) {
+            report->hits.emplace_back("slot-before", before);
+            report->hits.emplace_back("slot-target", target);
+            report->hits.emplace_back("slot-empty", empty);
+            report->hits.emplace_back("load-use", load_use);
+        }
+    }
+};
+
+
+void run_peephole(std::vector<AsmLine> &lines, PeepholeReport *report)
+{
+    Peephole(lines).run(report);
+}
+
+void fill_delay_slots(std::vector<AsmLine> &lines, PeepholeReport *report)
+{
+    Scheduler(lines).run(report);
+}
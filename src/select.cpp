@@ -0,0 +1,456 @@
+#include "ir.hpp"
+#include "ast/runtime.hpp"
+
+#include <string>
+#include <utility>
+
+
+static const char *const register_names[32] = {
+    "$0", "$1", "$2", "$3", "$4", "$5", "$6", "$7",
+    "$t0", "$t1", "$t2", "$t3", "$t4", "$t5", "$t6", "$t7",
+    "$s0", "$s1", "$s2", "$s3", "$s4", "$s5", "$s6", "$s7",
+    "$t8", "$t9", "$26", "$27", "$28", "$sp", "$fp", "$31"
+};
+
+//values live across a print must survive printf, so only they take $s
+//registers; $t8/$t9 are scratch for constants and spilled values
+static const unsigned temporary_registers = 0x0000ff00; //$t0-$t7
+static const unsigned saved_registers = 0x00ff0000;     //$s0-$s7
+static const int scratch_a = 24, scratch_b = 25;
+
+static bool fits_immediate(int64_t value)
+{ return value >= -32768 && value <= 32767; }
+
+static bool power_of_two(uint32_t value)
+{ return value != 0 && (value & (value - 1)) == 0; }
+
+//! Multiplier and shift for dividing by d, |d| >= 2 and not a power of two,
+//! with the high word of a multiply (Hacker's Delight, 10-1)
+struct Magic
+{
+    int32_t multiplier;
+    int shift;
+};
+
+static Magic signed_magic(int32_t d)
+{
+    const uint32_t two31 = 0x80000000u;
+    uint32_t ad = d < 0 ? -(uint32_t)d : d;
+    uint32_t t = two31 + ((uint32_t)d >> 31);
+    uint32_t anc = t - 1 - t % ad; //largest n with n % ad == ad - 1
+    int p = 31;
+    uint32_t q1 = two31 / anc, r1 = two31 - q1 * anc;
+    uint32_t q2 = two31 / ad, r2 = two31 - q2 * ad;
+    uint32_t delta;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    uint32_t m = q2 + 1;
+    return Magic{(int32_t)(d < 0 ? -m : m), p - 32};
+}
+
+
+//! Allocates every value to a register or a stack slot, then walks the
+//! blocks in layout order emitting MIPS for each instruction.
+class Selection
+{
+private:
+    std::ostream &dst;
+    const IrProgram &ir;
+    bool printf_calls;
+    std::vector<int> reg;  //by value index, -1 when spilled or unused
+    std::vector<int> slot; //frame offset of spilled values
+    unsigned used_saved = 0;
+    unsigned slots = 0;
+    BlockLayout layout;
+
+    //spill slots are numbered from 0; they sit above the outgoing
+    //argument area and $gp
+    void allocate(const Liveness &live)
+    {
+        Allocation allocation = allocate_registers(ir, live, temporary_registers, saved_registers);
+        reg = std::move(allocation.reg);
+        slot = std::move(allocation.slot);
+        for (int &offset : slot) {
+            if (offset >= 0) offset = 24 + 4 * offset;
+        }
+        slots = allocation.slots;
+        used_saved = allocation.used_saved;
+    }
+
+    //! op r,offset($fp), adding offsets too wide for the instruction to
+    //! $fp in $3 first
+    void frame_access(const char *op, const char *r, int offset)
+    {
+        if (fits_immediate(offset)) {
+            dst<<"\t"<<op<<"\t"<<r<<","<<offset<<"($fp)\n";
+            return;
+        }
+        int high = (offset + 0x8000) >> 16;
+        dst<<"\tlui\t$3,"<<high<<"\n\taddu\t$3,$3,$fp\n";
+        dst<<"\t"<<op<<"\t"<<r<<","<<offset - high * 65536<<"($3)\n";
+    }
+
+    //! Register holding o, first loading it into scratch if it is a
+    //! constant or spilled
+    const char *use(Operand o, int scratch)
+    {
+        if (o.kind == OperandKind::Imm) {
+            if (o.value == 0) return register_names[0];
+            dst<<"\tli\t"<<register_names[scratch]<<","<<o.value<<"\n";
+            return register_names[scratch];
+        }
+        unsigned v = ir.value_index(o);
+        if (reg[v] >= 0) return register_names[reg[v]];
+        frame_access("lw", register_names[scratch], slot[v]);
+        return register_names[scratch];
+    }
+
+    //! Register to compute o into; store() puts it in its slot if spilled
+    const char *target(Operand o) const
+    {
+        int r = reg[ir.value_index(o)];
+        return register_names[r >= 0 ? r : scratch_a];
+    }
+
+    void store(Operand o)
+    {
+        unsigned v = ir.value_index(o);
+        if (reg[v] < 0) frame_access("sw", register_names[scratch_a], slot[v]);
+    }
+
+    void select_copy(const Instruction &insn)
+    {
+        Operand to = insn.dst(), from = insn.a();
+        unsigned v = ir.value_index(to);
+        if (reg[v] < 0) {
+            const char *r = use(from, scratch_a);
+            frame_access("sw", r, slot[v]);
+            return;
+        }
+        const char *d = register_names[reg[v]];
+        if (from.kind == OperandKind::Imm) dst<<"\tli\t"<<d<<","<<from.value<<"\n";
+        else if (reg[ir.value_index(from)] >= 0) {
+            if (reg[ir.value_index(from)] != reg[v]) dst<<"\tmove\t"<<d<<","<<register_names[reg[ir.value_index(from)]]<<"\n";
+        }
+        else frame_access("lw", d, slot[ir.value_index(from)]);
+    }
+
+    //! Whether multiplying by k takes no more than a negation or two
+    //! shifts and an add or subtract, each a single cycle where mul is not
+    static bool shifts_and_adds(uint32_t k)
+    {
+        uint32_t low = k & -k;
+        return power_of_two(k) || power_of_two(-k) || power_of_two(k - low) || power_of_two(k + low);
+    }
+
+    //$t9 holds the larger shift; ra is read before d is written
+    void select_multiply(const char *d, const char *ra, uint32_t k)
+    {
+        const char *t = register_names[scratch_b];
+        uint32_t low = k & -k;
+        int n = __builtin_ctz(k);
+        if (power_of_two(k)) dst<<"\tsll\t"<<d<<","<<ra<<","<<n<<"\n";
+        else if (power_of_two(-k)) {
+            dst<<"\tsll\t"<<d<<","<<ra<<","<<__builtin_ctz(-k)<<"\n";
+            dst<<"\tsubu\t"<<d<<",$0,"<<d<<"\n";
+        }
+        else {
+            //k is 2^m + 2^n or 2^m - 2^n
+            bool add = power_of_two(k - low);
+            int m = __builtin_ctz(add ? k - low : k + low);
+            const char *op = add ? "addu" : "subu";
+            dst<<"\tsll\t"<<t<<","<<ra<<","<<m<<"\n";
+            if (n == 0) dst<<"\t"<<op<<"\t"<<d<<","<<t<<","<<ra<<"\n";
+            else {
+                dst<<"\tsll\t"<<d<<","<<ra<<","<<n<<"\n";
+                dst<<"\t"<<op<<"\t"<<d<<","<<t<<","<<d<<"\n";
+            }
+        }
+    }
+
+    //! Division by a non-zero constant, rounding towards zero like div and
+    //! with no trap to check for
+    void select_divide(const char *d, const char *ra, int32_t k)
+    {
+        const char *t = register_names[scratch_b];
+        uint32_t magnitude = k < 0 ? -(uint32_t)k : k;
+        if (magnitude == 1) {
+            if (k < 0) dst<<"\tsubu\t"<<d<<",$0,"<<ra<<"\n";
+            else if (d != ra) dst<<"\tmove\t"<<d<<","<<ra<<"\n";
+            return;
+        }
+        if (power_of_two(magnitude)) {
+            //a negative dividend is biased by 2^n - 1 so the shift rounds up
+            int n = __builtin_ctz(magnitude);
+            if (n == 1) dst<<"\tsrl\t"<<t<<","<<ra<<",31\n";
+            else {
+                dst<<"\tsra\t"<<t<<","<<ra<<",31\n";
+                dst<<"\tsrl\t"<<t<<","<<t<<","<<32 - n<<"\n";
+            }
+            dst<<"\taddu\t"<<t<<","<<ra<<","<<t<<"\n";
+            dst<<"\tsra\t"<<d<<","<<t<<","<<n<<"\n";
+            if (k < 0) dst<<"\tsubu\t"<<d<<",$0,"<<d<<"\n";
+            return;
+        }
+        //the high word of the product, adding one when it is negative
+        Magic magic = signed_magic(k);
+        dst<<"\tli\t"<<t<<","<<magic.multiplier<<"\n";
+        dst<<"\tmult\t"<<ra<<","<<t<<"\n";
+        dst<<"\tmfhi\t"<<t<<"\n";
+        if (k > 0 && magic.multiplier < 0) dst<<"\taddu\t"<<t<<","<<t<<","<<ra<<"\n";
+        if (k < 0 && magic.multiplier > 0) dst<<"\tsubu\t"<<t<<","<<t<<","<<ra<<"\n";
+        if (magic.shift > 0) dst<<"\tsra\t"<<t<<","<<t<<","<<magic.shift<<"\n";
+        dst<<"\tsrl\t"<<d<<","<<t<<",31\n";
+        dst<<"\taddu\t"<<d<<","<<d<<","<<t<<"\n";
+    }
+
+    void select_operation(const Instruction &insn)
+    {
+        Operand a = insn.a(), b = insn.b();
+        bool commutes = insn.op == Opcode::Add || insn.op == Opcode::Mul || insn.op == Opcode::Equals;
+        if (commutes && a.kind == OperandKind::Imm && b.kind != OperandKind::Imm) std::swap(a, b);
+        int64_t k = b.value;
+        bool immediate = false; //b fits the instruction's 16-bit field
+        if (b.kind == OperandKind::Imm) {
+            switch (insn.op) {
+            case Opcode::Add: case Opcode::Less: immediate = fits_immediate(k); break;
+            case Opcode::Sub: immediate = fits_immediate(-k); break;
+            case Opcode::Equals: immediate = k >= 0 && k <= 0xffff; break;
+            case Opcode::Mul: immediate = shifts_and_adds(k); break;
+            case Opcode::Div: immediate = k != 0; break;
+            default: break;
+            }
+        }
+
+        //operands are in registers before anything is emitted for the op
+        const char *ra = use(a, scratch_a), *rb = immediate ? nullptr : use(b, scratch_b);
+        const char *d = target(insn.dst());
+        switch (insn.op) {
+        case Opcode::Add:
+            if (immediate) dst<<"\taddiu\t"<<d<<","<<ra<<","<<k<<"\n";
+            else dst<<"\taddu\t"<<d<<","<<ra<<","<<rb<<"\n";
+            break;
+        case Opcode::Sub:
+            if (immediate) dst<<"\taddiu\t"<<d<<","<<ra<<","<<-k<<"\n";
+            else dst<<"\tsubu\t"<<d<<","<<ra<<","<<rb<<"\n";
+            break;
+        case Opcode::Mul:
+            if (immediate) select_multiply(d, ra, k);
+            else dst<<"\tmul\t"<<d<<","<<ra<<","<<rb<<"\n";
+            break;
+        case Opcode::Div:
+            if (immediate) {
+                select_divide(d, ra, k);
+                break;
+            }
+            dst<<"\tdiv\t$0,"<<ra<<","<<rb<<"\n";
+            dst<<"\tteq\t"<<rb<<",$0,7\n";
+            dst<<"\tmflo\t"<<d<<"\n";
+            break;
+        case Opcode::Less:
+            if (immediate) dst<<"\tslti\t"<<d<<","<<ra<<","<<k<<"\n";
+            else dst<<"\tslt\t"<<d<<","<<ra<<","<<rb<<"\n";
+            break;
+        case Opcode::Equals:
+            if (immediate && k == 0) {
+                dst<<"\tsltiu\t"<<d<<","<<ra<<",1\n";
+                break;
+            }
+            if (immediate) dst<<"\txori\t"<<d<<","<<ra<<","<<k<<"\n";
+            else dst<<"\txor\t"<<d<<","<<ra<<","<<rb<<"\n";
+            dst<<"\tsltiu\t"<<d<<","<<d<<",1\n";
+            break;
+        default:
+            break;
+        }
+        store(insn.dst());
+    }
+
+    void select_print(const Instruction &insn)
+    {
+        //the runtime takes the value in $4, set in the delay slot unless
+        //that takes li or the load more than one instruction
+        Operand value = insn.a();
+        const char *arg = printf_calls ? "$5" : "$4";
+        bool wide = value.kind == OperandKind::Imm ? value.value < -32768 || value.value > 65535
+                                                   : reg[ir.value_index(value)] < 0 && !fits_immediate(slot[ir.value_index(value)]);
+        if (!printf_calls && !wide) dst<<"\tbal\t$PRINT\n";
+        if (value.kind == OperandKind::Imm) dst<<"\tli\t"<<arg<<","<<value.value<<"\n";
+        else if (reg[ir.value_index(value)] >= 0) dst<<"\tmove\t"<<arg<<","<<register_names[reg[ir.value_index(value)]]<<"\n";
+        else frame_access("lw", arg, slot[ir.value_index(value)]);
+        if (!printf_calls) {
+            if (wide) dst<<"\tbal\t$PRINT\n\tnop\n";
+            return;
+        }
+        dst<<"\tlw\t$2,%got($LC0)($28)\n\tnop\n"
+           <<"\taddiu\t$4,$2,%lo($LC0)\n"
+           <<"\tlw\t$25,%call16(printf)($28)\n\tnop\n"
+           <<"\t.reloc\t1f,R_MIPS_JALR,printf\n"
+           <<"1:\tjalr\t$25\n\tnop\n"
+           <<"\tlw\t$28,16($fp)\n\tnop\n";
+    }
+
+    //! Branch to target when compare comes out as when
+    void select_compare_branch(const Instruction &compare, bool when, int target)
+    {
+        Operand a = compare.a(), b = compare.b();
+        if (compare.op == Opcode::Equals) {
+            if (a.kind == OperandKind::Imm && b.kind != OperandKind::Imm) std::swap(a, b);
+            const char *ra = use(a, scratch_a), *rb = use(b, scratch_b);
+            dst<<"\t"<<(when ? "beq" : "bne")<<"\t"<<ra<<","<<rb<<",$L"<<target<<"\n\tnop\n";
+            return;
+        }
+
+        //a < 0, a < 1 and 0 < b test the sign of one register
+        const char *sign = nullptr;
+        Operand tested = a;
+        if (b.kind == OperandKind::Imm && b.value == 0) sign = when ? "bltz" : "bgez";
+        else if (b.kind == OperandKind::Imm && b.value == 1) sign = when ? "blez" : "bgtz";
+        else if (a.kind == OperandKind::Imm && a.value == 0) {
+            sign = when ? "bgtz" : "blez";
+            tested = b;
+        }
+        //use() may load a spilled operand, so it goes before the line starts
+        if (sign != nullptr) {
+            const char *r = use(tested, scratch_a);
+            dst<<"\t"<<sign<<"\t"<<r<<",$L"<<target<<"\n\tnop\n";
+            return;
+        }
+
+        const char *ra = use(a, scratch_a), *t = register_names[scratch_a];
+        if (b.kind == OperandKind::Imm && fits_immediate(b.value)) dst<<"\tslti\t"<<t<<","<<ra<<","<<b.value<<"\n";
+        else {
+            const char *rb = use(b, scratch_b);
+            dst<<"\tslt\t"<<t<<","<<ra<<","<<rb<<"\n";
+        }
+        dst<<"\t"<<(when ? "bne" : "beq")<<"\t"<<t<<",$0,$L"<<target<<"\n\tnop\n";
+    }
+
+    //the block after b in the layout needs no branch to reach it, as
+    //lay_out_blocks expects
+    void select_terminator(unsigned b)
+    {
+        const BasicBlock &block = ir.blocks[b];
+        const Instruction &insn = ir.terminator(b);
+        int next = b + 1;
+        if (insn.op == Opcode::Return) {
+            if (next != (int)ir.blocks.size()) dst<<"\tb\t$EXIT\n\tnop\n";
+            return;
+        }
+        if (insn.op == Opcode::Jump || block.succ[0] == block.succ[1]) {
+            if (block.succ[0] != next) dst<<"\tb\t$L"<<block.succ[0]<<"\n\tnop\n";
+            return;
+        }
+        const Instruction *compare = layout.fused[b];
+        if (compare != nullptr) {
+            if (block.succ[0] == next) select_compare_branch(*compare, false, block.succ[1]);
+            else {
+                select_compare_branch(*compare, true, block.succ[0]);
+                if (block.succ[1] != next) dst<<"\tb\t$L"<<block.succ[1]<<"\n\tnop\n";
+            }
+            return;
+        }
+        const char *condition = use(insn.a(), scratch_a);
+        if (block.succ[0] == next) {
+            dst<<"\tbeq\t"<<condition<<",$0,$L"<<block.succ[1]<<"\n\tnop\n";
+            return;
+        }
+        dst<<"\tbne\t"<<condition<<",$0,$L"<<block.succ[0]<<"\n\tnop\n";
+        if (block.succ[1] != next) dst<<"\tb\t$L"<<block.succ[1]<<"\n\tnop\n";
+    }
+
+    //$ra, $fp, then the $s registers in use from the highest down
+    template<class F>
+    void for_each_saved(unsigned frame, F f) const
+    {
+        f(31, frame - 4);
+        f(30, frame - 8);
+        unsigned offset = frame - 12;
+        for (int r = 23; r >= 16; r--) {
+            if (used_saved >> r & 1) {
+                f(r, offset);
+                offset -= 4;
+            }
+        }
+    }
+
+public:
+    Selection(std::ostream &_dst, const IrProgram &_ir, bool _printf_calls)
+        : dst(_dst),
+        ir(_ir),
+        printf_calls(_printf_calls)
+    {}
+
+    void run()
+    {
+        Liveness live = compute_liveness(ir);
+        allocate(live);
+        layout = lay_out_blocks(ir);
+
+        unsigned frame = (24 + 4*slots + 4*__builtin_popcount(used_saved) + 8 + 7) & ~7u;
+        //a frame past 32KB is allocated in two steps, registers first, so
+        //addiu and their offsets still fit in 16 bits
+        unsigned top = frame <= 32767 ? frame : (4*__builtin_popcount(used_saved) + 8 + 7) & ~7u;
+        if (printf_calls) dst<<"\t.rdata\n\t.align\t2\n$LC0:\n\t.ascii\t\"%d\\012\\000\"\n";
+        dst<<"\t.text\n\t.align\t2\n\t.globl\tmain\n"
+           <<"\t.set\tnomips16\n\t.set\tnomicromips\n"
+           <<"\t.ent\tmain\n\t.type\tmain, @function\nmain:\n"
+           <<"\t.frame\t$fp,"<<frame<<",$31\n"
+           <<"\t.mask\t0x"<<std::hex<<(0xc0000000u | used_saved)<<std::dec<<",-4\n"
+           <<"\t.fmask\t0x00000000,0\n"
+           <<"\t.set\tnoreorder\n\t.cpload\t$25\n"
+           <<"\taddiu\t$sp,$sp,-"<<top<<"\n";
+        for_each_saved(top, [&](int r, unsigned offset) { dst<<"\tsw\t"<<register_names[r]<<","<<offset<<"($sp)\n"; });
+        if (top != frame) dst<<"\tli\t$3,"<<frame - top<<"\n\tsubu\t$sp,$sp,$3\n";
+        dst<<"\tmove\t$fp,$sp\n\t.cprestore\t16\n";
+
+        //variables read before they are assigned start at 0
+        live.for_each_in(0, [&](unsigned v) {
+            if (reg[v] >= 0) dst<<"\tmove\t"<<register_names[reg[v]]<<",$0\n";
+            else frame_access("sw", "$0", slot[v]);
+        });
+
+        for (unsigned b = 0; b < ir.blocks.size(); b++) {
+            if (layout.labelled[b]) dst<<"$L"<<b<<":\n";
+            const BasicBlock &block = ir.blocks[b];
+            unsigned end = block.end() - (layout.fused[b] != nullptr ? 2 : 1);
+            for (unsigned i = block.first; i < end; i++) {
+                const Instruction &insn = ir.code[i];
+                if (insn.op == Opcode::Copy) select_copy(insn);
+                else if (insn.op == Opcode::Print) select_print(insn);
+                else select_operation(insn);
+            }
+            select_terminator(b);
+        }
+
+        if (layout.exit_labelled) dst<<"$EXIT:\n";
+        if (!printf_calls) dst<<"\tbal\t$FLUSH\n\tnop\n";
+        dst<<"\tmove\t$2,$0\n\tmove\t$sp,$fp\n";
+        if (top != frame) dst<<"\tli\t$3,"<<frame - top<<"\n\taddu\t$sp,$sp,$3\n";
+        for_each_saved(top, [&](int r, unsigned offset) { dst<<"\tlw\t"<<register_names[r]<<","<<offset<<"($sp)\n"; });
+        dst<<"\taddiu\t$sp,$sp,"<<top<<"\n"
+           <<"\tj\t$31\n\tnop\n"
+           <<"\t.set\treorder\n\t.end\tmain\n\t.size\tmain, .-main\n\n";
+        if (!printf_calls) generate_print_runtime(dst);
+    }
+};
+
+
+void select_mips(std::ostream &dst, const IrProgram &ir, bool printf_calls)
+{
+    Selection(dst, ir, printf_calls).run();
+}
@@ -0,0 +1,261 @@
+#include "ir.hpp"
+
+#include <string>
+#include <utility>
+
+
+//by encoding number; %eax, %ecx and %edx are scratch, for idivl above all
+static const char *const register_names[16] = {
+    "%eax", "%ecx", "%edx", "%ebx", "%esp", "%ebp", "%esi", "%edi",
+    "%r8d", "%r9d", "%r10d", "%r11d", "%r12d", "%r13d", "%r14d", "%r15d"
+};
+static const char *const saved_names[16] = {
+    nullptr, nullptr, nullptr, "%rbx", nullptr, nullptr, nullptr, nullptr,
+    nullptr, nullptr, nullptr, nullptr, "%r12", "%r13", "%r14", "%r15"
+};
+
+//printf may clobber the first set and must preserve the second
+static const unsigned temporary_registers = 0x0fc0; //%esi, %edi, %r8d-%r11d
+static const unsigned saved_registers = 0xf008;     //%ebx, %r12d-%r15d
+
+
+//! Allocates every value to a register or a stack slot, then walks the
+//! blocks in layout order emitting x86-64 for each instruction. Values are
+//! 32-bit, so every operation is on the low halves of the registers.
+class X86Selection
+{
+private:
+    std::ostream &dst;
+    const IrProgram &ir;
+    Allocation allocation;
+    BlockLayout layout;
+    unsigned saved_count = 0;
+
+    bool in_memory(Operand o) const
+    { return o.is_value() && allocation.reg[ir.value_index(o)] < 0; }
+
+    //! o as an instruction operand: $k, a register or a slot below the
+    //! saved registers
+    std::string operand(Operand o) const
+    {
+        if (o.kind == OperandKind::Imm) return "$" + std::to_string(o.value);
+        unsigned v = ir.value_index(o);
+        if (allocation.reg[v] >= 0) return register_names[allocation.reg[v]];
+        return std::to_string(-8 * (int)saved_count - 4 * (allocation.slot[v] + 1)) + "(%rbp)";
+    }
+
+    //! Register to compute o into; store() puts it in its slot if spilled
+    std::string target(Operand o) const
+    { return in_memory(o) ? "%eax" : operand(o); }
+
+    void store(Operand o, const std::string &from)
+    { if (in_memory(o)) dst<<"\tmovl\t"<<from<<","<<operand(o)<<"\n"; }
+
+    void move(const std::string &from, const std::string &to)
+    {
+        if (from == to) return;
+        if (from == "$0" && to[0] == '%') dst<<"\txorl\t"<<to<<","<<to<<"\n";
+        else dst<<"\tmovl\t"<<from<<","<<to<<"\n";
+    }
+
+    void select_copy(const Instruction &insn)
+    {
+        Operand to = insn.dst(), from = insn.a();
+        if (in_memory(to) && in_memory(from)) {
+            move(operand(from), "%eax");
+            move("%eax", operand(to));
+        }
+        else move(operand(from), operand(to));
+    }
+
+    //! Set the flags for a compared with b
+    void compare(Operand a, Operand b)
+    {
+        std::string ra = operand(a);
+        if (a.kind == OperandKind::Imm || (in_memory(a) && in_memory(b))) {
+            move(ra, "%eax");
+            ra = "%eax";
+        }
+        dst<<"\tcmpl\t"<<operand(b)<<","<<ra<<"\n";
+    }
+
+    //! Division rounding towards zero as on MIPS. idivl traps on a zero
+    //! divisor as div does there, but also on the most negative number over
+    //! -1, which MIPS leaves as it is; dividing by -1 is a negation here.
+    void select_divide(const Instruction &insn)
+    {
+        Operand b = insn.b();
+        move(operand(insn.a()), "%eax");
+        if (b.kind == OperandKind::Imm && b.value == -1) dst<<"\tnegl\t%eax\n";
+        else if (b.kind == OperandKind::Imm) dst<<"\tmovl\t"<<operand(b)<<",%ecx\n\tcltd\n\tidivl\t%ecx\n";
+        else {
+            move(operand(b), "%ecx");
+            dst<<"\tcmpl\t$-1,%ecx\n\tjne\t1f\n\tnegl\t%eax\n\tjmp\t2f\n"
+               <<"1:\tcltd\n\tidivl\t%ecx\n2:\n";
+        }
+        if (!in_memory(insn.dst())) move("%eax", operand(insn.dst()));
+        else store(insn.dst(), "%eax");
+    }
+
+    void select_operation(const Instruction &insn)
+    {
+        if (insn.op == Opcode::Div) {
+            select_divide(insn);
+            return;
+        }
+        Operand a = insn.a(), b = insn.b();
+        bool commutes = insn.op == Opcode::Add || insn.op == Opcode::Mul || insn.op == Opcode::Equals;
+        if (commutes && a.kind == OperandKind::Imm && b.kind != OperandKind::Imm) std::swap(a, b);
+
+        if (insn.op == Opcode::Less || insn.op == Opcode::Equals) {
+            compare(a, b);
+            std::string d = target(insn.dst());
+            dst<<"\t"<<(insn.op == Opcode::Less ? "setl" : "sete")<<"\t%al\n"
+               <<"\tmovzbl\t%al,"<<d<<"\n";
+            store(insn.dst(), d);
+            return;
+        }
+
+        //d is written before b is read, so b must not be in it
+        std::string d = target(insn.dst());
+        if (operand(b) == d) {
+            if (commutes) std::swap(a, b);
+            else d = "%eax";
+        }
+        if (insn.op == Opcode::Mul && b.kind == OperandKind::Imm && a.kind != OperandKind::Imm) {
+            dst<<"\timull\t"<<operand(b)<<","<<operand(a)<<","<<d<<"\n";
+        }
+        else {
+            const char *op = insn.op == Opcode::Add ? "addl" : insn.op == Opcode::Sub ? "subl" : "imull";
+            move(operand(a), d);
+            dst<<"\t"<<op<<"\t"<<operand(b)<<","<<d<<"\n";
+        }
+        if (in_memory(insn.dst())) store(insn.dst(), d);
+        else move(d, operand(insn.dst()));
+    }
+
+    void select_print(const Instruction &insn)
+    {
+        move(operand(insn.a()), "%esi");
+        dst<<"\tleaq\t.LC0(%rip),%rdi\n"
+           <<"\txorl\t%eax,%eax\n"
+           <<"\tcall\tprintf@PLT\n";
+    }
+
+    //the block after b in the layout needs no jump to reach it, as
+    //lay_out_blocks expects
+    void select_terminator(unsigned b)
+    {
+        const BasicBlock &block = ir.blocks[b];
+        const Instruction &insn = ir.terminator(b);
+        int next = b + 1;
+        if (insn.op == Opcode::Return) {
+            if (next != (int)ir.blocks.size()) dst<<"\tjmp\t.LEXIT\n";
+            return;
+        }
+        if (insn.op == Opcode::Jump || block.succ[0] == block.succ[1]) {
+            if (block.succ[0] != next) dst<<"\tjmp\t.L"<<block.succ[0]<<"\n";
+            return;
+        }
+
+        //jump to succ[0] on taken, else to succ[1]
+        const char *taken, *not_taken;
+        const Instruction *fused = layout.fused[b];
+        if (fused != nullptr) {
+            Operand lhs = fused->a(), rhs = fused->b();
+            if (fused->op == Opcode::Equals && lhs.kind == OperandKind::Imm) std::swap(lhs, rhs);
+            compare(lhs, rhs);
+            taken = fused->op == Opcode::Less ? "jl" : "je";
+            not_taken = fused->op == Opcode::Less ? "jge" : "jne";
+        }
+        else if (insn.a().kind == OperandKind::Imm) {
+            //only unoptimized code branches on a constant
+            int to = block.succ[insn.a().value != 0 ? 0 : 1];
+            if (to != next) dst<<"\tjmp\t.L"<<to<<"\n";
+            return;
+        }
+        else {
+            std::string condition = operand(insn.a());
+            if (in_memory(insn.a())) dst<<"\tcmpl\t$0,"<<condition<<"\n";
+            else dst<<"\ttestl\t"<<condition<<","<<condition<<"\n";
+            taken = "jne";
+            not_taken = "je";
+        }
+        if (block.succ[0] == next) {
+            dst<<"\t"<<not_taken<<"\t.L"<<block.succ[1]<<"\n";
+            return;
+        }
+        dst<<"\t"<<taken<<"\t.L"<<block.succ[0]<<"\n";
+        if (block.succ[1] != next) dst<<"\tjmp\t.L"<<block.succ[1]<<"\n";
+    }
+
+    //%rbx and %r12-%r15 in use, in push order
+    template<class F>
+    void for_each_saved(F f) const
+    {
+        for (int r = 0; r < 16; r++) {
+            if (allocation.used_saved >> r & 1) f(saved_names[r]);
+        }
+    }
+
+public:
+    X86Selection(std::ostream &_dst, const IrProgram &_ir)
+        : dst(_dst),
+        ir(_ir)
+    {}
+
+    void run()
+    {
+        Liveness live = compute_liveness(ir);
+        allocation = allocate_registers(ir, live, temporary_registers, saved_registers);
+        layout = lay_out_blocks(ir);
+        saved_count = __builtin_popcount(allocation.used_saved);
+
+        //%rsp is 16-byte aligned at each call: the return address and
+        //%rbp make 16, then the saved registers and slots are rounded up
+        unsigned below = 8 * saved_count;
+        unsigned frame = ((below + 4 * allocation.slots + 15) & ~15u) - below;
+
+        dst<<"\t.section\t.rodata\n.LC0:\n\t.string\t\"%d\\n\"\n"
+           <<"\t.text\n\t.globl\tmain\n\t.type\tmain, @function\nmain:\n"
+           <<"\tpushq\t%rbp\n\tmovq\t%rsp,%rbp\n";
+        for_each_saved([&](const char *r) { dst<<"\tpushq\t"<<r<<"\n"; });
+        if (frame != 0) dst<<"\tsubq\t$"<<frame<<",%rsp\n";
+
+        //variables read before they are assigned start at 0
+        live.for_each_in(0, [&](unsigned v) {
+            if (allocation.reg[v] >= 0) move("$0", register_names[allocation.reg[v]]);
+            else dst<<"\tmovl\t$0,"<<-8 * (int)saved_count - 4 * (allocation.slot[v] + 1)<<"(%rbp)\n";
+        });
+
+        for (unsigned b = 0; b < ir.blocks.size(); b++) {
+            if (layout.labelled[b]) dst<<".L"<<b<<":\n";
+            const BasicBlock &block = ir.blocks[b];
+            unsigned end = block.end() - (layout.fused[b] != nullptr ? 2 : 1);
+            for (unsigned i = block.first; i < end; i++) {
+                const Instruction &insn = ir.code[i];
+                if (insn.op == Opcode::Copy) select_copy(insn);
+                else if (insn.op == Opcode::Print) select_print(insn);
+                else select_operation(insn);
+            }
+            select_terminator(b);
+        }
+
+        if (layout.exit_labelled) dst<<".LEXIT:\n";
+        dst<<"\txorl\t%eax,%eax\n";
+        if (saved_count == 0) dst<<"\tmovq\t%rbp,%rsp\n";
+        else dst<<"\tleaq\t-"<<below<<"(%rbp),%rsp\n";
+        std::vector<const char *> pushed;
+        for_each_saved([&](const char *r) { pushed.push_back(r); });
+        for (auto r = pushed.rbegin(); r != pushed.rend(); ++r) dst<<"\tpopq\t"<<*r<<"\n";
+        dst<<"\tpopq\t%rbp\n\tret\n"
+           <<"\t.size\tmain, .-main\n"
+           <<"\t.section\t.note.GNU-stack,\"\",@progbits\n";
+    }
+};
+
+
+void select_x86_64(std::ostream &dst, const IrProgram &ir)
+{
+    X86Selection(dst, ir).run();
+}
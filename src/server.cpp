@@ -0,0 +1,154 @@
+#include "server.hpp"
+#include "protocol.hpp"
+#include "emitter.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+
+
+//connections wait here until a worker is free
+class ConnectionQueue
+{
+private:
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<int> connections;
+public:
+    void push(int fd)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        connections.push_back(fd);
+        ready.notify_one();
+    }
+
+    int pop()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        ready.wait(guard, [this]() { return !connections.empty(); });
+        int fd = connections.front();
+        connections.pop_front();
+        return fd;
+    }
+};
+
+
+class Worker
+{
+private:
+    Session session;
+    std::vector<char> text; //inline source plus the two NULs flex needs
+    AsmEmitter out; //kept between requests, like the session
+
+    void compile(const std::string &name, const char *flags)
+    {
+        int optimize = strchr(flags, '2') != nullptr ? 2 : strchr(flags, 'O') != nullptr;
+        session.printf_calls = strchr(flags, 'p') != nullptr;
+        if (strchr(flags, 's') != nullptr && optimize == 0) stream_assembly(out, name, session);
+        else print_assembly(out, name, session, optimize);
+    }
+
+    //! Header and body go out in one writev, the body straight from out
+    bool reply(int fd, bool ok, std::string_view body)
+    {
+        char header[48];
+        int length = snprintf(header, sizeof header, "%s %zu\n", ok ? "ok" : "error", body.size());
+        iovec parts[2] = { { header, (size_t)length }, { const_cast<char *>(body.data()), body.size() } };
+        return write_all(fd, parts, 2);
+    }
+
+public:
+    //! Answer requests on fd until the client hangs up
+    void serve(int fd)
+    {
+        char header[96], kind[16], flags[16];
+        size_t name_length, source_length;
+        std::string name;
+        while (read_header(fd, header, sizeof header)) {
+            if (sscanf(header, "%15s %15s %zu %zu", kind, flags, &name_length, &source_length) != 4) break;
+            bool is_path = strcmp(kind, "path") == 0;
+
+            //the rest of an oversized request is never read, so hang up after it
+            if (name_length > MAX_NAME_LENGTH || source_length > MAX_SOURCE_LENGTH) {
+                reply(fd, false, "request exceeds the server's size limits");
+                break;
+            }
+            name.resize(name_length);
+            if (!read_all(fd, &name[0], name_length)) break;
+            text.resize(source_length + 2);
+            if (!read_all(fd, text.data(), source_length)) break;
+            text[source_length] = text[source_length+1] = '\0';
+
+            session.reset();
+            out.clear();
+            bool ok = true;
+            try {
+                std::unique_ptr<MappedSource> source;
+                if (is_path) {
+                    source.reset(new MappedSource(std::string(text.data(), source_length)));
+                    session.read_mapped(*source);
+                } else {
+                    session.read_buffer(text.data(), text.size());
+                }
+                compile(name, flags);
+            } catch (const std::exception &e) {
+                ok = false;
+                out.clear();
+                out<<name<<": "<<e.what();
+            }
+            if (!reply(fd, ok, out.text())) break;
+        }
+        close(fd);
+    }
+};
+
+
+int run_server(const char *socket_path, unsigned workers)
+{
+    //a client that goes away mid-reply must not take the server down
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address;
+    if (!socket_address(socket_path, address)) {
+        fprintf(stderr, "%s: socket path is too long\n", socket_path);
+        return EXIT_FAILURE;
+    }
+    if (!private_socket_directory(socket_path)) {
+        perror(socket_path);
+        return EXIT_FAILURE;
+    }
+    //only a socket left behind by an earlier server is replaced
+    struct stat info;
+    if (lstat(socket_path, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(socket_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = umask(077);
+    bool bound = listener >= 0 && bind(listener, (sockaddr *)&address, sizeof address) == 0;
+    umask(mask);
+    if (!bound || listen(listener, 128) != 0) {
+        perror(socket_path);
+        return EXIT_FAILURE;
+    }
+
+    ConnectionQueue queue;
+    std::vector<std::thread> threads;
+    if (workers == 0) workers = 1;
+    for (unsigned i = 0; i < workers; i++) {
+        threads.emplace_back([&queue]() {
+            std::unique_ptr<Worker> worker(new Worker);
+            for (;;) worker->serve(queue.pop());
+        });
+    }
+
+    for (;;) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd >= 0 && !same_user_peer(fd)) close(fd);
+        else if (fd >= 0) queue.push(fd);
+        else if (errno != EINTR) perror("accept");
+    }
+}
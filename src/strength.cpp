@@ -0,0 +1,157 @@
+#include "passes.hpp"
+
+#include <utility>
+#include <vector>
+
+
+//! Products of a loop's counter and a constant, kept in a temp of their own
+//! that starts as the product in front of the loop and goes up by the step
+//! times the constant right after the counter does. A counter is a variable
+//! whose only assignment in the loop adds or subtracts a constant.
+class InductionVariables
+{
+private:
+    IrProgram &ir;
+    LoopNest nest;
+    std::vector<std::vector<Instruction> > appended; //by block, before its terminator
+    std::vector<std::vector<Instruction> > after;    //by instruction
+
+    //per loop, reset through touched
+    std::vector<unsigned> defs, def_at;
+    std::vector<unsigned> touched;
+
+    struct Derived
+    {
+        Symbol counter;
+        int32_t factor;
+        Operand value;
+    };
+
+    //! Step of the counter v is assigned with in insn, if it is one
+    static bool step_of(const Instruction &insn, Operand v, uint32_t &step)
+    {
+        if (insn.dst() != v) return false;
+        if (insn.op == Opcode::Add && insn.a() == v && insn.b().kind == OperandKind::Imm) step = insn.b().value;
+        else if (insn.op == Opcode::Add && insn.b() == v && insn.a().kind == OperandKind::Imm) step = insn.a().value;
+        else if (insn.op == Opcode::Sub && insn.a() == v && insn.b().kind == OperandKind::Imm) step = -(uint32_t)insn.b().value;
+        else return false;
+        return true;
+    }
+
+    //! The constant block leaves v holding, when its last assignment there
+    //! is one, as in the i := 0 in front of a while
+    bool starts_at(unsigned block, Operand v, int32_t &start) const
+    {
+        const BasicBlock &range = ir.blocks[block];
+        for (unsigned i = range.end() - 1; i-- > range.first; ) {
+            const Instruction &insn = ir.code[i];
+            if (insn.dst() != v) continue;
+            start = insn.a().value;
+            return insn.op == Opcode::Copy && insn.a().kind == OperandKind::Imm;
+        }
+        return false;
+    }
+
+    //! Multiplying by a power of two or its negation is a shift anyway
+    static bool worth_reducing(int32_t factor)
+    {
+        uint32_t k = factor;
+        return (k & (k - 1)) != 0 && (-k & (-k - 1)) != 0;
+    }
+
+    void reduce(const LoopNest::Loop &loop)
+    {
+        for (unsigned v : touched) defs[v] = 0;
+        touched.clear();
+        for (unsigned b : loop.blocks) {
+            const BasicBlock &block = ir.blocks[b];
+            for (unsigned i = block.first; i < block.end(); i++) {
+                if (!ir.code[i].dst().is_value()) continue;
+                unsigned v = ir.value_index(ir.code[i].dst());
+                if (defs[v]++ == 0) touched.push_back(v);
+                def_at[v] = i;
+            }
+        }
+
+        std::vector<Derived> derived;
+        for (unsigned b : loop.blocks) {
+            const BasicBlock &block = ir.blocks[b];
+            for (unsigned i = block.first; i + 1 < block.end(); i++) {
+                Instruction &insn = ir.code[i];
+                if (insn.op != Opcode::Mul) continue;
+                Operand counter = insn.a(), factor = insn.b();
+                if (counter.kind == OperandKind::Imm) std::swap(counter, factor);
+                if (counter.kind != OperandKind::Var || factor.kind != OperandKind::Imm || !worth_reducing(factor.value)) continue;
+                unsigned v = ir.value_index(counter);
+                uint32_t step;
+                if (defs[v] != 1 || !step_of(ir.code[def_at[v]], counter, step)) continue;
+
+                Operand value = Operand::none();
+                for (const Derived &d : derived) {
+                    if (d.counter == (Symbol)counter.value && d.factor == factor.value) value = d.value;
+                }
+                if (value.kind == OperandKind::None) {
+                    value = ir.new_temp();
+                    derived.push_back(Derived{(Symbol)counter.value, factor.value, value});
+                    int32_t start;
+                    if (starts_at(loop.entry, counter, start)) {
+                        appended[loop.entry].emplace_back(Opcode::Copy, value, Operand::imm((int32_t)((uint32_t)start * (uint32_t)factor.value)));
+                    }
+                    else appended[loop.entry].emplace_back(Opcode::Mul, value, counter, factor);
+                    after[def_at[v]].emplace_back(Opcode::Add, value, value, Operand::imm((int32_t)(step * (uint32_t)factor.value)));
+                }
+
+                //read the product directly up to where it next changes;
+                //the copy is left for dead code elimination
+                Operand product = insn.dst();
+                insn = Instruction(Opcode::Copy, product, value);
+                unsigned last = def_at[v] > i && def_at[v] < block.end() ? def_at[v] : block.end() - 1;
+                for (unsigned j = i + 1; j <= last && product.kind == OperandKind::Temp; j++) {
+                    for (unsigned k = 1; k < 3; k++) {
+                        if (ir.code[j].operand(k) == product) ir.code[j].set(k, value);
+                    }
+                }
+            }
+        }
+    }
+
+public:
+    InductionVariables(IrProgram &_ir)
+        : ir(_ir),
+        nest(find_loops(_ir))
+    {}
+
+    void run()
+    {
+        if (nest.loops.empty()) return;
+        appended.resize(ir.blocks.size());
+        after.resize(ir.code.size());
+        defs.assign(ir.values(), 0);
+        def_at.assign(ir.values(), 0);
+        for (const LoopNest::Loop &loop : nest.loops) {
+            if (loop.entry >= 0) reduce(loop);
+        }
+
+        std::vector<Instruction> code;
+        code.reserve(ir.code.size());
+        for (BasicBlock &block : ir.blocks) {
+            unsigned first = code.size();
+            for (unsigned i = block.first; i + 1 < block.end(); i++) {
+                code.push_back(ir.code[i]);
+                code.insert(code.end(), after[i].begin(), after[i].end());
+            }
+            unsigned b = &block - ir.blocks.data();
+            code.insert(code.end(), appended[b].begin(), appended[b].end());
+            code.push_back(ir.code[block.end() - 1]);
+            block.first = first;
+            block.count = code.size() - first;
+        }
+        ir.code.swap(code);
+    }
+};
+
+
+void reduce_induction_variables(IrProgram &ir)
+{
+    InductionVariables(ir).run();
+}
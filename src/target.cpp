@@ -0,0 +1,56 @@
+#include "target.hpp"
+
+
+class MipsTarget : public Target
+{
+public:
+    const char *name() const override
+    { return "mips"; }
+
+    void print_header(std::ostream &dst, const std::string &fileName) const override
+    {
+        dst<<"\t.file\t1 \""<<fileName<<"\"\n"
+           <<"\t.section .mdebug.abi32\n\t.previous\n"
+           <<"\t.nan\tlegacy\n\t.module fp=xx\n"
+           <<"\t.module nooddspreg\n\t.abicalls\n\n";
+    }
+
+    void select(std::ostream &dst, const IrProgram &ir, bool printf_calls) const override
+    { select_mips(dst, ir, printf_calls); }
+
+    bool generates_from_ast() const override
+    { return true; }
+};
+
+//! System V x86-64 in AT&T syntax, for gcc or as and ld. Prints always go
+//! through printf, whose buffering does what the MIPS runtime does.
+class X86_64Target : public Target
+{
+public:
+    const char *name() const override
+    { return "x86_64"; }
+
+    void print_header(std::ostream &dst, const std::string &fileName) const override
+    { dst<<"\t.file\t\""<<fileName<<"\"\n"; }
+
+    //prints already call printf, so --printf changes nothing here
+    void select(std::ostream &dst, const IrProgram &ir, bool /*printf_calls*/) const override
+    { select_x86_64(dst, ir); }
+};
+
+
+const Target &mips_target()
+{
+    static const MipsTarget target;
+    return target;
+}
+
+const Target *find_target(const std::string &name)
+{
+    static const X86_64Target x86_64;
+    static const Target *const targets[] = { &mips_target(), &x86_64 };
+    for (const Target *target : targets) {
+        if (name == target->name()) return target;
+    }
+    return nullptr;
+}
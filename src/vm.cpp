@@ -0,0 +1,380 @@
+#include "vm.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+
+//! Numbers the slots, then turns each block into bytecode in layout order
+//! the way select_mips turns it into assembly: a comparison only the
+//! branch reads is done by the branch, and the block after needs no jump.
+//! A block holding only such a comparison, as ends every while loop, is
+//! tested again at the end of each block going to it rather than jumped to.
+class BytecodeCompiler
+{
+private:
+    const IrProgram &ir;
+    BlockLayout layout;
+    Bytecode &out;
+
+    std::vector<int> value_slot;  //by value index, -1 until given one
+    std::vector<int> temp_block;  //by temp, the one block it is used in, or -2 if several
+    unsigned fixed = 0, locals = 0;
+    std::unordered_map<int32_t,int> constants; //to their slots past the temps
+    std::vector<unsigned> block_start;
+    std::vector<size_t> jumps;    //instructions whose target is still a block
+
+    bool local(Operand o) const
+    { return o.kind == OperandKind::Temp && temp_block[o.value] >= 0; }
+
+    //every temp read before it is written in a block, or used in more
+    //than one, keeps a slot of its own
+    void find_local_temps()
+    {
+        temp_block.assign(ir.temps, -1);
+        for (unsigned b = 0; b < ir.blocks.size(); b++) {
+            const BasicBlock &block = ir.blocks[b];
+            for (unsigned i = block.first; i < block.end(); i++) {
+                const Instruction &insn = ir.code[i];
+                for (unsigned k = 1; k < 3; k++) {
+                    Operand o = insn.operand(k);
+                    if (o.kind == OperandKind::Temp && temp_block[o.value] != (int)b) temp_block[o.value] = -2;
+                }
+                Operand d = insn.dst();
+                if (d.kind == OperandKind::Temp && temp_block[d.value] == -1) temp_block[d.value] = b;
+                else if (d.kind == OperandKind::Temp && temp_block[d.value] != (int)b) temp_block[d.value] = -2;
+            }
+        }
+    }
+
+    void number_slots()
+    {
+        value_slot.assign(ir.values(), -1);
+        std::vector<int> local_slot(ir.temps, -1);
+        for (const BasicBlock &block : ir.blocks) {
+            unsigned used = 0;
+            for (unsigned i = block.first; i < block.end(); i++) {
+                for (unsigned k = 0; k < 3; k++) {
+                    Operand o = ir.code[i].operand(k);
+                    if (!o.is_value()) continue;
+                    if (local(o)) {
+                        if (local_slot[o.value] < 0) local_slot[o.value] = used++;
+                    }
+                    else if (value_slot[ir.value_index(o)] < 0) value_slot[ir.value_index(o)] = fixed++;
+                }
+            }
+            locals = std::max(locals, used);
+        }
+        for (unsigned t = 0; t < ir.temps; t++) {
+            if (local_slot[t] >= 0) value_slot[ir.value_index(Operand::temp(t))] = fixed + local_slot[t];
+        }
+        out.frame.assign(fixed + locals, 0);
+    }
+
+    int slot(Operand o)
+    {
+        if (o.kind != OperandKind::Imm) return value_slot[ir.value_index(o)];
+        auto found = constants.find(o.value);
+        if (found != constants.end()) return found->second;
+        int n = out.frame.size();
+        out.frame.push_back(o.value);
+        constants.emplace(o.value, n);
+        return n;
+    }
+
+    void emit(VmOp op, int32_t dst = 0, int32_t a = 0, int32_t b = 0)
+    { out.code.push_back(VmInstruction{op, dst, a, b, 0}); }
+
+    void emit_jump(VmOp op, int block, int32_t a = 0, int32_t b = 0)
+    {
+        jumps.push_back(out.code.size());
+        out.code.push_back(VmInstruction{op, 0, a, b, block});
+    }
+
+    void emit_instruction(const Instruction &insn)
+    {
+        Operand a = insn.a(), b = insn.b();
+        switch (insn.op) {
+        case Opcode::Copy:
+            if (slot(insn.dst()) != slot(a)) emit(VmOp::Copy, slot(insn.dst()), slot(a));
+            return;
+        case Opcode::Print:
+            emit(VmOp::Print, 0, slot(a));
+            return;
+        case Opcode::Add: case Opcode::Sub:
+            if (insn.op == Opcode::Add && a.kind == OperandKind::Imm && b.kind != OperandKind::Imm) std::swap(a, b);
+            if (a.kind != OperandKind::Imm && b.kind == OperandKind::Imm) {
+                uint32_t k = b.value;
+                emit(VmOp::AddK, slot(insn.dst()), slot(a), insn.op == Opcode::Add ? k : 0u - k);
+                return;
+            }
+            break;
+        default:
+            break;
+        }
+        static const VmOp ops[] = { VmOp::Copy, VmOp::Add, VmOp::Sub, VmOp::Mul, VmOp::Div, VmOp::Less, VmOp::Equals };
+        emit(ops[(int)insn.op], slot(insn.dst()), slot(a), slot(b));
+    }
+
+    //! Whether insn, which is not a jump, reads or writes slot s
+    static bool uses(const VmInstruction &insn, int32_t s)
+    {
+        if (insn.op == VmOp::Print) return insn.a == s;
+        if (insn.op == VmOp::Copy || insn.op == VmOp::AddK) return insn.dst == s || insn.a == s;
+        return insn.dst == s || insn.a == s || insn.b == s;
+    }
+
+    //! The last instruction since start adding a constant to slot s in
+    //! place, if nothing after it uses s, so it can step s at the end
+    //! instead; the end of the code if there is none. Between start and
+    //! the end there are no jumps.
+    size_t find_step(int32_t s, size_t start) const
+    {
+        for (size_t i = out.code.size(); i > start; i--) {
+            const VmInstruction &insn = out.code[i - 1];
+            if (insn.op == VmOp::AddK && insn.dst == s && insn.a == s) return i - 1;
+            if (uses(insn, s)) break;
+        }
+        return out.code.size();
+    }
+
+    //! Only a comparison and the branch on it
+    bool is_test(int b) const
+    { return ir.blocks[b].count == 2 && layout.fused[b] != nullptr; }
+
+    //! The branch ending block c, placed in the block starting at start
+    //! and followed by block next
+    void emit_branch(unsigned c, int next, size_t start)
+    {
+        const BasicBlock &block = ir.blocks[c];
+        const Instruction &insn = ir.terminator(c);
+        const Instruction *fused = layout.fused[c];
+        if (fused == nullptr && insn.a().kind == OperandKind::Imm) {
+            //only unoptimized code branches on a constant
+            int to = block.succ[insn.a().value != 0 ? 0 : 1];
+            if (to != next) emit_jump(VmOp::Jump, to);
+            return;
+        }
+
+        //jump to succ[0] on the condition, or on its negation to succ[1]
+        //when succ[0] comes next
+        bool negate = block.succ[0] == next;
+        int to = block.succ[negate ? 1 : 0];
+        if (fused == nullptr) emit_jump(negate ? VmOp::JumpIfNot : VmOp::JumpIf, to, slot(insn.a()));
+        else if (fused->op == Opcode::Equals) {
+            Operand a = fused->a(), b = fused->b();
+            if (a.kind == OperandKind::Imm) std::swap(a, b);
+            emit_jump(negate ? VmOp::JumpNotEqual : VmOp::JumpEqual, to, slot(a), slot(b));
+        }
+        else if (fused->b().kind != OperandKind::Imm || fused->a().kind == OperandKind::Imm) {
+            emit_jump(negate ? VmOp::JumpNotLess : VmOp::JumpLess, to, slot(fused->a()), slot(fused->b()));
+        }
+        else {
+            int32_t a = slot(fused->a()), k = fused->b().value;
+            size_t step = negate ? out.code.size() : find_step(a, start);
+            if (step != out.code.size()) {
+                //x := x + 1 then while x < K
+                int32_t by = out.code[step].b;
+                out.code.erase(out.code.begin() + step);
+                emit_jump(VmOp::AddKJumpLessK, to, by, k);
+                out.code.back().dst = a;
+            }
+            else emit_jump(negate ? VmOp::JumpNotLessK : VmOp::JumpLessK, to, a, k);
+        }
+        if (!negate && block.succ[1] != next) emit_jump(VmOp::Jump, block.succ[1]);
+    }
+
+    void emit_terminator(unsigned b, size_t start)
+    {
+        const BasicBlock &block = ir.blocks[b];
+        const Instruction &insn = ir.terminator(b);
+        int next = b + 1;
+        if (insn.op == Opcode::Return) emit(VmOp::Halt);
+        else if (insn.op == Opcode::Jump || block.succ[0] == block.succ[1]) {
+            if (is_test(block.succ[0])) emit_branch(block.succ[0], next, start);
+            else if (block.succ[0] != next) emit_jump(VmOp::Jump, block.succ[0]);
+        }
+        else emit_branch(b, next, start);
+    }
+
+public:
+    BytecodeCompiler(const IrProgram &_ir, Bytecode &_out)
+        : ir(_ir),
+        out(_out)
+    {}
+
+    void run()
+    {
+        layout = lay_out_blocks(ir);
+        find_local_temps();
+        number_slots();
+
+        for (unsigned b = 0; b < ir.blocks.size(); b++) {
+            const BasicBlock &block = ir.blocks[b];
+            size_t start = out.code.size();
+            block_start.push_back(start);
+            unsigned end = block.end() - (layout.fused[b] != nullptr ? 2 : 1);
+            for (unsigned i = block.first; i < end; i++) emit_instruction(ir.code[i]);
+            emit_terminator(b, start);
+        }
+        //whatever the last block ends in, nothing runs past the code
+        emit(VmOp::Halt);
+
+        for (size_t i : jumps) out.code[i].target = block_start[out.code[i].target];
+    }
+};
+
+
+Bytecode compile_bytecode(const IrProgram &ir)
+{
+    Bytecode bytecode;
+    BytecodeCompiler(ir, bytecode).run();
+    return bytecode;
+}
+
+
+//! Lines of decimal text, handed to the stream a block at a time
+class PrintBuffer
+{
+private:
+    std::ostream &dst;
+    char text[1 << 16];
+    size_t used = 0;
+
+public:
+    explicit PrintBuffer(std::ostream &_dst)
+        : dst(_dst)
+    {}
+
+    void print(int32_t value)
+    {
+        if (used > sizeof text - 16) flush();
+        char digits[10];
+        unsigned n = 0;
+        uint32_t u = value < 0 ? 0u - (uint32_t)value : value;
+        do {
+            digits[n++] = '0' + u % 10;
+            u /= 10;
+        } while (u != 0);
+        if (value < 0) text[used++] = '-';
+        while (n != 0) text[used++] = digits[--n];
+        text[used++] = '\n';
+    }
+
+    void flush()
+    {
+        dst.write(text, used);
+        used = 0;
+    }
+};
+
+
+//! Direct-threaded: each instruction is copied with the address of its
+//! handler in place of the opcode, and every handler ends by jumping
+//! straight to the next one's.
+void run_bytecode(const Bytecode &bytecode, std::ostream &dst)
+{
+    struct Threaded
+    {
+        const void *handler;
+        int32_t dst, a, b, target;
+    };
+    //in the order of VmOp
+    static const void *const handlers[] = {
+        &&copy, &&add, &&sub, &&mul, &&div, &&less, &&equals, &&add_k, &&print,
+        &&jump, &&jump_if, &&jump_if_not, &&jump_less, &&jump_not_less,
+        &&jump_less_k, &&jump_not_less_k, &&jump_equal, &&jump_not_equal,
+        &&add_k_jump_less_k, &&halt
+    };
+
+    std::vector<Threaded> code;
+    code.reserve(bytecode.code.size());
+    for (const VmInstruction &insn : bytecode.code) {
+        code.push_back(Threaded{handlers[(int)insn.op], insn.dst, insn.a, insn.b, insn.target});
+    }
+    std::vector<int32_t> frame = bytecode.frame;
+    int32_t *slot = frame.data();
+    const Threaded *start = code.data(), *pc = start;
+    PrintBuffer printed(dst);
+
+#define NEXT() goto *(++pc)->handler
+#define JUMP() do { pc = start + pc->target; goto *pc->handler; } while (0)
+//add, sub and mul wrap around like addu, subu and mul
+#define WRAP(x, op, y) (int32_t)((uint32_t)(x) op (uint32_t)(y))
+
+    goto *pc->handler;
+copy:
+    slot[pc->dst] = slot[pc->a];
+    NEXT();
+add:
+    slot[pc->dst] = WRAP(slot[pc->a], +, slot[pc->b]);
+    NEXT();
+sub:
+    slot[pc->dst] = WRAP(slot[pc->a], -, slot[pc->b]);
+    NEXT();
+mul:
+    slot[pc->dst] = WRAP(slot[pc->a], *, slot[pc->b]);
+    NEXT();
+div: {
+    //div truncates and lo wraps, so INT_MIN / -1 is INT_MIN
+    int32_t a = slot[pc->a], b = slot[pc->b];
+    if (b == 0) goto trap;
+    slot[pc->dst] = b == -1 ? WRAP(0, -, a) : a / b;
+    NEXT();
+}
+less:
+    slot[pc->dst] = slot[pc->a] < slot[pc->b];
+    NEXT();
+equals:
+    slot[pc->dst] = slot[pc->a] == slot[pc->b];
+    NEXT();
+add_k:
+    slot[pc->dst] = WRAP(slot[pc->a], +, pc->b);
+    NEXT();
+print:
+    printed.print(slot[pc->a]);
+    NEXT();
+jump:
+    JUMP();
+jump_if:
+    if (slot[pc->a] != 0) JUMP();
+    NEXT();
+jump_if_not:
+    if (slot[pc->a] == 0) JUMP();
+    NEXT();
+jump_less:
+    if (slot[pc->a] < slot[pc->b]) JUMP();
+    NEXT();
+jump_not_less:
+    if (!(slot[pc->a] < slot[pc->b])) JUMP();
+    NEXT();
+jump_less_k:
+    if (slot[pc->a] < pc->b) JUMP();
+    NEXT();
+jump_not_less_k:
+    if (!(slot[pc->a] < pc->b)) JUMP();
+    NEXT();
+jump_equal:
+    if (slot[pc->a] == slot[pc->b]) JUMP();
+    NEXT();
+jump_not_equal:
+    if (slot[pc->a] != slot[pc->b]) JUMP();
+    NEXT();
+add_k_jump_less_k: {
+    int32_t x = WRAP(slot[pc->dst], +, pc->a);
+    slot[pc->dst] = x;
+    if (x < pc->b) JUMP();
+    NEXT();
+}
+halt:
+    printed.flush();
+    return;
+trap:
+    printed.flush();
+    throw std::runtime_error("division by zero");
+
+#undef NEXT
+#undef JUMP
+#undef WRAP
+}
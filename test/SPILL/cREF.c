@@ -0,0 +1,30 @@
+#include <stdio.h>
+int i, o, fa, fb, fc, fd, fe, ff, fg, x, v, c;
+int ga, gb, gc, gd, ge, gf, gg;
+
+int main()
+{
+    i = 0;
+    while (i < 2){
+        o = o + i * 5 + 1;
+        fa = fa + i; fb = fb + i; fc = fc + i; fd = fd + i;
+        fe = fe + i; ff = ff + i; fg = fg + i;
+        i = i + 1;
+    }
+    x = o * 3;
+    printf("%d\n", fa);
+    printf("%d\n", x);
+    printf("%d\n", fa); printf("%d\n", fb); printf("%d\n", fc); printf("%d\n", fd);
+    printf("%d\n", fe); printf("%d\n", ff); printf("%d\n", fg);
+    v = o + 5;
+    ga = o + 6; gb = o + 7; gc = o + 8; gd = o + 9;
+    ge = o + 10; gf = o + 11; gg = o + 12;
+    printf("%d\n", o);
+    c = v * 2;
+    printf("%d\n", ga);
+    printf("%d\n", c);
+    printf("%d\n", ga); printf("%d\n", gb); printf("%d\n", gc); printf("%d\n", gd);
+    printf("%d\n", ge); printf("%d\n", gf); printf("%d\n", gg);
+    printf("%d\n", v);
+    return 0;
+}
@@ -0,0 +1,25 @@
+#include <stdio.h>
+int x, y, z;
+
+int main()
+{
+    x = 5;
+    y = 0;
+    while (y < 0){
+        printf("%d\n", y);
+        y = y + 1;
+    }
+    printf("%d\n", y);
+    if (y){
+        x = 7;
+        printf("%d\n", x);
+    }
+    printf("%d\n", x);
+    z = x + 1;
+    while (z < 8){
+        printf("%d\n", z);
+        z = z + 1;
+    }
+    printf("%d\n", x + z);
+    return 0;
+}
@@ -1 +1,63 @@
-####  NEED TO IMPLEMENT ####
+#!/bin/bash
+# Compile each program in test/* and diff what it prints against its
+# cREF.c built with the host compiler:
+#   --run    in the bytecode VM, at -O0, -O and -O2
+#   mips     at -O0, -O and -O2, linked by MIPS_CC and run under MIPS_RUN
+#   x86_64   at -O0, -O and -O2 with --target=x86_64, on an x86-64 host
+# Targets whose tools are missing are skipped, and the script says so.
+#   ./test_compiler.sh
+# CC defaults to cc, MIPS_CC to mips-linux-gnu-gcc and MIPS_RUN to qemu-mips.
+
+CC=${CC:-cc}
+MIPS_CC=${MIPS_CC:-mips-linux-gnu-gcc}
+MIPS_RUN=${MIPS_RUN:-qemu-mips}
+OUT=$(mktemp -d)
+trap "rm -rf $OUT" EXIT
+
+make bin/compiler || exit 1
+
+targets="run"
+if command -v $MIPS_CC > /dev/null && command -v $MIPS_RUN > /dev/null; then targets="$targets mips"
+else echo "skipping mips: $MIPS_CC or $MIPS_RUN not found"
+fi
+if [ "$(uname -m)" == x86_64 ]; then targets="$targets x86_64"
+else echo "skipping x86_64: the host is $(uname -m)"
+fi
+
+# what bin/compiler $flags makes of source when run as target, into $OUT/got
+run() {
+    case $1 in
+    run)
+        bin/compiler $2 --run -S $3 -o $OUT/got ;;
+    mips)
+        bin/compiler $2 -S $3 -o $OUT/prog.s && $MIPS_CC -static -o $OUT/prog $OUT/prog.s \
+            && $MIPS_RUN $OUT/prog > $OUT/got ;;
+    x86_64)
+        bin/compiler $2 --target=x86_64 -S $3 -o $OUT/prog.s && $CC -o $OUT/prog $OUT/prog.s \
+            && $OUT/prog > $OUT/got ;;
+    esac
+}
+
+status=0
+passed=0
+for dir in test/*/; do
+    source=$(ls $dir*.txt | grep -v MIPS.txt)
+    $CC -w -o $OUT/ref $dir/cREF.c && $OUT/ref > $OUT/want || { status=1; continue; }
+    for target in $targets; do
+        for opt in -O0 -O -O2; do
+            flags=$([ $opt == -O0 ] || echo $opt)
+            if ! run $target "$flags" $source; then
+                echo "$source $target $opt: failed to build or run"
+                status=1
+            elif ! diff $OUT/want $OUT/got > $OUT/diff; then
+                echo "$source $target $opt: output differs from $dir""cREF.c"
+                head -20 $OUT/diff
+                status=1
+            else
+                passed=$((passed + 1))
+            fi
+        done
+    done
+done
+echo "$passed passed"
+exit $status